@@ -0,0 +1,325 @@
+#include "../inc/tftp.hpp"
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <iomanip>
+#include <random>
+#include <sstream>
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+
+// Loopback throughput benchmark: serves generated files from an in-process server on an ephemeral port
+// and sweeps blksize x file size x concurrency, one machine-readable line per combination.
+//
+//   tftp_bench [--blksize 512,1428,8192] [--sizes 64K,1M,16M] [--concurrency 1,4,16] [--repeat 4]
+//              [--direction recv,send] [--server engine|thread] [--workers 1] [--window 16] [--io-uring]
+//              [--cache 256M] [--open-files n] [--format json|csv]
+//
+// Latencies are per transfer (request to last byte), throughput is all bytes over the wall time of a run,
+// CPU time covers the whole process - client and server side together.
+
+namespace fs = std::filesystem;
+
+namespace {
+    struct Options {
+        std::vector<uint16_t> blksizes = { 512, 1428, 8192 };
+        std::vector<size_t> sizes = { 64 << 10, 1 << 20, 16 << 20 };
+        std::vector<size_t> concurrency = { 1, 4, 16 };
+        std::vector<std::string> directions = { "recv", "send" };
+        size_t repeat = 4;          // transfers per client thread
+        uint16_t window = 16;
+        bool io_uring = false;
+        size_t cache = 0;           // server file cache, bytes
+        size_t open_files = 0;      // server open file cache, entries
+        bool engine = true;         // Server::run event loop, otherwise thread-per-transfer handleClient
+        size_t workers = 1;         // engine's SO_REUSEPORT shards, 0 - one per core
+        bool csv = false;
+    };
+
+    struct Result {
+        std::string direction;
+        uint16_t blksize;
+        size_t file_size;
+        size_t concurrency;
+        size_t transfers;
+        size_t errors;
+        double seconds;
+        double p50_ms;
+        double p99_ms;
+        double cpu_seconds;
+    };
+
+    // swallows everything, recv benchmarks shouldn't measure the memory allocator
+    class NullBuffer : public std::streambuf {
+    protected:
+        std::streamsize xsputn(const char*, std::streamsize n) override { return n; }
+        int_type overflow(int_type c) override { return traits_type::not_eof(c); }
+    };
+
+    double cpuSeconds() {
+    #ifdef _WIN32
+        FILETIME creation, exit, kernel, user;
+        GetProcessTimes(GetCurrentProcess(), &creation, &exit, &kernel, &user);
+        auto seconds = [](const FILETIME& ft) { return ((static_cast<uint64_t>(ft.dwHighDateTime) << 32) | ft.dwLowDateTime) / 1e7; };
+        return seconds(kernel) + seconds(user);
+    #else
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+    #endif
+    }
+
+    size_t parseSize(const std::string& text) {
+        size_t pos;
+        size_t value = std::stoull(text, &pos);
+        switch (pos < text.size() ? std::toupper(static_cast<unsigned char>(text[pos])) : 0) {
+            case 'G': return value << 30;
+            case 'M': return value << 20;
+            case 'K': return value << 10;
+            default: return value;
+        }
+    }
+
+    template <typename T, typename F>
+    std::vector<T> parseList(const std::string& text, F parse) {
+        std::vector<T> values;
+        std::istringstream iss(text);
+        std::string item;
+        while (std::getline(iss, item, ',')) {
+            if (!item.empty()) values.push_back(static_cast<T>(parse(item)));
+        }
+        return values;
+    }
+
+    // nearest rank, sorted input
+    double percentile(const std::vector<double>& sorted, double p) {
+        if (sorted.empty()) return 0;
+        size_t rank = static_cast<size_t>(std::ceil(p / 100 * sorted.size()));
+        return sorted[std::min(sorted.size(), std::max<size_t>(rank, 1)) - 1];
+    }
+
+    void writeData(const fs::path& path, size_t size) {
+        std::mt19937_64 rng(size);
+        std::vector<uint64_t> chunk(8192);
+        std::ofstream ofs(path, std::ios::binary);
+        for (size_t left = size; left > 0;) {
+            for (auto& word : chunk) word = rng();
+            size_t len = std::min(left, chunk.size() * sizeof(uint64_t));
+            ofs.write(reinterpret_cast<const char*>(chunk.data()), static_cast<std::streamsize>(len));
+            left -= len;
+        }
+    }
+
+    std::string dataName(size_t size) {
+        return "data_" + std::to_string(size);
+    }
+
+    Result runOne(const std::string& remote, const fs::path& root, const std::string& direction, uint16_t blksize, size_t file_size, size_t concurrency, size_t repeat) {
+        tftp::Config::getInstance().setBlockSize(blksize);
+
+        std::mutex mutex;
+        std::vector<double> latencies;
+        size_t errors = 0;
+
+        double cpu_start = cpuSeconds();
+        auto start = std::chrono::steady_clock::now();
+
+        std::vector<std::thread> clients;
+        for (size_t c = 0; c < concurrency; c++) {
+            clients.emplace_back([&, c] {
+                for (size_t r = 0; r < repeat; r++) {
+                    bool ok = true;
+                    auto begin = std::chrono::steady_clock::now();
+                    try {
+                        if (direction == "recv") {
+                            NullBuffer null_buffer;
+                            std::ostream sink(&null_buffer);
+                            ok = tftp::Client::recv(remote, dataName(file_size), sink) == static_cast<std::streamsize>(file_size);
+                        } else {
+                            std::ifstream source(root / dataName(file_size), std::ios::binary);
+                            tftp::Client::send(remote, "upload_" + std::to_string(c), source);
+                        }
+                    } catch (const tftp::TftpError& e) {
+                        std::ostringstream err;
+                        err << e;
+                        std::lock_guard<std::mutex> lock(mutex);
+                        std::cerr << direction << " failed: " << err.str() << std::endl;
+                        ok = false;
+                    }
+                    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+
+                    std::lock_guard<std::mutex> lock(mutex);
+                    if (ok) latencies.push_back(ms);
+                    else errors++;
+                }
+            });
+        }
+        for (auto& t : clients) t.join();
+
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        double cpu_seconds = cpuSeconds() - cpu_start;
+        std::sort(latencies.begin(), latencies.end());
+
+        return Result { direction, blksize, file_size, concurrency, latencies.size(), errors, seconds,
+                        percentile(latencies, 50), percentile(latencies, 99), cpu_seconds };
+    }
+
+    void print(const Result& r, const Options& options) {
+        double bytes = static_cast<double>(r.file_size) * r.transfers;
+        double mb_per_s = r.seconds > 0 ? bytes / 1e6 / r.seconds : 0;
+        double cpu_per_gb = bytes > 0 ? r.cpu_seconds / (bytes / 1e9) : 0;
+        const char* server = options.engine ? "engine" : "thread";
+
+        std::ostringstream line;
+        line << std::fixed << std::setprecision(3);
+        if (options.csv) {
+            line << server << ',' << r.direction << ',' << r.blksize << ',' << options.window << ',' << r.file_size << ','
+                 << r.concurrency << ',' << r.transfers << ',' << r.errors << ',' << r.seconds << ',' << mb_per_s << ','
+                 << r.p50_ms << ',' << r.p99_ms << ',' << cpu_per_gb;
+        } else {
+            line << "{\"server\":\"" << server << "\",\"direction\":\"" << r.direction << "\",\"blksize\":" << r.blksize
+                 << ",\"window\":" << options.window << ",\"file_size\":" << r.file_size << ",\"concurrency\":" << r.concurrency
+                 << ",\"transfers\":" << r.transfers << ",\"errors\":" << r.errors << ",\"seconds\":" << r.seconds
+                 << ",\"mb_per_s\":" << mb_per_s << ",\"p50_ms\":" << r.p50_ms << ",\"p99_ms\":" << r.p99_ms
+                 << ",\"cpu_s_per_gb\":" << cpu_per_gb << "}";
+        }
+        std::cout << line.str() << std::endl;
+    }
+
+    void usage() {
+        std::cerr << "usage: tftp_bench [--blksize list] [--sizes list] [--concurrency list] [--repeat n] [--direction recv,send]" << std::endl
+                  << "                  [--server engine|thread] [--workers n] [--window n] [--io-uring] [--cache size] [--open-files n]" << std::endl
+                  << "                  [--format json|csv]" << std::endl;
+    }
+}
+
+int main(int argc, char** argv) {
+    Options options;
+    try {
+        for (int i = 1; i < argc; i++) {
+            std::string arg = argv[i];
+            auto value = [&]() -> std::string {
+                if (i + 1 >= argc) throw std::invalid_argument(arg + " needs a value");
+                return argv[++i];
+            };
+
+            if (arg == "--blksize") options.blksizes = parseList<uint16_t>(value(), [](const std::string& s) { return std::stoul(s); });
+            else if (arg == "--sizes") options.sizes = parseList<size_t>(value(), parseSize);
+            else if (arg == "--concurrency") options.concurrency = parseList<size_t>(value(), [](const std::string& s) { return std::stoul(s); });
+            else if (arg == "--repeat") options.repeat = std::stoul(value());
+            else if (arg == "--direction") options.directions = parseList<std::string>(value(), [](const std::string& s) { return s; });
+            else if (arg == "--server") options.engine = value() != "thread";
+            else if (arg == "--workers") options.workers = std::stoul(value());
+            else if (arg == "--window") options.window = static_cast<uint16_t>(std::stoul(value()));
+            else if (arg == "--io-uring") options.io_uring = true;
+            else if (arg == "--cache") options.cache = parseSize(value());
+            else if (arg == "--open-files") options.open_files = std::stoul(value());
+            else if (arg == "--format") options.csv = value() == "csv";
+            else {
+                usage();
+                return arg == "--help" ? 0 : 2;
+            }
+        }
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        usage();
+        return 2;
+    }
+
+#ifdef _WIN32
+    WSADATA wsaData;
+    if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
+        std::cerr << "WSAStartup failed" << std::endl;
+        return 1;
+    }
+#endif
+
+    tftp::Config& config = tftp::Config::getInstance();
+    config.setWindowSize(options.window);
+    config.setIoUring(options.io_uring);
+    config.setCacheSize(static_cast<std::streamsize>(options.cache));
+    config.setOpenFileCacheSize(options.open_files);
+    config.setServerWorkers(options.workers);
+    config.setTimeout(1);
+
+    fs::path root = fs::temp_directory_path() / "tftp_bench";
+    fs::remove_all(root);
+    fs::create_directories(root);
+    for (size_t size : options.sizes) writeData(root / dataName(size), size);
+
+    size_t threads = *std::max_element(options.concurrency.begin(), options.concurrency.end());
+    std::atomic<bool> running(true);
+    std::vector<std::thread> server_threads;
+    std::unique_ptr<tftp::Server> server;
+    tftp::socket_t listen_sock = INVALID_SOCKET;
+    uint16_t port;
+
+    if (options.engine) {
+        server = std::make_unique<tftp::Server>(root.string(), 0);
+        port = server->getPort();
+        server_threads.emplace_back([&server] { server->run(); });
+    } else {
+        // handleClient serves one request per call, and a finished upload keeps its thread dallying for a timeout -
+        // two threads per client, so back to back requests don't queue behind that
+        listen_sock = socket(AF_INET, SOCK_DGRAM, 0);
+        struct sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t addr_len = sizeof(addr);
+        if (listen_sock == INVALID_SOCKET || bind(listen_sock, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+            getsockname(listen_sock, (struct sockaddr*)&addr, &addr_len) < 0) {
+            std::cerr << "Failed to set up listening socket" << std::endl;
+            return 1;
+        }
+        port = ntohs(addr.sin_port);
+
+    #ifdef _WIN32
+        const DWORD timeout = 200;
+    #else
+        const struct timeval timeout = { 0, 200000 };
+    #endif
+        setsockopt(listen_sock, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout));
+
+        for (size_t i = 0; i < 2 * threads; i++) {
+            server_threads.emplace_back([&] {
+                while (running) {
+                    try {
+                        tftp::Server::handleClient(listen_sock, root.string());
+                    } catch (const tftp::TftpError&) {
+                        // the client finds out too and counts it
+                    }
+                }
+            });
+        }
+    }
+
+    std::string remote = "127.0.0.1:" + std::to_string(port);
+    if (options.csv) std::cout << "server,direction,blksize,window,file_size,concurrency,transfers,errors,seconds,mb_per_s,p50_ms,p99_ms,cpu_s_per_gb" << std::endl;
+
+    size_t errors = 0;
+    for (const auto& direction : options.directions) {
+        for (uint16_t blksize : options.blksizes) {
+            for (size_t size : options.sizes) {
+                for (size_t concurrency : options.concurrency) {
+                    Result result = runOne(remote, root, direction, blksize, size, concurrency, options.repeat);
+                    print(result, options);
+                    errors += result.errors;
+                }
+            }
+        }
+    }
+
+    running = false;
+    if (server) server->stop();
+    for (auto& t : server_threads) t.join();
+#ifdef _WIN32
+    if (listen_sock != INVALID_SOCKET) closesocket(listen_sock);
+    WSACleanup();
+#else
+    if (listen_sock != INVALID_SOCKET) close(listen_sock);
+#endif
+
+    fs::remove_all(root);
+    return errors == 0 ? 0 : 1;
+}
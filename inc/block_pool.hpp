@@ -0,0 +1,51 @@
+#pragma once
+
+#include "tftp.hpp"
+#include <map>
+
+namespace tftp {
+    // Process-wide pool of block buffers, so transfers don't malloc, zero-fill and free every block.
+    // Buffers come in power-of-two size classes carved out of 2 MiB slabs (huge pages if Config asks for it)
+    // and go back to their class's free list when released. Slabs are never returned - the pool keeps its peak size.
+    class BlockPool {
+    public:
+        static constexpr size_t SlabSize = 2 << 20;
+
+        struct Deleter {
+            uint8_t size_class;
+            void operator()(uint8_t* buffer) const { BlockPool::getInstance().release(size_class, buffer); }
+        };
+        typedef std::unique_ptr<uint8_t[], Deleter> Buffer;
+
+        static BlockPool& getInstance() {
+            static BlockPool* instance = new BlockPool();   // never destroyed, buffers may come back during static destruction
+            return *instance;
+        }
+
+        // at least size bytes (up to SlabSize), contents are undefined
+        Buffer acquire(size_t size);
+
+        // slab a buffer was carved out of - index (in allocation order, stable) and start address.
+        // Lets io_uring register whole slabs as fixed buffers. False if ptr isn't from the pool.
+        bool findSlab(const uint8_t* ptr, size_t& index, uint8_t*& base);
+
+    private:
+        static constexpr uint8_t MinClass = 9;      // 512 B
+        static constexpr uint8_t MaxClass = 21;     // whole slab
+
+        struct SizeClass {
+            std::mutex mutex;
+            std::vector<uint8_t*> free;
+        };
+        SizeClass classes_[MaxClass - MinClass + 1];
+
+        std::mutex slabs_mutex_;
+        std::map<const uint8_t*, size_t> slabs_;    // start address -> index
+
+        BlockPool() = default;
+
+        void release(uint8_t size_class, uint8_t* buffer);
+        uint8_t* allocateSlab();
+        static uint8_t* allocateSlabMemory();
+    };
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+#include "tftp.hpp"
+#include "block_pool.hpp"
+
+#ifdef __linux__
+#include <netinet/udp.h>
+#include <sys/uio.h>
+
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+#endif
+
+namespace tftp {
+    // DATA packets for one peer, sent with as few syscalls as the platform allows -
+    // a single sendmmsg on linux, one send per datagram elsewhere.
+    // Payloads aren't copied and must stay valid until flush().
+    class SendBatch {
+    public:
+        static constexpr size_t MaxBatch = 64;
+
+        SendBatch() : count_(0) {}
+
+        size_t size() const { return count_; }
+        bool full() const { return count_ == MaxBatch; }
+        bool empty() const { return count_ == 0; }
+
+        void add(uint64_t block_num, const uint8_t* payload, size_t payload_len);
+
+        // sends everything queued and empties the batch. Returns how many datagrams went out,
+        // if that's less than were queued, getOsError() tells why the next one didn't.
+        size_t flush(socket_t sockfd, const struct sockaddr_in& addr);
+
+        // same, but runs of equally sized blocks go to the kernel as single UDP_SEGMENT (GSO) sends.
+        // If the kernel or route can't do it, offload is switched off and the rest is sent normally.
+        size_t flushSegmented(socket_t sockfd, const struct sockaddr_in& addr, bool& offload);
+
+    private:
+        uint8_t headers_[MaxBatch][4];
+        const uint8_t* payloads_[MaxBatch];
+        size_t lengths_[MaxBatch];
+        size_t count_;
+
+        size_t sendFrom(socket_t sockfd, const struct sockaddr_in& addr, size_t first);
+    };
+
+    // Receives whatever is pending on a socket, up to a batch of datagrams (possibly from different peers) at once -
+    // recvmmsg on linux, a single recvfrom elsewhere. Buffers come from the block pool and are reused for every batch.
+    // With offload, the kernel may hand over several coalesced datagrams (UDP_GRO) in one slot - they're split
+    // back up here, so data(i)/length(i) are always single datagrams.
+    class RecvBatch {
+    public:
+        static constexpr size_t OffloadSlotSize = 65536;    // a coalesced GRO packet can be up to 64K
+
+        RecvBatch(size_t slots, size_t slot_size, bool offload = false);
+
+        // asks the kernel to coalesce datagrams for this socket, false if it can't
+        static bool enableOffload(socket_t sockfd);
+
+        // number of datagrams received, -1 (see getOsError()) if there was nothing or receiving failed
+        int receive(socket_t sockfd);
+
+        uint8_t* data(size_t i) { return datagrams_[i].data; }
+        size_t length(size_t i) const { return datagrams_[i].len; }
+        const struct sockaddr_in& from(size_t i) const { return addrs_[datagrams_[i].slot]; }
+
+    private:
+        struct Datagram {
+            uint8_t* data;
+            size_t len;
+            size_t slot;
+        };
+
+        size_t slots_;
+        size_t slot_size_;
+        bool offload_;
+        BlockPool::Buffer buffer_;
+        std::vector<Datagram> datagrams_;
+        std::vector<struct sockaddr_in> addrs_;
+    #ifdef __linux__
+        std::vector<struct iovec> iovecs_;
+        std::vector<struct mmsghdr> msgs_;
+        std::vector<uint8_t> control_;
+    #endif
+
+        uint8_t* slot(size_t i) { return buffer_.get() + i * slot_size_; }
+    };
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include "tftp.hpp"
+#include "open_file_cache.hpp"
+#include <list>
+#include <unordered_map>
+#include <unordered_set>
+
+namespace tftp {
+    // Process-wide LRU cache of whole served files, bounded by Config::getCacheSize() bytes (0 disables it).
+    // Entries are checked against the file's size and mtime on every lookup and reloaded when it changed.
+    // Transfers hold on to the entry they serve from, so eviction never pulls memory out from under them.
+    // The server only looks files up; a miss is read on the ThreadPool while that request is served from disk.
+    class FileCache {
+    public:
+        struct Entry {
+            std::unique_ptr<uint8_t[]> data;    // nullptr for empty files
+            size_t size;
+            std::filesystem::file_time_type mtime;
+        };
+        typedef std::shared_ptr<const Entry> Handle;
+
+        static FileCache& getInstance() {
+            static FileCache* instance = new FileCache();   // never destroyed - loads on the pool may outlive main()
+            return *instance;
+        }
+
+        FileCache(const FileCache&) = delete;
+        FileCache& operator=(const FileCache&) = delete;
+
+        // contents of path, loaded on a miss - nullptr if caching is off, the file doesn't fit or can't be read.
+        // With file (path's OpenFileCache entry) nothing is asked of the file system on a hit.
+        Handle get(const std::filesystem::path& path, const OpenFileCache::Handle& file = nullptr);
+
+        // same, but never reads the file on the caller - a miss is loaded in the background and nullptr returned
+        Handle lookup(const std::filesystem::path& path, const OpenFileCache::Handle& file = nullptr);
+
+        void clear();
+        size_t getBytes();
+
+    private:
+        struct Slot {
+            Handle entry;
+            std::list<std::string>::iterator lru;
+        };
+
+        std::mutex mutex_;
+        std::list<std::string> lru_;        // most recently used first
+        std::unordered_map<std::string, Slot> entries_;
+        std::unordered_set<std::string> loading_;   // lookup() misses being read on the pool
+        size_t bytes_ = 0;
+
+        FileCache() = default;
+
+        static bool describe(const std::filesystem::path& path, const OpenFileCache::Handle& file, size_t& size, std::filesystem::file_time_type& mtime);
+        Handle find(const std::string& key, size_t size, std::filesystem::file_time_type mtime);
+        void insert(const std::string& key, const Handle& entry);
+        static Handle load(const std::filesystem::path& path, const OpenFileCache::Handle& file, size_t size, std::filesystem::file_time_type mtime);
+        void erase(std::unordered_map<std::string, Slot>::iterator it);
+    };
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include "tftp.hpp"
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#define TFTP_HAVE_IO_URING
+#include <linux/io_uring.h>
+
+namespace tftp {
+    // Minimal io_uring ring on raw syscalls (no liburing): one submission and one completion queue,
+    // owned by a single thread. Optional backend - see Config::setIoUring() and supported().
+    class IoUring {
+    public:
+        explicit IoUring(unsigned entries);
+        ~IoUring();
+
+        IoUring(const IoUring&) = delete;
+        IoUring& operator=(const IoUring&) = delete;
+
+        // kernel has io_uring and everything we rely on (wait timeouts, no dropped completions); checked once
+        static bool supported();
+
+        // zeroed SQE to fill in, nullptr if the submission queue is full (submit first)
+        struct io_uring_sqe* getSqe();
+        unsigned queued() const { return sqe_tail_ - submitted_; }
+
+        // submits what's queued and waits for at least wait_nr completions (up to timeout_ms, -1 waits forever).
+        // Returns false only on real errors - errno is kept.
+        bool submit(unsigned wait_nr = 0, int timeout_ms = -1);
+
+        // calls f(const io_uring_cqe&) for every completion available, returns how many there were
+        template <typename F>
+        unsigned reap(F f) {
+            unsigned head = *cq_head_;
+            unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+            unsigned count = 0;
+            for (; head != tail; head++, count++) f(cqes_[head & *cq_mask_]);
+            __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+            return count;
+        }
+
+        // fixed files/buffers: tables of n empty entries, filled in one by one
+        bool registerFiles(unsigned n);
+        bool updateFile(unsigned index, int fd);    // -1 clears the entry
+        bool registerBuffers(unsigned n);
+        bool updateBuffer(unsigned index, void* base, size_t len);
+
+    private:
+        int ring_fd_;
+        unsigned features_;
+
+        void* sq_ring_;
+        size_t sq_ring_size_;
+        void* cq_ring_;
+        size_t cq_ring_size_;
+        struct io_uring_sqe* sqes_;
+        size_t sqes_size_;
+
+        unsigned* sq_head_;
+        unsigned* sq_tail_;
+        unsigned* sq_mask_;
+        unsigned* sq_array_;
+        unsigned sq_entries_;
+        unsigned sqe_tail_;     // SQEs handed out
+        unsigned submitted_;    // SQEs the kernel has taken
+
+        unsigned* cq_head_;
+        unsigned* cq_tail_;
+        unsigned* cq_mask_;
+        struct io_uring_cqe* cqes_;
+
+        void release();
+    };
+}
+#endif
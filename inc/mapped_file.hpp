@@ -0,0 +1,32 @@
+#pragma once
+
+#include "tftp.hpp"
+
+namespace tftp {
+    // Read-only mapping of a whole file. Served blocks are sent straight out of it, no copies and no reads.
+    // The file must not be truncated while mapped - accessing pages past the new end raises SIGBUS. The server's own
+    // uploads never truncate (they're renamed over the old file), outside writers are why Config::setMappedReads() is opt-in.
+    class MappedFile {
+    public:
+        MappedFile() = default;
+        ~MappedFile() { unmap(); }
+
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+
+        // false if path isn't a regular file or can't be mapped
+        bool map(const std::filesystem::path& path);
+        // size bytes of an already open regular file, the descriptor stays the caller's. POSIX only, false elsewhere.
+        bool map(int fd, size_t size);
+        void unmap();
+
+        bool isMapped() const { return mapped_; }
+        const uint8_t* data() const { return data_; }
+        size_t size() const { return size_; }
+
+    private:
+        const uint8_t* data_ = nullptr;     // nullptr for empty files
+        size_t size_ = 0;
+        bool mapped_ = false;
+    };
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include "tftp.hpp"
+#include <list>
+#include <unordered_map>
+
+namespace tftp {
+    // Process-wide cache of what a read needs before its first block: whether there's a regular file under a name,
+    // its size and mtime, and a read-only descriptor to it. Holds up to Config::getOpenFileCacheSize() paths (0 disables it).
+    // Entries are kept current through inotify watches on every directory from the served root down to theirs,
+    // so a hit costs a hash lookup and one non-blocking read of the event queue instead of a string of stats and opens.
+    // Misses are remembered too, until something shows up under that name. Linux only - elsewhere get() returns nullptr.
+    class OpenFileCache {
+    public:
+        struct Entry {
+            int fd = -1;        // -1 - nothing readable under that name
+            size_t size = 0;
+            std::filesystem::file_time_type mtime;
+
+            Entry() = default;
+            ~Entry();
+            Entry(const Entry&) = delete;
+            Entry& operator=(const Entry&) = delete;
+
+            // positioned, the descriptor is shared by every transfer of the file - short only at the end
+            size_t read(uint8_t* buffer, size_t len, uint64_t offset) const;
+        };
+        typedef std::shared_ptr<const Entry> Handle;
+
+        static OpenFileCache& getInstance() {
+            static OpenFileCache instance;
+            return instance;
+        }
+
+        OpenFileCache(const OpenFileCache&) = delete;
+        OpenFileCache& operator=(const OpenFileCache&) = delete;
+
+        // path under root, opened on a miss - nullptr if the cache is off or path can't be kept current
+        // (a symlink, an unwatchable directory, out of descriptors), callers go to the file system then
+        Handle get(const std::filesystem::path& root, const std::filesystem::path& path);
+
+        void clear();
+        size_t size();
+
+    private:
+        struct Slot {
+            Handle entry;
+            std::list<std::string>::iterator lru;
+        };
+
+        std::mutex mutex_;
+        int inotify_fd_;
+        std::unordered_map<int, std::vector<std::string>> watches_;    // directories a watch stands for - more than one through symlinks
+        std::unordered_map<std::string, int> watched_;
+        std::list<std::string> lru_;        // most recently used first
+        std::unordered_map<std::string, Slot> entries_;
+
+        OpenFileCache();
+        ~OpenFileCache();
+
+        void drain();
+        bool watch(const std::filesystem::path& dir);
+        bool watchTree(const std::filesystem::path& root, const std::filesystem::path& dir);
+        void flush();
+        static Handle open(const std::string& path);
+        void erase(std::unordered_map<std::string, Slot>::iterator it);
+    };
+}
@@ -0,0 +1,101 @@
+#pragma once
+
+#include "tftp.hpp"
+#include <charconv>
+#include <string_view>
+#include <type_traits>
+
+namespace tftp {
+    // Decoding and encoding of the control packets (RRQ/WRQ, OACK, ERROR) without going through std::string.
+    // Decoders check a received datagram in place and hand out views into it, valid as long as the buffer is;
+    // nothing is allocated for a packet that turns out to be garbage. Numbers go through from_chars/to_chars.
+
+    struct RequestView {
+        TftpOpcode opcode;
+        std::string_view filename;
+        std::string_view mode;
+        std::string_view options;   // name\0value\0 pairs, see forEachOption()
+    };
+
+    struct ErrorView {
+        uint16_t code;
+        std::string_view message;
+    };
+
+    // largest request accepted - RFC 2347 caps one at 512 bytes, RFC 1350 peers stay within a default DATA datagram
+    constexpr size_t MaxRequestSize = 516;
+
+    // false unless it's an RRQ/WRQ with every field NUL terminated
+    bool decodeRequest(const uint8_t* buffer, size_t len, RequestView& request);
+
+    // false unless it's an OACK with every field NUL terminated
+    bool decodeOack(const uint8_t* buffer, size_t len, std::string_view& options);
+
+    // false unless it's an ERROR. The message runs up to its NUL or, from sloppy peers, the end of the packet.
+    bool decodeError(const uint8_t* buffer, size_t len, ErrorView& error);
+
+    // calls fn(name, value) for every pair, false if the list is cut short
+    template <typename Fn>
+    bool forEachOption(std::string_view options, Fn&& fn) {
+        while (!options.empty()) {
+            size_t name_end = options.find('\0');
+            size_t value_end = name_end == std::string_view::npos ? name_end : options.find('\0', name_end + 1);
+            if (value_end == std::string_view::npos) return false;
+
+            fn(options.substr(0, name_end), options.substr(name_end + 1, value_end - name_end - 1));
+            options.remove_prefix(value_end + 1);
+        }
+        return true;
+    }
+
+    // option names are case insensitive (RFC 2347)
+    bool optionIs(std::string_view name, std::string_view option);
+
+    // plain decimal digits and nothing else - no sign, no spaces, no trailing garbage, no overflow
+    template <typename T>
+    bool parseNumber(std::string_view text, T& value) {
+        if (text.empty() || text[0] < '0' || text[0] > '9') return false;
+        auto result = std::from_chars(text.data(), text.data() + text.size(), value);
+        return result.ec == std::errc() && result.ptr == text.data() + text.size();
+    }
+
+    // reads negotiated values out of an OACK, options the server didn't acknowledge fall back to RFC defaults
+    void parseOack(const uint8_t* buffer, int32_t len, uint16_t& blksize_val, uint16_t& windowsize_val, std::streamsize& tsize_val,
+                   std::string* multicast_val = nullptr, std::streamsize* offset_val = nullptr);
+
+    // Builds a packet straight into buffer. Strings and numbers are NUL terminated as the RFCs want; anything that
+    // doesn't fit isn't written and leaves ok() false, so a caller checks once at the end.
+    class PacketWriter {
+    public:
+        PacketWriter(uint8_t* buffer, size_t capacity) : buffer_(buffer), capacity_(capacity), len_(0), ok_(true) {}
+
+        PacketWriter& opcode(TftpOpcode opcode) { return word(static_cast<uint16_t>(opcode)); }
+
+        // network order, for block numbers and error codes
+        PacketWriter& word(uint16_t value);
+
+        PacketWriter& string(std::string_view text);
+
+        template <typename T, typename = std::enable_if_t<std::is_integral_v<T>>>
+        PacketWriter& number(T value) {
+            char digits[24];
+            auto result = std::to_chars(digits, digits + sizeof(digits), value);
+            return string(std::string_view(digits, static_cast<size_t>(result.ptr - digits)));
+        }
+
+        PacketWriter& option(std::string_view name, std::string_view value) { return string(name).string(value); }
+
+        template <typename T, typename = std::enable_if_t<std::is_integral_v<T>>>
+        PacketWriter& option(std::string_view name, T value) { return string(name).number(value); }
+
+        size_t size() const { return len_; }
+        size_t room() const { return capacity_ - len_; }
+        bool ok() const { return ok_; }
+
+    private:
+        uint8_t* buffer_;
+        size_t capacity_;
+        size_t len_;
+        bool ok_;
+    };
+}
@@ -0,0 +1,241 @@
+#pragma once
+
+#include "tftp.hpp"
+#include "io_uring.hpp"
+
+#ifdef _WIN32
+#include <unordered_map>
+#elif defined(__linux__)
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <unordered_map>
+#else
+#include <fcntl.h>
+#include <poll.h>
+#include <unordered_map>
+#endif
+
+namespace tftp {
+    // Readiness notification for many sockets at once - epoll on linux, poll()/WSAPoll() elsewhere.
+    // Every registered socket carries a 64-bit token, which is handed back when the socket becomes readable.
+    // With Config::setIoUring() linux uses multishot io_uring polls instead of epoll - only the waiting goes through
+    // the ring, the sockets' owners still send and receive with sendmmsg/recvmmsg. add() and remove() just queue
+    // a request that goes to the kernel with the next wait(), so a transfer costs no syscalls of its own for them.
+    class Poller {
+    public:
+        struct Event {
+            uint64_t token;
+        };
+
+        Poller() {
+        #if defined(__linux__)
+        #ifdef TFTP_HAVE_IO_URING
+            if (Config::getInstance().getIoUring() && IoUring::supported()) {
+                try {
+                    ring_ = std::make_unique<IoUring>(RingEntries);
+                    return;
+                } catch (const TftpError&) {
+                    ring_.reset();      // e.g. locked memory limit - epoll it is
+                }
+            }
+        #endif
+            epfd_ = epoll_create1(EPOLL_CLOEXEC);
+            if (epfd_ < 0) throw TftpError(TftpError::ErrorType::OS, getOsError(), "Failed to create epoll instance");
+        #endif
+        }
+
+        ~Poller() {
+        #if defined(__linux__)
+            if (epfd_ >= 0) close(epfd_);
+        #endif
+        }
+
+        Poller(const Poller&) = delete;
+        Poller& operator=(const Poller&) = delete;
+
+        void add(socket_t sockfd, uint64_t token) {
+        #if defined(__linux__)
+        #ifdef TFTP_HAVE_IO_URING
+            if (ring_) {
+                Watch watch { sockfd, token };
+                uint64_t id = next_id_++;
+                watches_[id] = watch;
+                ids_[sockfd] = id;
+                arm(id, watch);
+                return;
+            }
+        #endif
+            struct epoll_event ev = {};
+            ev.events = EPOLLIN;
+            ev.data.u64 = token;
+            if (epoll_ctl(epfd_, EPOLL_CTL_ADD, sockfd, &ev) < 0)
+                throw TftpError(TftpError::ErrorType::OS, getOsError(), "Failed to register socket");
+        #else
+            index_[sockfd] = fds_.size();
+            fds_.push_back({ sockfd, POLLIN, 0 });
+            tokens_.push_back(token);
+        #endif
+        }
+
+        void remove(socket_t sockfd) {
+        #if defined(__linux__)
+        #ifdef TFTP_HAVE_IO_URING
+            if (ring_) {
+                auto it = ids_.find(sockfd);
+                if (it == ids_.end()) return;
+
+                uint64_t id = it->second;
+                ids_.erase(it);
+                watches_.erase(id);
+
+                // goes out with the next wait(); whatever the old poll still reports is dropped by id
+                struct io_uring_sqe* sqe = getSqe();
+                sqe->opcode = IORING_OP_POLL_REMOVE;
+                sqe->fd = -1;
+                sqe->addr = id;
+                return;
+            }
+        #endif
+            epoll_ctl(epfd_, EPOLL_CTL_DEL, sockfd, nullptr);
+        #else
+            auto it = index_.find(sockfd);
+            if (it == index_.end()) return;
+
+            size_t idx = it->second;
+            index_.erase(it);
+            if (idx != fds_.size() - 1) {
+                fds_[idx] = fds_.back();
+                tokens_[idx] = tokens_.back();
+                index_[fds_[idx].fd] = idx;
+            }
+            fds_.pop_back();
+            tokens_.pop_back();
+        #endif
+        }
+
+        // waits up to timeout_ms (-1 - forever) and fills events, returns number of ready sockets
+        size_t wait(std::vector<Event>& events, int timeout_ms) {
+        #if defined(__linux__)
+        #ifdef TFTP_HAVE_IO_URING
+            if (ring_) return waitRing(events, timeout_ms);
+        #endif
+            raw_.resize(events.size());
+            int n = epoll_wait(epfd_, raw_.data(), static_cast<int>(raw_.size()), timeout_ms);
+            if (n < 0) {
+                if (getOsError() == EINTR) return 0;
+                throw TftpError(TftpError::ErrorType::OS, getOsError(), "Failed to wait for events");
+            }
+            for (int i = 0; i < n; i++) events[i].token = raw_[i].data.u64;
+            return static_cast<size_t>(n);
+        #else
+            if (fds_.empty()) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(timeout_ms < 0 ? 100 : timeout_ms));
+                return 0;
+            }
+        #ifdef _WIN32
+            int n = WSAPoll(fds_.data(), static_cast<ULONG>(fds_.size()), timeout_ms);
+        #else
+            int n = poll(fds_.data(), fds_.size(), timeout_ms);
+        #endif
+            if (n < 0) {
+                if (getOsError() == EINTR) return 0;
+                throw TftpError(TftpError::ErrorType::OS, getOsError(), "Failed to wait for events");
+            }
+            size_t count = 0;
+            for (size_t i = 0; i < fds_.size() && count < events.size(); i++) {
+                if (fds_[i].revents != 0) events[count++].token = tokens_[i];
+            }
+            return count;
+        #endif
+        }
+
+    private:
+    #if defined(__linux__)
+        int epfd_ = -1;
+        std::vector<struct epoll_event> raw_;
+
+    #ifdef TFTP_HAVE_IO_URING
+        static constexpr unsigned RingEntries = 256;
+
+        // A multishot poll is armed once per socket, a fixed file would save next to nothing - and registering
+        // one is a syscall of its own, on every transfer's way in and out.
+        struct Watch {
+            socket_t fd;
+            uint64_t token;
+        };
+
+        std::unique_ptr<IoUring> ring_;
+        std::unordered_map<uint64_t, Watch> watches_;  // by poll id (user_data of the poll request)
+        std::unordered_map<socket_t, uint64_t> ids_;
+        std::vector<uint64_t> ready_;   // ids reaped but not handed out yet
+        uint64_t next_id_ = 1;          // 0 - requests whose completions we don't care about
+        bool multishot_ = true;
+
+        struct io_uring_sqe* getSqe() {
+            struct io_uring_sqe* sqe = ring_->getSqe();
+            if (sqe == nullptr) {
+                ring_->submit();
+                sqe = ring_->getSqe();
+                if (sqe == nullptr) throw TftpError(TftpError::ErrorType::OS, EBUSY, "io_uring submission queue full");
+            }
+            return sqe;
+        }
+
+        void arm(uint64_t id, const Watch& watch) {
+            struct io_uring_sqe* sqe = getSqe();
+            sqe->opcode = IORING_OP_POLL_ADD;
+            sqe->fd = watch.fd;
+            sqe->poll32_events = POLLIN;
+            sqe->len = multishot_ ? IORING_POLL_ADD_MULTI : 0;  // multishot stays armed across events
+            sqe->user_data = id;
+        }
+
+        size_t waitRing(std::vector<Event>& events, int timeout_ms) {
+            // only block when there's nothing left over from the last round
+            bool ok = ready_.empty() ? ring_->submit(1, timeout_ms) : (ring_->queued() == 0 || ring_->submit());
+            if (!ok) throw TftpError(TftpError::ErrorType::OS, getOsError(), "Failed to wait for events");
+
+            ring_->reap([this](const struct io_uring_cqe& cqe) {
+                auto it = watches_.find(cqe.user_data);
+                if (it == watches_.end()) return;   // removed since, or a POLL_REMOVE completion
+
+                if (cqe.res == -EINVAL && multishot_) {
+                    multishot_ = false;             // kernel without multishot poll
+                    arm(it->first, it->second);
+                    return;
+                }
+
+                // errors are reported as readable too, the socket's owner finds out what's wrong on recv
+                ready_.push_back(it->first);
+                if (cqe.res >= 0 && !(cqe.flags & IORING_CQE_F_MORE)) arm(it->first, it->second);
+            });
+
+            size_t taken = std::min(ready_.size(), events.size());
+            size_t count = 0;
+            for (size_t i = 0; i < taken; i++) {
+                auto it = watches_.find(ready_[i]);
+                if (it != watches_.end()) events[count++].token = it->second.token;
+            }
+            ready_.erase(ready_.begin(), ready_.begin() + static_cast<std::ptrdiff_t>(taken));
+            return count;
+        }
+    #endif
+    #else
+        std::vector<struct pollfd> fds_;
+        std::vector<uint64_t> tokens_;
+        std::unordered_map<socket_t, size_t> index_;
+    #endif
+    };
+
+    inline void setNonBlocking(socket_t sockfd) {
+    #ifdef _WIN32
+        u_long mode = 1;
+        if (ioctlsocket(sockfd, FIONBIO, &mode) != 0)
+    #else
+        int flags = fcntl(sockfd, F_GETFL, 0);
+        if (flags < 0 || fcntl(sockfd, F_SETFL, flags | O_NONBLOCK) < 0)
+    #endif
+            throw TftpError(TftpError::ErrorType::OS, getOsError(), "Failed to make socket non-blocking");
+    }
+}
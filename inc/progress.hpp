@@ -0,0 +1,32 @@
+#pragma once
+
+#include "tftp.hpp"
+
+namespace tftp {
+    // When a transfer loop reports progress - there's no thread per transfer, the loop asks after every
+    // batch of packets or timeout. Due once callback_interval has passed since the last report, or as soon as
+    // another byte_interval bytes went through (0 - time only).
+    class ProgressThrottle {
+    public:
+        typedef std::chrono::steady_clock clock;
+
+        ProgressThrottle(std::chrono::milliseconds interval, uint64_t byte_interval)
+            : interval_(interval), byte_interval_(byte_interval), next_report_(clock::now() + interval), next_bytes_(byte_interval) {}
+
+        bool due(uint64_t transferred, clock::time_point now = clock::now()) {
+            if (now < next_report_ && (byte_interval_ == 0 || transferred < next_bytes_)) return false;
+            next_report_ = now + interval_;
+            next_bytes_ = transferred + byte_interval_;
+            return true;
+        }
+
+        // latest a loop should wake up at, for the time threshold
+        clock::time_point deadline() const { return next_report_; }
+
+    private:
+        std::chrono::milliseconds interval_;
+        uint64_t byte_interval_;
+        clock::time_point next_report_;
+        uint64_t next_bytes_;
+    };
+}
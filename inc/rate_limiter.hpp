@@ -0,0 +1,63 @@
+#pragma once
+
+#include "tftp.hpp"
+#include <map>
+#include <set>
+
+namespace tftp {
+    // Process-wide pacing of the DATA the server sends, against token buckets: one for everything
+    // (Config::getRateLimit()) and one per client address or subnet (getClientRateLimit(), getClientRatePrefix()).
+    // While a bucket is dry the transfers waiting on it get its tokens in start-time fair queueing order - least sent
+    // relative to their weight first, not whoever asks first - so a boot file isn't stuck behind a multi-GB image.
+    // Files up to getRateSmallFile() weigh SmallFileWeight times more and get their few blocks out quickly.
+    class RateLimiter {
+    public:
+        typedef std::chrono::steady_clock clock;
+
+        static constexpr double SmallFileWeight = 8;
+        static constexpr std::chrono::milliseconds BurstTime{20};     // bucket depth, in time at its rate
+
+        class Flow;
+        struct Closer {
+            void operator()(Flow* flow) const { RateLimiter::getInstance().close(flow); }
+        };
+        typedef std::unique_ptr<Flow, Closer> Handle;
+
+        static RateLimiter& getInstance() {
+            static RateLimiter* instance = new RateLimiter();   // never destroyed, transfers may close flows during static destruction
+            return *instance;
+        }
+
+        RateLimiter(const RateLimiter&) = delete;
+        RateLimiter& operator=(const RateLimiter&) = delete;
+
+        // a transfer of total_bytes to client - nullptr if no limit is set, there's nothing to pace
+        Handle open(const struct sockaddr_in& client, std::streamsize total_bytes);
+
+        // how many packets of unit bytes the flow may send now, up to wanted. Fewer (maybe none) - ask again at retry_at.
+        size_t acquire(Flow& flow, size_t wanted, size_t unit, clock::time_point& retry_at, clock::time_point now = clock::now());
+
+    private:
+        struct Bucket {
+            double rate = 0;            // bytes per second, 0 - unlimited
+            double tokens = 0;
+            clock::time_point refilled;
+            std::set<std::pair<double, Flow*>> waiting;     // by start tag
+            size_t flows = 0;           // per client buckets go away with their last flow
+        };
+
+        std::mutex mutex_;
+        Bucket global_;
+        std::map<uint32_t, Bucket> clients_;
+        double virtual_time_ = 0;       // start tag of the last grant
+
+        RateLimiter() = default;
+
+        void close(Flow* flow);
+        void setRate(Bucket& bucket, double rate, clock::time_point now);
+        void refill(Bucket& bucket, size_t unit, clock::time_point now);
+        double startTag(const Flow& flow) const;
+        void wait(Flow& flow, Bucket& bucket);
+        void unwait(Flow& flow);
+    };
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include "tftp.hpp"
+#include <algorithm>
+
+namespace tftp {
+    // Retransmission timeout from measured round trips - smoothed RTT plus four times its variance (RFC 6298),
+    // doubled on every timeout. Starts at the negotiated timeout and never goes above it, so a peer that
+    // only knows the RFC 2349 value is never rushed. Karn's rule is up to the caller: an exchange that had
+    // to be retransmitted mustn't be sampled.
+    class RtoEstimator {
+    public:
+        typedef std::chrono::microseconds duration;
+        static constexpr duration MinTimeout = std::chrono::milliseconds(20);  // scheduling jitter, not the network
+        static constexpr duration Granularity = std::chrono::milliseconds(1);
+
+        RtoEstimator(duration timeout, bool adaptive)
+            : max_(timeout), rto_(timeout), srtt_(0), rttvar_(0), adaptive_(adaptive) {}
+
+        duration get() const { return rto_; }
+
+        void sample(duration rtt) {
+            if (!adaptive_) return;
+            if (srtt_.count() == 0) {
+                srtt_ = std::max(rtt, duration(1));
+                rttvar_ = srtt_ / 2;
+            } else {
+                duration err = rtt > srtt_ ? rtt - srtt_ : srtt_ - rtt;
+                rttvar_ = (rttvar_ * 3 + err) / 4;
+                srtt_ = (srtt_ * 7 + rtt) / 8;
+            }
+            rto_ = std::min(std::max(srtt_ + std::max(Granularity, rttvar_ * 4), MinTimeout), max_);
+        }
+
+        // timed out - false if the timer was already at the negotiated timeout. Only those count
+        // against max_retries, the quick retransmissions on the way up are free.
+        bool backoff() {
+            if (rto_ >= max_) return false;
+            rto_ = std::min(rto_ * 2, max_);
+            return true;
+        }
+
+    private:
+        duration max_;
+        duration rto_;
+        duration srtt_;
+        duration rttvar_;
+        bool adaptive_;
+    };
+}
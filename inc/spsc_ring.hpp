@@ -0,0 +1,105 @@
+#pragma once
+
+#include "tftp.hpp"
+#include <condition_variable>
+
+namespace tftp {
+    // Bounded single-producer/single-consumer ring of reusable slots.
+    // Both ends are lock-free while there's room/data; a side that has to wait parks on a condition
+    // variable instead of spinning, and is only woken when the other side sees it parked.
+    // The consumer may look ahead (peek(i)) and release slots later, e.g. once a block is ACKed.
+    template <typename T>
+    class SpscRing {
+    public:
+        explicit SpscRing(size_t capacity)
+            : slots_(capacity), head_(0), tail_(0), closed_(false), producer_parked_(false), consumer_parked_(false) {}
+
+        SpscRing(const SpscRing&) = delete;
+        SpscRing& operator=(const SpscRing&) = delete;
+
+        size_t capacity() const { return slots_.size(); }
+
+        // producer: next free slot, waits while the ring is full - nullptr once closed
+        T* acquire() {
+            if (closed_) return nullptr;
+            size_t tail = tail_.load(std::memory_order_relaxed);
+            if (!waitFor(producer_parked_, [&] { return tail - head_.load() < slots_.size(); })) return nullptr;
+            return &slots_[tail % slots_.size()];
+        }
+
+        // producer: next free slot without waiting - nullptr while the ring is full or once it's closed
+        T* tryAcquire() {
+            size_t tail = tail_.load(std::memory_order_relaxed);
+            if (closed_ || tail - head_.load() >= slots_.size()) return nullptr;
+            return &slots_[tail % slots_.size()];
+        }
+
+        // producer: hands the slot returned by acquire() over to the consumer
+        void publish() {
+            tail_.fetch_add(1, std::memory_order_seq_cst);
+            wake(consumer_parked_);
+        }
+
+        // consumer: i-th unreleased slot, waits until it's published - nullptr once closed and nothing's left
+        T* peek(size_t i = 0) {
+            size_t head = head_.load(std::memory_order_relaxed);
+            if (!waitFor(consumer_parked_, [&] { return tail_.load() - head > i; })) return nullptr;
+            return &slots_[(head + i) % slots_.size()];
+        }
+
+        // consumer: oldest unreleased slot without waiting - nullptr while there's nothing published
+        T* tryPeek() {
+            size_t head = head_.load(std::memory_order_relaxed);
+            if (tail_.load() == head) return nullptr;
+            return &slots_[head % slots_.size()];
+        }
+
+        // consumer: gives the oldest slot back to the producer
+        void release() {
+            head_.fetch_add(1, std::memory_order_seq_cst);
+            wake(producer_parked_);
+        }
+
+        // either side: no more slots will be published/consumed, wakes whoever is parked
+        void close() {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                closed_ = true;
+            }
+            cv_.notify_all();
+        }
+
+    private:
+        std::vector<T> slots_;
+        alignas(64) std::atomic<size_t> head_;     // next slot to release, consumer owned
+        alignas(64) std::atomic<size_t> tail_;     // next slot to publish, producer owned
+        alignas(64) std::atomic<bool> closed_;
+        std::atomic<bool> producer_parked_;
+        std::atomic<bool> consumer_parked_;
+        std::mutex mutex_;
+        std::condition_variable cv_;
+
+        // false if the ring got closed before ready() became true
+        template <typename Pred>
+        bool waitFor(std::atomic<bool>& parked, Pred ready) {
+            // short spin first - the other side is usually just a packet away
+            for (int i = 0; i < 64; i++) {
+                if (ready()) return true;
+                if (closed_.load(std::memory_order_acquire)) return false;
+            }
+
+            std::unique_lock<std::mutex> lock(mutex_);
+            parked.store(true, std::memory_order_seq_cst);
+            cv_.wait(lock, [&] { return ready() || closed_.load(std::memory_order_relaxed); });
+            parked.store(false, std::memory_order_relaxed);
+            return ready();
+        }
+
+        void wake(std::atomic<bool>& parked) {
+            // pairs with the seq_cst store in waitFor: either we see it parked, or it sees our update
+            if (!parked.load(std::memory_order_seq_cst)) return;
+            { std::lock_guard<std::mutex> lock(mutex_); }
+            cv_.notify_all();
+        }
+    };
+}
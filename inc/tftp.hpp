@@ -8,6 +8,7 @@
 #include <arpa/inet.h>
 #include <errno.h>
 #include <netinet/in.h>
+#include <poll.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -24,21 +25,26 @@
 #include <mutex>
 #include <thread>
 #include <queue>
+#include <deque>
 #include <fstream>
 #include <filesystem>
 #include <functional>
 #include <chrono>
+#include <atomic>
+#include <exception>
+#include <future>
+#include <algorithm>
+#include <limits>
 
 namespace tftp {
     /* Things You can edit, to change how library works: */
 
-    // if defined, will use parallel file read, which is faster but uses more memory (up to file size at once at peak)
+    // if defined, client reads/writes the file on the shared thread pool, which is faster but uses more memory
+	// (a ring of up to 1024 blocks, less if max_queue_size is smaller)
 	// in other case, data will be read from file as needed (one chunk at the time) - transfer will be limited by disk read speed
-    // WARNING - this adds some overhead to every DATA - ACK transaction, if you're using blksize smaller than 2048, undef it.
     #define USE_PARALLEL_FILE_IO
 
     // struct Config {
-	// 	// TODO thing crashes with 32k block size XD
 	// 	static constexpr uint16_t BlockSize = 8192;     // smaller -> better for smaller files and bad connections but transfers slow down considerably
     //     static constexpr uint16_t Timeout = 5;
     //     static constexpr uint16_t MaxRetries = 5;
@@ -49,38 +55,230 @@ namespace tftp {
 
     class Config {
     public:
+        static constexpr uint16_t MinBlockSize = 8;         // RFC 2348 limits - the max still fits a UDP datagram
+        static constexpr uint16_t MaxBlockSize = 65464;
+
         static Config& getInstance() {
             static Config instance;
             return instance;
         }
 
         void setAll(uint16_t block_size, uint16_t timeout, uint16_t max_retries, std::streamsize max_queue_size) {
-            block_size_ = block_size;
+            setBlockSize(block_size);
             timeout_ = timeout;
             max_retries_ = max_retries;
             max_queue_size_ = max_queue_size;
         }
 
         uint16_t getBlockSize() const { return block_size_; }
-        void setBlockSize(uint16_t block_size) { block_size_ = block_size; }
+        void setBlockSize(uint16_t block_size) { block_size_ = std::max(MinBlockSize, std::min(block_size, MaxBlockSize)); }
+
+        bool getPathMtu() const { return path_mtu_; }
+        void setPathMtu(bool path_mtu) { path_mtu_ = path_mtu; }
+
+        size_t getServerWorkers() const { return server_workers_; }
+        void setServerWorkers(size_t server_workers) { server_workers_ = server_workers; }
+
+        size_t getPoolThreads() const { return pool_threads_; }
+        void setPoolThreads(size_t pool_threads) { pool_threads_ = pool_threads; }
+
+        std::streamsize getRateLimit() const { return rate_limit_; }
+        void setRateLimit(std::streamsize rate_limit) { rate_limit_ = rate_limit; }
+
+        std::streamsize getClientRateLimit() const { return client_rate_limit_; }
+        void setClientRateLimit(std::streamsize client_rate_limit) { client_rate_limit_ = client_rate_limit; }
+
+        uint8_t getClientRatePrefix() const { return client_rate_prefix_; }
+        void setClientRatePrefix(uint8_t client_rate_prefix) { client_rate_prefix_ = client_rate_prefix; }
+
+        std::streamsize getRateSmallFile() const { return rate_small_file_; }
+        void setRateSmallFile(std::streamsize rate_small_file) { rate_small_file_ = rate_small_file; }
 
         uint16_t getTimeout() const { return timeout_; }
         void setTimeout(uint16_t timeout) { timeout_ = timeout; }
 
+        uint32_t getUTimeout() const { return utimeout_; }
+        void setUTimeout(uint32_t utimeout) { utimeout_ = utimeout; }
+
+        // whichever of the two is in effect
+        std::chrono::microseconds getRetransmitTimeout() const {
+            if (utimeout_ > 0) return std::chrono::microseconds(utimeout_);
+            return std::chrono::seconds(timeout_);
+        }
+
+        bool getAdaptiveTimeout() const { return adaptive_timeout_; }
+        void setAdaptiveTimeout(bool adaptive_timeout) { adaptive_timeout_ = adaptive_timeout; }
+
+        std::streamsize getProgressBytes() const { return progress_bytes_; }
+        void setProgressBytes(std::streamsize progress_bytes) { progress_bytes_ = progress_bytes; }
+
         uint16_t getMaxRetries() const { return max_retries_; }
         void setMaxRetries(uint16_t max_retries) { max_retries_ = max_retries; }
 
         std::streamsize getMaxQueueSize() const { return max_queue_size_; }
         void setMaxQueueSize(std::streamsize max_queue_size) { max_queue_size_ = max_queue_size; }
 
+        uint16_t getWindowSize() const { return window_size_; }
+        void setWindowSize(uint16_t window_size) { window_size_ = window_size == 0 ? 1 : window_size; }
+
+        bool getHugePages() const { return huge_pages_; }
+        void setHugePages(bool huge_pages) { huge_pages_ = huge_pages; }
+
+        bool getMappedReads() const { return mapped_reads_; }
+        void setMappedReads(bool mapped_reads) { mapped_reads_ = mapped_reads; }
+
+        bool getOffload() const { return offload_; }
+        void setOffload(bool offload) { offload_ = offload; }
+
+        bool getIoUring() const { return io_uring_; }
+        void setIoUring(bool io_uring) { io_uring_ = io_uring; }
+
+        std::streamsize getCacheSize() const { return cache_size_; }
+        void setCacheSize(std::streamsize cache_size) { cache_size_ = cache_size; }
+
+        const std::string& getCacheManifest() const { return cache_manifest_; }
+        void setCacheManifest(const std::string& cache_manifest) { cache_manifest_ = cache_manifest; }
+
+        size_t getOpenFileCacheSize() const { return open_file_cache_size_; }
+        void setOpenFileCacheSize(size_t open_file_cache_size) { open_file_cache_size_ = open_file_cache_size; }
+
+        const std::string& getMulticastAddress() const { return multicast_address_; }
+        void setMulticastAddress(const std::string& multicast_address) { multicast_address_ = multicast_address; }
+
+        uint16_t getMulticastPort() const { return multicast_port_; }
+        void setMulticastPort(uint16_t multicast_port) { multicast_port_ = multicast_port; }
+
+        const std::string& getMulticastInterface() const { return multicast_interface_; }
+        void setMulticastInterface(const std::string& multicast_interface) { multicast_interface_ = multicast_interface; }
+
+        uint8_t getMulticastTtl() const { return multicast_ttl_; }
+        void setMulticastTtl(uint8_t multicast_ttl) { multicast_ttl_ = multicast_ttl; }
+
+        bool getRequestMulticast() const { return request_multicast_; }
+        void setRequestMulticast(bool request_multicast) { request_multicast_ = request_multicast; }
+
     private:
-        Config() : block_size_(4096), timeout_(5), max_retries_(5), max_queue_size_(300 * (1 << 20)) {}
+        Config() : block_size_(4096), timeout_(5), max_retries_(5), max_queue_size_(300 * (1 << 20)), window_size_(16), huge_pages_(false), mapped_reads_(false), offload_(true), io_uring_(false), cache_size_(0), open_file_cache_size_(0),
+                   multicast_port_(1758), multicast_ttl_(1), request_multicast_(false), utimeout_(0), adaptive_timeout_(true), progress_bytes_(0), path_mtu_(true), server_workers_(1), pool_threads_(0),
+                   rate_limit_(0), client_rate_limit_(0), client_rate_prefix_(32), rate_small_file_(8 << 20) {}
 
         uint16_t block_size_;               // smaller -> better for smaller files and bad connections but transfers slow down considerably
         uint16_t timeout_;                  // in seconds
         uint16_t max_retries_;              // how many times to retry sending packet
         std::streamsize max_queue_size_;    // in bytes, max memory usage will be this + around 10%. Default is 300 MB.
                                             // If set to low, downloads will slow down to speed of disk write.
+        uint16_t window_size_;              // max blocks in flight per ACK (RFC 7440), 1 is classic lock-step TFTP
+        bool huge_pages_;                   // back block buffers with huge pages (linux only, falls back to normal pages)
+        bool mapped_reads_;                 // server sends served files straight from a memory mapping instead of reading them.
+                                            // Off by default - a file truncated by someone else while it's mapped kills the server
+                                            // with SIGBUS. Uploads to the server replace files by rename, those are safe.
+                                            // Multicast sessions map their file either way.
+        bool offload_;                      // UDP segmentation/receive offload (GSO/GRO) for DATA streams, linux only.
+                                            // Falls back to plain sends/receives where the kernel or route can't do it.
+        bool io_uring_;                     // event loops wait on sockets and the server writes uploads through io_uring (linux only).
+                                            // Packets themselves still go through sendmmsg/recvmmsg, the blocking Client doesn't use it.
+                                            // Ignored where the kernel doesn't have it or it's disabled.
+        std::streamsize cache_size_;        // in bytes, server keeps up to this much of served files in memory (LRU). 0 - no cache.
+        std::string cache_manifest_;        // files (relative to the server root, one per line) loaded into the cache
+                                            // when a Server is constructed. Empty - nothing preloaded.
+        size_t open_file_cache_size_;       // server keeps metadata and an open descriptor for up to this many requested paths,
+                                            // kept current through inotify (linux only). 0 - every request asks the file system.
+        std::string multicast_address_;     // server: group for RFC 2090 multicast reads, e.g. 239.255.0.69. Empty - option is ignored.
+        uint16_t multicast_port_;           // server: first group port, concurrent sessions count up from it
+        std::string multicast_interface_;   // local address of the interface groups are sent to/joined on. Empty - routing decides.
+        uint8_t multicast_ttl_;             // server: hops group traffic may take, 1 keeps it on the local network
+        bool request_multicast_;            // client: ask for the multicast option on reads (RFC 2090)
+        uint32_t utimeout_;                 // in microseconds, replaces timeout_ and is negotiated as utimeout when set. 0 - whole seconds only.
+        bool adaptive_timeout_;             // retransmit after a few measured round trips instead of always waiting the full timeout
+        std::streamsize progress_bytes_;    // progress callbacks also fire every this many bytes, not just every callback_interval. 0 - time only.
+        bool path_mtu_;                     // server: no block bigger than the route to the client carries unfragmented (linux only)
+        size_t server_workers_;             // Server listens on this many SO_REUSEPORT sockets, each served by its own thread pinned
+                                            // to a core. 0 - one per core, 1 - single socket served from run()'s thread.
+        size_t pool_threads_;               // shared threads doing file reads/writes for all transfers, 0 - one per core.
+                                            // Read once, when the first transfer (or Server) starts them.
+        std::streamsize rate_limit_;        // server: bytes per second of DATA for all reads together. 0 - unlimited.
+        std::streamsize client_rate_limit_; // server: bytes per second of DATA per client address/subnet. 0 - unlimited.
+        uint8_t client_rate_prefix_;        // clients sharing this many leading address bits share client_rate_limit_, 32 - per address
+        std::streamsize rate_small_file_;   // files up to this many bytes get a bigger share of a limited rate, for low latency. 0 - equal shares.
+    };
+
+    // Process-wide counters and latency histograms, shared by Client and Server (labelled by side).
+    // Updates are relaxed atomic adds - no locks on the hot path; snapshot() copies everything out,
+    // and a snapshot renders itself in the Prometheus text exposition format.
+    class Metrics {
+    public:
+        enum class Side { Client, Server };
+        enum class Counter {
+            ReadRequests,       // RRQs sent (client) or accepted (server)
+            WriteRequests,
+            BytesSent,          // payload, once acknowledged
+            BytesReceived,      // payload, once accepted in order
+            Retransmissions,    // windows/ACKs sent again - after a timeout or a loss reported by the peer
+            Timeouts,
+            DuplicateAcks,      // ignored, as RFC 1350 says (sorcerer's apprentice)
+        };
+        enum class Histogram {
+            FirstData,          // RRQ to first DATA - received (client) or sent (server)
+            BlockRtt,           // window/ACK to the answer, as sampled by the retransmission timer
+            TransferTime,       // request to the last ACK, successful transfers only
+        };
+
+        static constexpr size_t Sides = 2;
+        static constexpr size_t Counters = 7;
+        static constexpr size_t Histograms = 3;
+        static constexpr size_t ErrorCodes = 9;     // RFC 1350 0-7, RFC 2347 8
+        static constexpr size_t Buckets = 17;       // upper bounds below, plus +Inf
+
+        struct HistogramSnapshot {
+            uint64_t buckets[Buckets + 1];          // not cumulative, last one is +Inf
+            uint64_t count;
+            double sum;                             // in seconds
+        };
+
+        struct Snapshot {
+            uint64_t counters[Sides][Counters];
+            uint64_t errors_sent[Sides][ErrorCodes];
+            uint64_t errors_received[Sides][ErrorCodes];
+            HistogramSnapshot histograms[Sides][Histograms];
+
+            uint64_t get(Side side, Counter counter) const { return counters[static_cast<size_t>(side)][static_cast<size_t>(counter)]; }
+            const HistogramSnapshot& get(Side side, Histogram histogram) const { return histograms[static_cast<size_t>(side)][static_cast<size_t>(histogram)]; }
+
+            std::string toPrometheus() const;
+        };
+
+        static Metrics& getInstance() {
+            static Metrics instance;
+            return instance;
+        }
+
+        void add(Side side, Counter counter, uint64_t n = 1) {
+            counters_[static_cast<size_t>(side)][static_cast<size_t>(counter)].fetch_add(n, std::memory_order_relaxed);
+        }
+
+        // ERROR packet, by code - anything past the known codes is counted as 0 (not defined)
+        void error(Side side, bool sent, uint16_t code) {
+            auto& errors = sent ? errors_sent_ : errors_received_;
+            errors[static_cast<size_t>(side)][code < ErrorCodes ? code : 0].fetch_add(1, std::memory_order_relaxed);
+        }
+
+        void observe(Side side, Histogram histogram, std::chrono::nanoseconds value);
+
+        Snapshot snapshot() const;
+        void reset();
+
+    private:
+        struct AtomicHistogram {
+            std::atomic<uint64_t> buckets[Buckets + 1];
+            std::atomic<uint64_t> sum_ns;
+        };
+
+        std::atomic<uint64_t> counters_[Sides][Counters];
+        std::atomic<uint64_t> errors_sent_[Sides][ErrorCodes];
+        std::atomic<uint64_t> errors_received_[Sides][ErrorCodes];
+        AtomicHistogram histograms_[Sides][Histograms];
+
+        Metrics() { reset(); }
     };
 
 #ifdef _WIN32
@@ -89,11 +287,14 @@ namespace tftp {
 #define clean_sockfd(sockfd) do { closesocket(sockfd); WSACleanup(); } while(0)
 #define getOsError() WSAGetLastError()
 #define TIMEOUT_OS_ERR WSAETIMEDOUT
+#define WOULDBLOCK_OS_ERR WSAEWOULDBLOCK
 #else
 	typedef int socket_t;
 #define clean_sockfd(sockfd) do { close(sockfd); } while(0)
 #define getOsError() errno
 #define TIMEOUT_OS_ERR ETIMEDOUT
+#define WOULDBLOCK_OS_ERR EWOULDBLOCK
+#define INVALID_SOCKET (-1)
 #endif
 
     class TftpError : public std::runtime_error {
@@ -116,6 +317,7 @@ namespace tftp {
             UnknownTransferId,
             FileAlreadyExists,
             NoSuchUser,
+            OptionNegotiation,  // RFC 2347
         };
 
         TftpError(ErrorType type, int code, const std::string& msg)
@@ -148,13 +350,21 @@ namespace tftp {
 
     class Client {
     public:
+        // callbacks are made by the transfer loop itself, on the calling thread - the counters
+        // are atomic so other threads can watch them too
         class Progress {
         public:
-            size_t total_bytes;
-            size_t transferred_bytes;
+            std::atomic<size_t> total_bytes;
+            std::atomic<size_t> transferred_bytes;
             bool transfer_active() const { return transferred_bytes < total_bytes; }
 
             Progress(size_t total_bytes) : total_bytes(total_bytes), transferred_bytes(0) {}
+            Progress(const Progress& other) : total_bytes(other.total_bytes.load()), transferred_bytes(other.transferred_bytes.load()) {}
+            Progress& operator=(const Progress& other) {
+                total_bytes = other.total_bytes.load();
+                transferred_bytes = other.transferred_bytes.load();
+                return *this;
+            }
         };
 
         typedef std::function<void(Progress&)> ProgressCallback;
@@ -172,7 +382,26 @@ namespace tftp {
             const std::string& filename,
             std::ostream& data,
             ProgressCallback progress = nullptr,
-            std::chrono::milliseconds callback_interval = std::chrono::milliseconds(1000)
+            std::chrono::milliseconds callback_interval = std::chrono::milliseconds(1000),
+            std::streamsize offset = 0      // resume - data gets the file from this byte on
+        );
+
+        // one file of a recvMany batch - bytes and error are filled in once it's done
+        struct Fetch {
+            std::string filename;
+            std::ostream* data;
+            std::streamsize bytes;
+            std::exception_ptr error;   // null if the file made it
+
+            Fetch(const std::string& filename, std::ostream& data) : filename(filename), data(&data), bytes(0) {}
+        };
+
+        // fetches every file from the same server, at most max_concurrent at a time, all driven from the calling
+        // thread (an AsyncClient of its own). A failed file doesn't stop the rest. Returns how many made it.
+        static size_t recvMany (
+            const std::string& remote_addr,
+            std::vector<Fetch>& files,
+            size_t max_concurrent = 16
         );
     
     private:
@@ -185,28 +414,21 @@ namespace tftp {
 			void forceCleanup() { needs_cleanup_ = true; cleanup(); }
             void dismiss() { needs_cleanup_ = false; }
 
-			void guardThread(std::thread&& t) {
-				threads_.push_back(std::move(t));
-			}
 			template <typename T>
             void guardNew(T* ptr) {
-				news_.push_back(static_cast<void*>(ptr));
+				news_.push_back([ptr] { delete[] ptr; });
             }
 
         private:
             socket_t sockfd_;
-			std::vector<std::thread> threads_;
-            std::vector<void*> news_;
+            std::vector<std::function<void()>> news_;   // delete[] with the right type
             bool needs_cleanup_;
 
 			void cleanup() {
 				if (needs_cleanup_) {
                     if (needs_cleanup_) {
-                        for (auto& t : threads_) {
-                            t.join();
-                        }
-                        for (auto& ptr : news_) {
-                            delete[] ptr;
+                        for (auto& del : news_) {
+                            del();
                         }
 
                         clean_sockfd(sockfd_);
@@ -217,6 +439,49 @@ namespace tftp {
         };
     };
 
+    // Client transfers without a thread each - every transfer is a non-blocking state machine, and one event loop
+    // drives as many of them as it's given (the same model as the event-loop Server). With threads = 0 there's no
+    // loop of its own, the caller drives it with poll(); otherwise transfers are spread over that many loops.
+    // Streams have to outlive their transfer, callbacks are made from the loop's thread and must not throw.
+    // Multicast (RFC 2090) is left to Client::recv.
+    class AsyncClient {
+    public:
+        // bytes transferred, or why the transfer failed
+        typedef std::function<void(std::streamsize bytes, std::exception_ptr error)> CompletionCallback;
+
+        explicit AsyncClient(size_t threads = 1, std::chrono::milliseconds callback_interval = std::chrono::milliseconds(1000));
+        ~AsyncClient();     // transfers still running are aborted
+
+        AsyncClient(const AsyncClient&) = delete;
+        AsyncClient& operator=(const AsyncClient&) = delete;
+
+        // all of these return right away and are safe to call from any thread (or from a callback)
+        void send(const std::string& remote_addr, const std::string& filename, std::istream& data, CompletionCallback done,
+                  Client::ProgressCallback progress = nullptr);
+        void recv(const std::string& remote_addr, const std::string& filename, std::ostream& data, CompletionCallback done,
+                  Client::ProgressCallback progress = nullptr);
+        std::future<std::streamsize> send(const std::string& remote_addr, const std::string& filename, std::istream& data);
+        std::future<std::streamsize> recv(const std::string& remote_addr, const std::string& filename, std::ostream& data);
+
+        // threads = 0 only - runs whatever is ready, waiting up to timeout for something to be. Returns the transfers still active.
+        size_t poll(std::chrono::milliseconds timeout = std::chrono::milliseconds(0));
+
+        size_t getActiveTransfers() const;
+
+    private:
+        friend class Client;    // recvMany drives a Loop of its own
+
+        class Transfer;
+        class Loop;
+
+        void submit(std::unique_ptr<Transfer> transfer);
+
+        std::chrono::milliseconds callback_interval_;
+        std::vector<std::unique_ptr<Loop>> loops_;
+        std::vector<std::thread> threads_;
+        std::atomic<size_t> next_loop_;
+    };
+
     class Server {
     public:
         class TransferInfo {
@@ -264,65 +529,60 @@ namespace tftp {
         
         typedef std::function<void(TransferInfo&)> TransferCallback;
 
-        static void handleClient (
-            socket_t sockfd,
+        // Event-loop server: owns the listening socket and serves every RRQ/WRQ it receives concurrently,
+        // driving all transfers from the thread that calls run(). Port 0 binds an ephemeral port.
+        // With Config's server workers above 1 there's a socket per worker on the same port (SO_REUSEPORT) and
+        // run() drives each from its own thread - callback is then called from all of them.
+        Server (
             const std::string& root_dir,
+            uint16_t port = 69,
             TransferCallback callback = nullptr,
             std::chrono::milliseconds callback_interval = std::chrono::milliseconds(1000)
         );
+        ~Server();
 
-	private:
-        class ServerCleanupGuard {
-        public:
-            ServerCleanupGuard() : needs_cleanup_(true) {}
-            ~ServerCleanupGuard() {
-                cleanup();
-            }
-            void forceCleanup() { needs_cleanup_ = true; cleanup(); }
-            void dismiss() { needs_cleanup_ = false; }
+        Server(const Server&) = delete;
+        Server& operator=(const Server&) = delete;
 
-            template <typename T>
-            void guardNew(T* ptr) {
-                news_.push_back(static_cast<void*>(ptr));
-            }
+        // blocks until stop() is called, transfers still active at that point are aborted
+        void run();
+        // safe to call from any thread (or from a callback)
+        void stop() { running_ = false; }
 
-			void guardSocket(socket_t sockfd) {
-				sockfd_ = sockfd;
-			}
+        uint16_t getPort() const { return port_; }
+        size_t getActiveTransfers() const { return active_transfers_; }
 
-            void guardThread(std::thread&& t) {
-                threads_.push_back(std::move(t));
-            }
+        // serves a single request received on sockfd, blocks until the transfer is finished.
+        // Uploads of all calls go through one writer, sized by Config's max queue size at the first call
+        static void handleClient (
+            socket_t sockfd,
+            const std::string& root_dir,
+            TransferCallback callback = nullptr,
+            std::chrono::milliseconds callback_interval = std::chrono::milliseconds(1000)
+        );
 
-			void guardFile(std::ifstream&& file) {
-				file_ = std::move(file);
-			}
+	private:
+        class Transfer;
+
+        std::vector<socket_t> sockfds_;     // one per worker, all bound to port_
+        uint16_t port_;
+        std::string root_dir_;
+        TransferCallback callback_;
+        std::chrono::milliseconds callback_interval_;
+        std::atomic<bool> running_;
+        std::atomic<size_t> active_transfers_;
+
+        // event loop over one listening socket and the transfers it accepted
+        void serve(socket_t sockfd);
+    };
 
-        private:
-            socket_t sockfd_;
-            bool needs_cleanup_;
-			std::ifstream file_;
-            std::vector<void*> news_;
-            std::vector<std::thread> threads_;
-
-            void cleanup() {
-                if (needs_cleanup_) {
-                    for (auto& t : threads_) {
-                        t.join();
-                    }
-                    for (auto& ptr : news_) {
-                        delete[] ptr;
-                    }
-					file_.close();
-                #ifdef _WIN32
-					closesocket(sockfd_);
-                #else
-					close(sockfd_);
-                #endif
-                    needs_cleanup_ = false;
-                }
-            }
-        };
+    enum class TftpOpcode : uint16_t {
+        ReadRequest = 1,
+        WriteRequest = 2,
+        Data = 3,
+        Ack = 4,
+        Error = 5,
+        Oack = 6,
     };
 
     namespace {
@@ -337,27 +597,12 @@ namespace tftp {
             NoSuchUser = 7,
         };
 
-        enum class TftpOpcode : uint16_t {
-            ReadRequest = 1,
-            WriteRequest = 2,
-            Data = 3,
-            Ack = 4,
-            Error = 5,
-            Oack = 6,
-        };
-
         // u16 {a, b} -> u8 {b}
-        uint8_t getOpcodeByte(TftpOpcode opcode) {
+        inline uint8_t getOpcodeByte(TftpOpcode opcode) {
             return static_cast<uint8_t>(static_cast<uint16_t>(opcode) & 0xFF);
         }
 
-        void strncpy_inc_offset(uint8_t* buffer, const char* str, size_t len, uint16_t& offset) {
-            std::copy(str, str + len, buffer + offset);
-            offset += static_cast<uint16_t>(len);
-            buffer[offset++] = '\0';
-        }
-
-        std::streamsize getStreamLength(std::istream& stream) {
+        inline std::streamsize getStreamLength(std::istream& stream) {
             std::streamsize current = stream.tellg();
             stream.seekg(0, std::ios::end);
             std::streamsize length = stream.tellg();
@@ -370,14 +615,66 @@ namespace tftp {
             return length;
         }
 
-        // safer reinterpret_cast<char*>
-        std::string readStringFromBuffer(uint8_t* buffer, size_t len) {
-            auto null_byte = std::find(buffer, buffer + len, '\0');
-            if (null_byte == buffer + len) {
-                throw TftpError(TftpError::ErrorType::Tftp, 0, "Malformed packet");
+        // sends header + payload as one datagram, without copying payload into a packet buffer
+        inline bool sendDatagram(socket_t sockfd, const struct sockaddr_in& addr, const uint8_t* header, size_t header_len, const uint8_t* payload, size_t payload_len) {
+        #ifdef _WIN32
+            WSABUF packet[2];
+            packet[0].buf = reinterpret_cast<char*>(const_cast<uint8_t*>(header));
+            packet[0].len = static_cast<ULONG>(header_len);
+            packet[1].buf = reinterpret_cast<char*>(const_cast<uint8_t*>(payload));
+            packet[1].len = static_cast<ULONG>(payload_len);
+
+            DWORD bytes_sent;
+            return WSASendTo(sockfd, packet, payload_len > 0 ? 2 : 1, &bytes_sent, 0, (struct sockaddr*)&addr, sizeof(addr), nullptr, nullptr) != SOCKET_ERROR;
+        #else
+            struct iovec packet[2];
+            packet[0].iov_base = const_cast<uint8_t*>(header);
+            packet[0].iov_len = header_len;
+            packet[1].iov_base = const_cast<uint8_t*>(payload);
+            packet[1].iov_len = payload_len;
+
+            struct msghdr msg = {};
+            msg.msg_name = const_cast<struct sockaddr_in*>(&addr);
+            msg.msg_namelen = sizeof(addr);
+            msg.msg_iov = packet;
+            msg.msg_iovlen = payload_len > 0 ? 2 : 1;
+
+            return sendmsg(sockfd, &msg, 0) >= 0;
+        #endif
+        }
+
+        // waits until sockfd is readable or deadline passes - unlike SO_RCVTIMEO, stray
+        // duplicates can't keep pushing a retransmission back
+        inline bool waitReadable(socket_t sockfd, std::chrono::steady_clock::time_point deadline) {
+            while (true) {
+                auto wait = std::chrono::ceil<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+                if (wait.count() <= 0) return false;
+
+                struct pollfd pfd = {};
+                pfd.fd = sockfd;
+                pfd.events = POLLIN;
+            #ifdef _WIN32
+                int ret = WSAPoll(&pfd, 1, static_cast<int>(wait.count()));
+            #else
+                int ret = poll(&pfd, 1, static_cast<int>(wait.count()));
+            #endif
+                if (ret > 0) return true;
+                if (ret < 0 && getOsError() != EINTR) return true;  // let the following recv report the error
             }
+        }
+
+        inline bool sameAddress(const struct sockaddr_in& a, const struct sockaddr_in& b) {
+            return a.sin_addr.s_addr == b.sin_addr.s_addr && a.sin_port == b.sin_port;
+        }
 
-			return std::string(reinterpret_cast<char*>(buffer), null_byte - buffer);
+        // a whole window of DATA has to fit into the receive buffer, or its tail is dropped and every
+        // window waits out a timeout (8K blocks barely fit 12 to the default one). Best effort, capped by rmem_max.
+        inline void reserveWindow(socket_t sockfd, size_t windowsize, size_t blksize) {
+            int wanted = static_cast<int>(std::min<size_t>(windowsize * (blksize + 4) * 2, std::numeric_limits<int>::max()));
+            int current = 0;
+            socklen_t len = sizeof(current);
+            if (getsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, reinterpret_cast<char*>(&current), &len) == 0 && current >= wanted) return;
+            setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, reinterpret_cast<const char*>(&wanted), sizeof(wanted));
         }
     }
 }
@@ -0,0 +1,74 @@
+#pragma once
+
+#include "tftp.hpp"
+#include <condition_variable>
+
+namespace tftp {
+    // Process-wide work-stealing pool for the disk stages of transfers (read-ahead, write-behind), so no transfer
+    // starts a thread of its own. Threads are started once, on first use, and live as long as the process.
+    // Every worker has its own deque: it pushes and pops at the back (the newest task is the one still in cache),
+    // idle workers steal from the front of the others'. Tasks must not block waiting for other tasks.
+    class ThreadPool {
+    public:
+        typedef std::function<void()> Task;
+
+        static constexpr size_t MaxQueued = 4096;   // beyond this, submit() runs the task on the caller instead
+
+        static ThreadPool& getInstance() {
+            static ThreadPool* instance = new ThreadPool(Config::getInstance().getPoolThreads());    // never destroyed, like its threads
+            return *instance;
+        }
+
+        ThreadPool(const ThreadPool&) = delete;
+        ThreadPool& operator=(const ThreadPool&) = delete;
+
+        void submit(Task task);
+
+        size_t size() const { return workers_.size(); }
+
+    private:
+        struct Worker {
+            std::mutex mutex;
+            std::deque<Task> tasks;
+        };
+
+        std::vector<std::unique_ptr<Worker>> workers_;
+        std::atomic<size_t> queued_;
+        std::atomic<size_t> next_;      // round robin for submits from outside the pool
+        std::mutex idle_mutex_;
+        std::condition_variable idle_cv_;
+
+        static thread_local size_t self_;   // worker index + 1 on pool threads, 0 elsewhere
+
+        explicit ThreadPool(size_t threads);
+
+        bool pop(size_t self, Task& task);
+        void run(size_t self);
+    };
+
+    // A stage that runs on the pool, never twice at the same time. schedule() while it's running makes it run once
+    // more afterwards, so whatever was handed to it in between is seen - the function just does all there is to do.
+    class SerialTask {
+    public:
+        explicit SerialTask(std::function<void()> fn) : fn_(std::move(fn)), state_(Idle) {}
+        ~SerialTask() { wait(); }
+
+        SerialTask(const SerialTask&) = delete;
+        SerialTask& operator=(const SerialTask&) = delete;
+
+        void schedule();
+
+        // until it's neither running nor scheduled
+        void wait();
+
+    private:
+        enum State { Idle, Scheduled, Rescheduled };
+
+        std::function<void()> fn_;
+        std::atomic<int> state_;
+        std::mutex mutex_;
+        std::condition_variable cv_;
+
+        void run();
+    };
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+#include "tftp.hpp"
+#include "block_pool.hpp"
+#include "io_uring.hpp"
+#include "thread_pool.hpp"
+#include <cstdio>
+
+namespace tftp {
+    // Write-behind stage for uploads: the network side hands data over and goes on ACKing,
+    // a writer on the shared ThreadPool turns it into large sequential writes, one round at a time. Files finished
+    // in the same round are fsynced together, so concurrent uploads share the cost of going to disk.
+    // With Config::setIoUring() a round is submitted to io_uring as one linked write(+fsync) chain per file.
+    // Uploads go to a temporary file next to the target, renamed over it only once it's complete and synced -
+    // a failed upload never touches the old copy, and readers of it never see it truncated.
+    class WriteBehind {
+    public:
+        static constexpr size_t BatchSize = 256 * 1024;    // bytes collected per file before handing them to the writer
+
+        class File {
+        public:
+            bool failed() const { return error_ != 0; }
+            int getError() const { return error_; }
+            bool closed() const { return closed_; }     // close() went through - synced and renamed, or failed()
+
+        private:
+            friend class WriteBehind;
+
+            FILE* fp_ = nullptr;
+            std::filesystem::path path_;
+            std::filesystem::path temp_path_;   // what's written to, becomes path_ on a successful close
+            BlockPool::Buffer batch_;       // network side only - data not handed over yet
+            size_t batch_len_ = 0;
+            std::atomic<int> error_{0};     // set by the writer, errno of the first failed write
+            std::atomic<bool> closed_{false};
+            uint64_t offset_ = 0;           // writer side - io_uring writes carry explicit offsets
+            int fixed_ = -1;                // writer side - io_uring fixed file index
+        };
+
+        explicit WriteBehind(std::streamsize max_backlog = Config::getInstance().getMaxQueueSize());
+        ~WriteBehind();     // drains everything still queued
+
+        WriteBehind(const WriteBehind&) = delete;
+        WriteBehind& operator=(const WriteBehind&) = delete;
+
+        // creates the temporary file and reserves expected_size bytes on disk if it's known, nullptr on failure
+        std::shared_ptr<File> open(const std::filesystem::path& path, std::streamsize expected_size);
+
+        // false if the writer is too far behind - drop the block, the peer will retransmit it
+        bool write(const std::shared_ptr<File>& file, const uint8_t* data, size_t len);
+
+        // hands over what's left; writer syncs the file and renames it into place, or deletes it if keep is false
+        void close(const std::shared_ptr<File>& file, bool keep);
+
+        std::streamsize getBacklog() const { return backlog_; }
+
+    private:
+        struct Job {
+            std::shared_ptr<File> file;
+            BlockPool::Buffer data;     // goes back to the pool once written
+            size_t len;
+            bool close;
+            bool keep;
+        };
+
+        std::mutex mutex_;
+        std::deque<Job> jobs_;
+        std::atomic<std::streamsize> backlog_;  // bytes written but not on disk yet - pending batches and queued jobs
+        std::streamsize max_backlog_;
+        std::unique_ptr<SerialTask> writer_;    // the destructor waits for it to drain before any member goes
+
+    #ifdef TFTP_HAVE_IO_URING
+        static constexpr unsigned RingEntries = 128;
+        static constexpr unsigned MaxFixedFiles = 256;
+        static constexpr unsigned MaxFixedBuffers = 1024;      // pool slabs, 2 GiB worth
+
+        std::unique_ptr<IoUring> ring_;     // writer only - its rounds never overlap
+        std::vector<unsigned> free_fixed_;
+        std::vector<int8_t> slabs_;         // per pool slab: 0 - not seen yet, 1 - fixed buffer, -1 - couldn't register
+        bool fixed_buffers_ = false;
+        bool broken_ = false;               // a submit failed outright, uploads fail from then on
+
+        void writeRing(std::deque<Job>& jobs);
+        bool fixedBuffer(const uint8_t* data, unsigned& index);
+    #endif
+
+        void push(Job&& job);
+        void flush(const std::shared_ptr<File>& file);
+        void drain();
+        void finish(std::vector<Job>& finished, bool synced);
+    };
+}
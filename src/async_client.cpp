@@ -0,0 +1,753 @@
+#include "../inc/tftp.hpp"
+#include "../inc/block_pool.hpp"
+#include "../inc/datagram_batch.hpp"
+#include "../inc/packet.hpp"
+#include "../inc/poller.hpp"
+#include "../inc/progress.hpp"
+#include "../inc/rto.hpp"
+
+using namespace tftp;
+
+namespace {
+    constexpr uint16_t DefaultBlockSize = 512;  // RFC 1350, when the server ignores our options
+
+    // one block of the upload, kept until it's ACKed
+    struct Chunk {
+        BlockPool::Buffer data;
+        size_t len = 0;
+    };
+
+    void count(Metrics::Counter counter, uint64_t n = 1) {
+        Metrics::getInstance().add(Metrics::Side::Client, counter, n);
+    }
+
+    void observe(Metrics::Histogram histogram, std::chrono::steady_clock::time_point since) {
+        Metrics::getInstance().observe(Metrics::Side::Client, histogram, std::chrono::steady_clock::now() - since);
+    }
+
+    // "ip" or "ip:port", same as Client::send/recv take it
+    struct sockaddr_in parseRemote(const std::string& remote_addr_str) {
+        struct sockaddr_in remote_addr = {};
+        remote_addr.sin_family = AF_INET;
+
+        size_t pos = remote_addr_str.find(':');
+        std::string ip = remote_addr_str.substr(0, pos);
+        uint16_t port = 69;
+        if (pos != std::string::npos && !parseNumber(std::string_view(remote_addr_str).substr(pos + 1), port))
+            throw TftpError(TftpError::ErrorType::OS, 0, "Invalid port");
+        remote_addr.sin_port = htons(port);
+        if (inet_pton(AF_INET, ip.c_str(), &remote_addr.sin_addr) != 1)
+            throw TftpError(TftpError::ErrorType::OS, 0, "Invalid IP address");
+        return remote_addr;
+    }
+
+    void closeSocket(socket_t sockfd) {
+    #ifdef _WIN32
+        closesocket(sockfd);
+    #else
+        close(sockfd);
+    #endif
+    }
+}
+
+/* One client transfer, RRQ or WRQ - what Client::recv/send do, as a state machine that never blocks.
+ * A Loop feeds it packets (onReadable) and timer expirations (onTimeout), the way Server::run feeds
+ * Server::Transfer. Unlike the blocking client it resends an unanswered request, and whichever server
+ * TID answers first is the one we talk to. */
+class AsyncClient::Transfer {
+public:
+    enum class Type {
+        Read,
+        Write,
+    };
+
+    // a finished transfer's socket and receive buffers, handed on to the next transfer of a recvMany lane
+    struct Endpoint {
+        socket_t sockfd;
+        std::unique_ptr<RecvBatch> batch;
+        struct sockaddr_in peer;    // server TID the last transfer talked to
+    };
+
+    socket_t sockfd;
+    bool done;
+    std::chrono::steady_clock::time_point deadline;
+    Client::Progress info;
+    ProgressThrottle progress;     // when progress_callback_ is due next
+
+    Transfer(Type type, const std::string& remote_addr, const std::string& filename, std::istream* in, std::ostream* out,
+             CompletionCallback completion, Client::ProgressCallback progress_callback, std::chrono::milliseconds callback_interval)
+        : sockfd(INVALID_SOCKET), done(false), info(0),
+          progress(callback_interval, static_cast<uint64_t>(std::max<std::streamsize>(Config::getInstance().getProgressBytes(), 0))), config_(Config::getInstance()),
+          type_(type), remote_(remote_addr), filename_(filename), in_(in), out_(out), completion_(std::move(completion)), progress_callback_(std::move(progress_callback)),
+          negotiated_(false), blksize_(config_.getBlockSize()), windowsize_(config_.getWindowSize()), total_(0), rto_(config_.getRetransmitTimeout(), config_.getAdaptiveTimeout()),
+          timed_out_(false), retries_(config_.getMaxRetries()), window_received_(0), gap_acked_(false), acked_(0), next_(1), sent_(0), rollback_guard_(0), final_block_(0) {
+        remote_addr_ = {};
+        comm_addr_ = {};
+        previous_peer_ = {};
+        started_at_ = std::chrono::steady_clock::now();
+    }
+
+    ~Transfer() {
+        if (sockfd != INVALID_SOCKET) closeSocket(sockfd);
+    }
+
+    // before start() - goes on with another transfer's socket instead of opening one. Whatever that one
+    // left queued is dropped, its server may still repeat its final DATA later (see onReadable).
+    void reuse(Endpoint&& endpoint) {
+        sockfd = endpoint.sockfd;
+        recv_batch_ = std::move(endpoint.batch);
+        previous_peer_ = endpoint.peer;
+        while (recv_batch_->receive(sockfd) > 0) {}
+    }
+
+    bool reusable() const { return sockfd != INVALID_SOCKET && recv_batch_; }
+
+    // after it's done - the socket and buffers, so they're not closed with the transfer
+    Endpoint detach() {
+        Endpoint endpoint { sockfd, std::move(recv_batch_), negotiated_ ? comm_addr_ : previous_peer_ };
+        sockfd = INVALID_SOCKET;
+        return endpoint;
+    }
+
+    // creates the socket and sends the request - failures end the transfer right away (done)
+    void start() {
+        try {
+            remote_addr_ = parseRemote(remote_);
+            if (type_ == Type::Write) info.total_bytes = static_cast<size_t>(getStreamLength(*in_));
+        } catch (const TftpError& e) {
+            return abort(e);
+        }
+
+        if (sockfd == INVALID_SOCKET) {
+            struct sockaddr_in local_addr = {};
+            local_addr.sin_family = AF_INET;
+            local_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+            local_addr.sin_port = htons(0);
+
+            if ((sockfd = socket(AF_INET, SOCK_DGRAM, 0)) == INVALID_SOCKET)
+                return abort(TftpError(TftpError::ErrorType::OS, getOsError(), "Failed to create socket"));
+            if (bind(sockfd, (struct sockaddr*)&local_addr, sizeof(local_addr)) == -1)
+                return abort(TftpError(TftpError::ErrorType::OS, getOsError(), "Failed to bind socket"));
+            setNonBlocking(sockfd);
+            if (type_ == Type::Read) reserveWindow(sockfd, windowsize_, blksize_);
+        }
+
+        // negotiated sizes are never above what we ask for, so these fit whatever comes back
+        if (!recv_batch_) {
+            if (type_ == Type::Read) recv_batch_ = std::make_unique<RecvBatch>(std::min<size_t>(windowsize_, 32), static_cast<size_t>(blksize_) + 4);
+            else recv_batch_ = std::make_unique<RecvBatch>(16, static_cast<size_t>(blksize_) + 4);
+        }
+
+        // same options as the blocking client
+        request_.resize(filename_.size() + 128);
+        PacketWriter request(request_.data(), request_.size());
+        request.opcode(type_ == Type::Read ? TftpOpcode::ReadRequest : TftpOpcode::WriteRequest).string(filename_).string("octet")
+            .option("blksize", blksize_)
+            .option("tsize", info.total_bytes.load());
+        if (type_ == Type::Write) request.option("timeout", config_.getTimeout());
+        request.option("windowsize", windowsize_);
+        if (config_.getUTimeout() > 0) request.option("utimeout", config_.getUTimeout());
+        request_.resize(request.size());
+
+        sendRequest();
+    }
+
+    void onReadable() {
+        while (!done) {
+            int received = recv_batch_->receive(sockfd);
+            if (received < 0) {
+                auto errnum = getOsError();
+                if (errnum == WOULDBLOCK_OS_ERR || errnum == EAGAIN || errnum == EINTR) return;
+                return abort(TftpError(TftpError::ErrorType::OS, errnum, "Failed to receive response"));
+            }
+
+            for (int i = 0; i < received && !done; i++) {
+                const struct sockaddr_in& from = recv_batch_->from(i);
+                if (!negotiated_ && stale(from, recv_batch_->data(i), recv_batch_->length(i))) continue;
+                if (negotiated_ && !sameAddress(from, comm_addr_)) {
+                    // answer to a resent request - that transfer isn't ours
+                    rejectStranger(from);
+                    continue;
+                }
+                if (recv_batch_->length(i) < 4) continue;
+
+                handlePacket(from, recv_batch_->data(i), recv_batch_->length(i));
+            }
+        }
+    }
+
+    void onTimeout() {
+        if (done) return;
+        timed_out_ = true;
+        count(Metrics::Counter::Timeouts);
+        if (!rto_.backoff() && --retries_ <= 0) return abort(TftpError(TftpError::ErrorType::Timeout, 0, "Max retries exceeded"));
+        count(Metrics::Counter::Retransmissions);
+
+        if (!negotiated_) {
+            sendRequest();
+        } else if (type_ == Type::Read) {
+            sendAck(next_ - 1);
+            gap_acked_ = true;
+        } else {
+            next_ = acked_ + 1;     // whole window is resent
+            sendWindow();
+        }
+    }
+
+    // the loop asks after every batch of packets and on timers
+    void reportProgress(std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now()) {
+        if (progress_callback_ && !done && progress.due(info.transferred_bytes, now)) progress_callback_(info);
+    }
+
+    bool wantsProgress() const { return static_cast<bool>(progress_callback_); }
+
+    // client is going away - tell the server, if we know which socket it's using
+    void cancel() {
+        if (done) return;
+        if (negotiated_) sendError(comm_addr_, TftpError::ErrorCode::None, "Client shutting down");
+        abort(TftpError(TftpError::ErrorType::Tftp, 0, "Client shutting down"));
+    }
+
+    // hands the result over, once done
+    void complete() {
+        if (!failure_ && progress_callback_) progress_callback_(info);
+        if (completion_) completion_(total_, failure_);
+    }
+
+private:
+    Config config_;
+    Type type_;
+    std::string remote_;
+    std::string filename_;
+    std::istream* in_;          // WRQ
+    std::ostream* out_;         // RRQ
+    CompletionCallback completion_;
+    Client::ProgressCallback progress_callback_;
+    std::exception_ptr failure_;
+
+    struct sockaddr_in remote_addr_;    // where the request goes
+    struct sockaddr_in comm_addr_;      // server's transfer socket, from its first answer
+    struct sockaddr_in previous_peer_;  // reused socket - server TID of the transfer that had it before
+    bool negotiated_;           // comm_addr_ is known and the options settled
+    std::vector<uint8_t> request_;      // kept for resending
+    std::unique_ptr<RecvBatch> recv_batch_;
+
+    uint16_t blksize_;
+    uint16_t windowsize_;
+    std::streamsize total_;     // bytes written out (RRQ) or ACKed (WRQ)
+    RtoEstimator rto_;
+    std::chrono::steady_clock::time_point started_at_;
+    std::chrono::steady_clock::time_point sent_at_;
+    bool timed_out_;            // something was resent - its answer can't be timed (Karn)
+    int retries_;
+
+    // RRQ
+    uint16_t window_received_;  // in-order blocks since the last ACK
+    bool gap_acked_;            // already told the server where to resume
+
+    // WRQ - window_[0] is block acked_ + 1
+    std::deque<Chunk> window_;
+    uint64_t acked_;
+    uint64_t next_;             // next block to send (WRQ) or expected (RRQ)
+    uint64_t sent_;             // highest block sent so far - anything above it can't be ACKed
+    uint64_t rollback_guard_;   // duplicate ACKs below this block don't roll the window back again
+    uint64_t final_block_;      // unknown until the short chunk shows up
+
+    void handlePacket(const struct sockaddr_in& from, uint8_t* packet, size_t len) {
+        uint16_t block_num = (packet[2] << 8) | (packet[3] & 0xFF);
+
+        if (packet[1] == static_cast<uint8_t>(TftpOpcode::Error)) {
+            ErrorView error = {};
+            decodeError(packet, len, error);
+            Metrics::getInstance().error(Metrics::Side::Client, false, error.code);
+            return abort(TftpError(TftpError::ErrorType::Tftp, error.code, std::string(error.message)));
+        }
+
+        if (!negotiated_) {
+            comm_addr_ = from;
+            negotiated_ = true;
+
+            if (packet[1] == static_cast<uint8_t>(TftpOpcode::Oack)) {
+                std::streamsize tsize = static_cast<std::streamsize>(info.total_bytes);
+                try {
+                    parseOack(packet, static_cast<int32_t>(len), blksize_, windowsize_, tsize);
+                } catch (const TftpError& e) {
+                    return abort(e);
+                }
+                sampleRtt();
+                retries_ = config_.getMaxRetries();
+                if (type_ == Type::Write) return sendWindow();
+                info.total_bytes = static_cast<size_t>(std::max<std::streamsize>(tsize, 0));
+                return sendAck(0);
+            }
+
+            // no options - the server went straight to RFC 1350
+            blksize_ = DefaultBlockSize;
+            windowsize_ = 1;
+            if (type_ == Type::Write && packet[1] == static_cast<uint8_t>(TftpOpcode::Ack) && block_num == 0) {
+                sampleRtt();
+                retries_ = config_.getMaxRetries();
+                return sendWindow();
+            }
+            if (type_ == Type::Write || packet[1] != static_cast<uint8_t>(TftpOpcode::Data))
+                return abort(TftpError(TftpError::ErrorType::Tftp, packet[1], "Invalid response opcode"));
+        }
+
+        if (type_ == Type::Read) {
+            if (packet[1] == static_cast<uint8_t>(TftpOpcode::Data)) return onData(block_num, packet + 4, len - 4);
+            if (packet[1] == static_cast<uint8_t>(TftpOpcode::Oack) && next_ == 1) return sendAck(0);     // our ACK 0 got lost
+        } else {
+            if (packet[1] == static_cast<uint8_t>(TftpOpcode::Ack)) return onAck(block_num);
+            if (packet[1] == static_cast<uint8_t>(TftpOpcode::Oack) && acked_ == 0) return;     // first window got lost, the timer resends it
+        }
+        abort(TftpError(TftpError::ErrorType::Tftp, packet[1], "Invalid response opcode"));
+    }
+
+    void onData(uint16_t block_num, const uint8_t* payload, size_t len) {
+        if (block_num != static_cast<uint16_t>(next_)) {
+            // lost block or a retransmission of something we have - ACK the last good one once, server resumes after it
+            if (!gap_acked_) {
+                count(Metrics::Counter::Retransmissions);
+                sendAck(next_ - 1);
+            }
+            gap_acked_ = true;
+            return;
+        }
+        if (len > blksize_) return abort(TftpError(TftpError::ErrorType::Tftp, block_num, "Block too large"));
+
+        retries_ = config_.getMaxRetries();
+        gap_acked_ = false;
+        if (window_received_ == 0) sampleRtt();     // first block since our last ACK
+        if (next_ == 1) observe(Metrics::Histogram::FirstData, started_at_);
+
+        out_->write(reinterpret_cast<const char*>(payload), len);
+        next_++;
+        total_ += static_cast<std::streamsize>(len);
+        count(Metrics::Counter::BytesReceived, len);
+        info.transferred_bytes += len;
+        deadline = std::chrono::steady_clock::now() + rto_.get();
+
+        // one ACK per window (RFC 7440), and always for the last block
+        bool last = len < blksize_;
+        if (++window_received_ == windowsize_ || last) sendAck(next_ - 1);
+        if (last && !done) finish();
+    }
+
+    void onAck(uint16_t block_num) {
+        uint64_t ack = acked_ + static_cast<uint16_t>(block_num - static_cast<uint16_t>(acked_));
+        if (ack == acked_) {
+            // server lost the first block of a window that's all out - go back once, later duplicates
+            // may answer blocks it got twice (sorcerer's apprentice) until everything sent by now is ACKed
+            count(Metrics::Counter::DuplicateAcks);
+            bool window_out = sent_ >= acked_ + windowsize_ || (final_block_ != 0 && sent_ >= final_block_);
+            if (window_out && acked_ >= rollback_guard_) {
+                rollback_guard_ = sent_ + 1;
+                timed_out_ = true;
+                count(Metrics::Counter::Retransmissions);
+                next_ = acked_ + 1;
+                sendWindow();
+            }
+            return;
+        }
+        if (ack > sent_) return;
+
+        sampleRtt();
+        size_t acked_bytes = 0;
+        for (; acked_ < ack; acked_++) {
+            acked_bytes += window_.front().len;
+            window_.pop_front();    // buffer goes back to the pool
+        }
+        info.transferred_bytes += acked_bytes;
+        total_ += static_cast<std::streamsize>(acked_bytes);
+        count(Metrics::Counter::BytesSent, acked_bytes);
+        retries_ = config_.getMaxRetries();
+
+        if (final_block_ != 0 && acked_ == final_block_) return finish();
+
+        // ACK from the middle of the window - server lost the block after it, go back
+        if (next_ > acked_ + 1) count(Metrics::Counter::Retransmissions);
+        next_ = acked_ + 1;
+        sendWindow();
+    }
+
+    // sends every block the window allows, starting at next_ - the rest goes out on the next ACK/timeout if the socket buffer fills up
+    void sendWindow() {
+        SendBatch batch;
+        uint64_t batch_start = next_;
+
+        auto flush = [&]() {
+            size_t queued = static_cast<size_t>(next_ - batch_start);
+            size_t sent = batch.flush(sockfd, comm_addr_);
+            next_ = batch_start + sent;
+            batch_start = next_;
+            if (sent == queued) return true;
+
+            auto errnum = getOsError();
+            if (errnum != WOULDBLOCK_OS_ERR && errnum != EAGAIN && errnum != ENOBUFS)
+                abort(TftpError(TftpError::ErrorType::OS, errnum, "Failed to send data"));
+            return false;
+        };
+
+        while (next_ <= acked_ + windowsize_ && (final_block_ == 0 || next_ <= final_block_)) {
+            const Chunk& chunk = loadChunk(static_cast<size_t>(next_ - acked_ - 1));
+            if (chunk.len < blksize_) final_block_ = next_;
+
+            batch.add(next_, chunk.data.get(), chunk.len);
+            next_++;
+            if (batch.full() && !flush()) break;
+        }
+        if (!batch.empty()) flush();
+        if (done) return;
+
+        sent_ = std::max(sent_, next_ - 1);
+        sent_at_ = std::chrono::steady_clock::now();
+        deadline = sent_at_ + rto_.get();
+    }
+
+    // window_[i], read from the stream the first time it's needed
+    const Chunk& loadChunk(size_t i) {
+        while (window_.size() <= i) {
+            Chunk& chunk = window_.emplace_back();
+            chunk.data = BlockPool::getInstance().acquire(blksize_);
+            in_->read(reinterpret_cast<char*>(chunk.data.get()), blksize_);
+            chunk.len = static_cast<size_t>(in_->gcount());
+        }
+        return window_[i];
+    }
+
+    void sendRequest() {
+        if (sendto(sockfd, reinterpret_cast<char*>(request_.data()), static_cast<int>(request_.size()), 0, (struct sockaddr*)&remote_addr_, sizeof(remote_addr_)) == -1)
+            return abort(TftpError(TftpError::ErrorType::OS, getOsError(), "Failed to send request"));
+        count(type_ == Type::Read ? Metrics::Counter::ReadRequests : Metrics::Counter::WriteRequests);
+        sent_at_ = std::chrono::steady_clock::now();
+        deadline = sent_at_ + rto_.get();
+    }
+
+    void sendAck(uint64_t block_num) {
+        uint8_t ack[4] = { 0, static_cast<uint8_t>(TftpOpcode::Ack), static_cast<uint8_t>((block_num >> 8) & 0xFF), static_cast<uint8_t>(block_num & 0xFF) };
+        if (sendto(sockfd, reinterpret_cast<char*>(ack), 4, 0, (struct sockaddr*)&comm_addr_, sizeof(comm_addr_)) == -1)
+            return abort(TftpError(TftpError::ErrorType::OS, getOsError(), "Failed to send ack"));
+        window_received_ = 0;
+        sent_at_ = std::chrono::steady_clock::now();
+        deadline = sent_at_ + rto_.get();
+    }
+
+    void sendError(const struct sockaddr_in& to, TftpError::ErrorCode code, std::string_view msg) {
+        uint8_t buffer[DefaultBlockSize + 4];
+        PacketWriter packet(buffer, sizeof(buffer));
+        packet.opcode(TftpOpcode::Error).word(static_cast<uint16_t>(code)).string(msg.substr(0, sizeof(buffer) - 5));
+        if (sendto(sockfd, reinterpret_cast<char*>(buffer), static_cast<int>(packet.size()), 0, (struct sockaddr*)&to, sizeof(to)) != -1)
+            Metrics::getInstance().error(Metrics::Side::Client, true, static_cast<uint16_t>(code));
+    }
+
+    // DATA from the server of the transfer this socket had before, which didn't get our final ACK - it's ACKed
+    // again and not taken for an answer to our request. Anything else from there could be the new transfer.
+    bool stale(const struct sockaddr_in& from, const uint8_t* packet, size_t len) {
+        if (len < 4 || packet[1] != static_cast<uint8_t>(TftpOpcode::Data) || !sameAddress(from, previous_peer_)) return false;
+        uint8_t ack[4] = { 0, static_cast<uint8_t>(TftpOpcode::Ack), packet[2], packet[3] };
+        sendto(sockfd, reinterpret_cast<char*>(ack), 4, 0, (struct sockaddr*)&from, sizeof(from));
+        return true;
+    }
+
+    void rejectStranger(const struct sockaddr_in& from) {
+        sendError(from, TftpError::ErrorCode::UnknownTransferId, "Transfer ID unknown");
+    }
+
+    // answer to what went out at sent_at_ - only if nothing was resent in between
+    void sampleRtt() {
+        if (!timed_out_) {
+            auto rtt = std::chrono::steady_clock::now() - sent_at_;
+            rto_.sample(std::chrono::duration_cast<RtoEstimator::duration>(rtt));
+            Metrics::getInstance().observe(Metrics::Side::Client, Metrics::Histogram::BlockRtt, rtt);
+        }
+        timed_out_ = false;
+    }
+
+    void finish() {
+        if (!done && !failure_) observe(Metrics::Histogram::TransferTime, started_at_);
+        done = true;
+        window_.clear();
+    }
+
+    void abort(const TftpError& err) {
+        failure_ = std::make_exception_ptr(err);
+        finish();
+    }
+};
+
+/* One event loop and the transfers it drives - poller token is slot index + 1, 0 is the wakeup socket.
+ * Only the thread running poll() touches the table, other threads hand transfers over through submit(). */
+class AsyncClient::Loop {
+public:
+    std::atomic<size_t> active;     // submitted and not completed yet
+
+    Loop() : active(0), wakeup_(INVALID_SOCKET), events_(256), next_sweep_(std::chrono::steady_clock::now()), running_(true) {
+    #ifdef _WIN32
+        WSADATA wsaData;
+        if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0)
+            throw TftpError(TftpError::ErrorType::OS, getOsError(), "Failed to initialize Winsock");
+    #endif
+
+        // submit() sends a byte to this one to interrupt a wait - works with every Poller backend
+        wakeup_addr_ = {};
+        wakeup_addr_.sin_family = AF_INET;
+        wakeup_addr_.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t addr_len = sizeof(wakeup_addr_);
+        if ((wakeup_ = socket(AF_INET, SOCK_DGRAM, 0)) == INVALID_SOCKET)
+            throw TftpError(TftpError::ErrorType::OS, getOsError(), "Failed to create socket");
+        if (bind(wakeup_, (struct sockaddr*)&wakeup_addr_, sizeof(wakeup_addr_)) < 0 ||
+            getsockname(wakeup_, (struct sockaddr*)&wakeup_addr_, &addr_len) < 0) {
+            auto errnum = getOsError();
+            clean_sockfd(wakeup_);
+            throw TftpError(TftpError::ErrorType::OS, errnum, "Failed to bind socket");
+        }
+        setNonBlocking(wakeup_);
+        poller_.add(wakeup_, 0);
+    }
+
+    ~Loop() {
+        // nothing is left hanging - every transfer still around completes with an error
+        for (auto& transfer : submitted_) {
+            transfer->cancel();
+            transfer->complete();
+        }
+        for (auto& transfer : transfers_) {
+            if (!transfer) continue;
+            transfer->cancel();
+            transfer->complete();
+            poller_.remove(transfer->sockfd);
+        }
+        for (auto& endpoint : spare_) clean_sockfd(endpoint.sockfd);
+        poller_.remove(wakeup_);
+        clean_sockfd(wakeup_);
+    }
+
+    Loop(const Loop&) = delete;
+    Loop& operator=(const Loop&) = delete;
+
+    // from the thread driving poll() there's no need to interrupt it
+    void submit(std::unique_ptr<Transfer> transfer, bool wakeup = true) {
+        active++;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            submitted_.push_back(std::move(transfer));
+        }
+        if (wakeup) wake();
+    }
+
+    // finished transfers leave their sockets to the next ones started, instead of closing them
+    void recycle() { recycle_ = true; }
+
+    void poll(std::chrono::milliseconds timeout) {
+        using clock = std::chrono::steady_clock;
+
+        adopt();
+        auto now = clock::now();
+        auto wait = std::chrono::ceil<std::chrono::milliseconds>(std::min(next_sweep_, now + timeout) - now);
+        size_t n = poller_.wait(events_, static_cast<int>(std::max<int64_t>(wait.count(), 0)));
+
+        for (size_t i = 0; i < n; i++) {
+            if (events_[i].token == 0) {
+                drainWakeups();
+                continue;
+            }
+
+            size_t slot = static_cast<size_t>(events_[i].token - 1);
+            if (slot >= transfers_.size() || !transfers_[slot] || transfers_[slot]->done) continue;
+
+            Transfer& t = *transfers_[slot];
+            t.onReadable();
+            if (t.done) {
+                finished_.push_back(slot);
+                continue;
+            }
+
+            next_sweep_ = std::min(next_sweep_, t.deadline);
+            t.reportProgress();
+        }
+
+        for (size_t slot : finished_) release(slot);
+        finished_.clear();
+        adopt();
+
+        // timers - only walk the table once the earliest deadline we know of has passed
+        now = clock::now();
+        if (now < next_sweep_) return;
+
+        next_sweep_ = now + std::chrono::seconds(1);
+        for (size_t slot = 0; slot < transfers_.size(); slot++) {
+            if (!transfers_[slot]) continue;
+            Transfer& t = *transfers_[slot];
+
+            if (now >= t.deadline) t.onTimeout();
+            if (t.done) {
+                release(slot);
+                continue;
+            }
+
+            t.reportProgress(now);
+            next_sweep_ = std::min(next_sweep_, t.deadline);
+            if (t.wantsProgress()) next_sweep_ = std::min(next_sweep_, t.progress.deadline());
+        }
+    }
+
+    void run() {
+        while (running_) poll(std::chrono::seconds(1));
+    }
+
+    void stop() {
+        running_ = false;
+        wake();
+    }
+
+private:
+    Poller poller_;
+    socket_t wakeup_;
+    struct sockaddr_in wakeup_addr_;
+    std::mutex mutex_;
+    std::vector<std::unique_ptr<Transfer>> submitted_;  // guarded by mutex_, started on the loop's thread
+
+    std::vector<std::unique_ptr<Transfer>> transfers_;
+    std::vector<size_t> free_slots_;
+    std::vector<size_t> finished_;
+    std::vector<Poller::Event> events_;
+    std::chrono::steady_clock::time_point next_sweep_;
+    std::atomic<bool> running_;
+    bool recycle_ = false;
+    std::vector<Transfer::Endpoint> spare_;     // recycled sockets waiting for a transfer
+
+    void wake() {
+        uint8_t byte = 0;
+        sendto(wakeup_, reinterpret_cast<char*>(&byte), 1, 0, (struct sockaddr*)&wakeup_addr_, sizeof(wakeup_addr_));
+    }
+
+    void drainWakeups() {
+        uint8_t byte;
+        while (::recv(wakeup_, reinterpret_cast<char*>(&byte), 1, 0) >= 0) {}
+    }
+
+    // starts whatever was submitted since the last round
+    void adopt() {
+        std::vector<std::unique_ptr<Transfer>> submitted;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            submitted.swap(submitted_);
+        }
+
+        for (auto& transfer : submitted) {
+            if (!spare_.empty()) {
+                transfer->reuse(std::move(spare_.back()));
+                spare_.pop_back();
+            }
+            transfer->start();
+            if (transfer->done) {
+                if (recycle_ && transfer->reusable()) spare_.push_back(transfer->detach());
+                transfer->complete();
+                active--;
+                continue;
+            }
+
+            size_t slot;
+            if (free_slots_.empty()) {
+                slot = transfers_.size();
+                transfers_.emplace_back();
+            } else {
+                slot = free_slots_.back();
+                free_slots_.pop_back();
+            }
+
+            poller_.add(transfer->sockfd, slot + 1);
+            next_sweep_ = std::min(next_sweep_, transfer->deadline);
+            transfers_[slot] = std::move(transfer);
+        }
+    }
+
+    void release(size_t slot) {
+        std::unique_ptr<Transfer> transfer = std::move(transfers_[slot]);
+        free_slots_.push_back(slot);
+        poller_.remove(transfer->sockfd);
+        if (recycle_ && transfer->reusable()) spare_.push_back(transfer->detach());
+        transfer->complete();
+        active--;
+    }
+};
+
+AsyncClient::AsyncClient(size_t threads, std::chrono::milliseconds callback_interval)
+    : callback_interval_(callback_interval), next_loop_(0) {
+    for (size_t i = 0; i < std::max<size_t>(threads, 1); i++) loops_.push_back(std::make_unique<Loop>());
+    for (size_t i = 0; i < threads; i++) threads_.emplace_back([loop = loops_[i].get()] { loop->run(); });
+}
+
+AsyncClient::~AsyncClient() {
+    for (auto& loop : loops_) loop->stop();
+    for (auto& t : threads_) t.join();
+    loops_.clear();     // aborts what's left, from this thread
+}
+
+void AsyncClient::send(const std::string& remote_addr, const std::string& filename, std::istream& data, CompletionCallback done,
+                       Client::ProgressCallback progress) {
+    submit(std::make_unique<Transfer>(Transfer::Type::Write, remote_addr, filename, &data, nullptr, std::move(done), std::move(progress), callback_interval_));
+}
+
+void AsyncClient::recv(const std::string& remote_addr, const std::string& filename, std::ostream& data, CompletionCallback done,
+                       Client::ProgressCallback progress) {
+    submit(std::make_unique<Transfer>(Transfer::Type::Read, remote_addr, filename, nullptr, &data, std::move(done), std::move(progress), callback_interval_));
+}
+
+std::future<std::streamsize> AsyncClient::send(const std::string& remote_addr, const std::string& filename, std::istream& data) {
+    auto promise = std::make_shared<std::promise<std::streamsize>>();
+    send(remote_addr, filename, data, [promise](std::streamsize bytes, std::exception_ptr error) {
+        if (error) promise->set_exception(error);
+        else promise->set_value(bytes);
+    });
+    return promise->get_future();
+}
+
+std::future<std::streamsize> AsyncClient::recv(const std::string& remote_addr, const std::string& filename, std::ostream& data) {
+    auto promise = std::make_shared<std::promise<std::streamsize>>();
+    recv(remote_addr, filename, data, [promise](std::streamsize bytes, std::exception_ptr error) {
+        if (error) promise->set_exception(error);
+        else promise->set_value(bytes);
+    });
+    return promise->get_future();
+}
+
+size_t AsyncClient::poll(std::chrono::milliseconds timeout) {
+    if (!threads_.empty()) throw std::logic_error("AsyncClient::poll() is for clients without threads of their own");
+    loops_[0]->poll(timeout);
+    return loops_[0]->active;
+}
+
+size_t AsyncClient::getActiveTransfers() const {
+    size_t active = 0;
+    for (auto& loop : loops_) active += loop->active;
+    return active;
+}
+
+void AsyncClient::submit(std::unique_ptr<Transfer> transfer) {
+    loops_[next_loop_++ % loops_.size()]->submit(std::move(transfer));
+}
+
+size_t Client::recvMany(const std::string& remote_addr, std::vector<Fetch>& files, size_t max_concurrent) {
+    AsyncClient::Loop loop;
+    loop.recycle();     // a lane's socket and buffers go from one file to the next
+    size_t lanes = std::max<size_t>(max_concurrent, 1);
+    size_t next = 0;
+    size_t succeeded = 0;
+
+    // completions only record the result - the next files are started here, between polls
+    while (true) {
+        for (; next < files.size() && loop.active < lanes; next++) {
+            Fetch& fetch = files[next];
+            loop.submit(std::make_unique<AsyncClient::Transfer>(AsyncClient::Transfer::Type::Read, remote_addr, fetch.filename, nullptr, fetch.data,
+                [&fetch, &succeeded](std::streamsize bytes, std::exception_ptr error) {
+                    fetch.bytes = bytes;
+                    fetch.error = error;
+                    if (!error) succeeded++;
+                }, nullptr, std::chrono::milliseconds(1000)), false);
+        }
+        if (loop.active == 0) break;
+        loop.poll(std::chrono::seconds(1));
+    }
+    return succeeded;
+}
@@ -0,0 +1,69 @@
+#include "../inc/block_pool.hpp"
+
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+using namespace tftp;
+
+BlockPool::Buffer BlockPool::acquire(size_t size) {
+    if (size > SlabSize) throw std::invalid_argument("Block buffer larger than a slab");
+
+    uint8_t size_class = MinClass;
+    while ((static_cast<size_t>(1) << size_class) < size) size_class++;
+
+    SizeClass& sc = classes_[size_class - MinClass];
+    std::lock_guard<std::mutex> lock(sc.mutex);
+    if (sc.free.empty()) {
+        uint8_t* slab = allocateSlab();
+        size_t buffer_size = static_cast<size_t>(1) << size_class;
+        for (size_t offset = 0; offset < SlabSize; offset += buffer_size) sc.free.push_back(slab + offset);
+    }
+
+    uint8_t* buffer = sc.free.back();
+    sc.free.pop_back();
+    return Buffer(buffer, Deleter { size_class });
+}
+
+void BlockPool::release(uint8_t size_class, uint8_t* buffer) {
+    if (buffer == nullptr) return;
+
+    SizeClass& sc = classes_[size_class - MinClass];
+    std::lock_guard<std::mutex> lock(sc.mutex);
+    sc.free.push_back(buffer);
+}
+
+bool BlockPool::findSlab(const uint8_t* ptr, size_t& index, uint8_t*& base) {
+    std::lock_guard<std::mutex> lock(slabs_mutex_);
+    auto it = slabs_.upper_bound(ptr);
+    if (it == slabs_.begin()) return false;
+    --it;
+    if (ptr >= it->first + SlabSize) return false;
+
+    index = it->second;
+    base = const_cast<uint8_t*>(it->first);
+    return true;
+}
+
+uint8_t* BlockPool::allocateSlab() {
+    uint8_t* slab = allocateSlabMemory();
+    std::lock_guard<std::mutex> lock(slabs_mutex_);
+    slabs_.emplace(slab, slabs_.size());
+    return slab;
+}
+
+uint8_t* BlockPool::allocateSlabMemory() {
+#ifdef __linux__
+    if (Config::getInstance().getHugePages()) {
+        // explicit huge pages need to be reserved by the admin, transparent ones are the fallback
+        void* slab = mmap(nullptr, SlabSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (slab == MAP_FAILED) {
+            slab = mmap(nullptr, SlabSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (slab == MAP_FAILED) throw std::bad_alloc();
+            madvise(slab, SlabSize, MADV_HUGEPAGE);
+        }
+        return static_cast<uint8_t*>(slab);
+    }
+#endif
+    return static_cast<uint8_t*>(::operator new(SlabSize, std::align_val_t(4096)));
+}
@@ -1,7 +1,219 @@
 #include "../inc/tftp.hpp"
+#include "../inc/block_pool.hpp"
+#include "../inc/datagram_batch.hpp"
+#include "../inc/packet.hpp"
+#include "../inc/progress.hpp"
+#include "../inc/rto.hpp"
+#include "../inc/spsc_ring.hpp"
+#include "../inc/thread_pool.hpp"
+#include <map>
 
 using namespace tftp;
 
+// one block of file data, buffer comes from the shared pool and is reused until the chunk is destroyed
+struct Chunk {
+	BlockPool::Buffer data;
+	size_t len = 0;
+};
+
+// request packets are sized by the filename, not the block size - opcode, mode and every option we send fit in the rest
+static size_t requestSize(const std::string& filename) {
+	return filename.size() + 128;
+}
+
+// first answer to a request - a server ignoring blksize sends 512 byte blocks whatever we asked for
+static size_t responseSize(const Config& config) {
+	return std::max<size_t>(config.getBlockSize(), 512) + 4;
+}
+
+static void count(Metrics::Counter counter, uint64_t n = 1) {
+	Metrics::getInstance().add(Metrics::Side::Client, counter, n);
+}
+
+static void observe(Metrics::Histogram histogram, std::chrono::steady_clock::duration value) {
+	Metrics::getInstance().observe(Metrics::Side::Client, histogram, value);
+}
+
+// ERROR packet from the server, to be thrown
+static TftpError serverError(const uint8_t* packet, size_t len) {
+	ErrorView error = {};
+	decodeError(packet, len, error);
+	Metrics::getInstance().error(Metrics::Side::Client, false, error.code);
+	return TftpError(TftpError::ErrorType::Tftp, error.code, std::string(error.message));
+}
+
+#ifdef USE_PARALLEL_FILE_IO
+// slots for the file I/O ring - bounded by max_queue_size, but always room for a full window.
+// Capped as well, a few MB of read-ahead/write-behind is plenty and slots keep their buffers for reuse.
+static size_t ringCapacity(const Config& config) {
+	size_t by_memory = static_cast<size_t>(config.getMaxQueueSize() / config.getBlockSize());
+	return std::max<size_t>(static_cast<size_t>(config.getWindowSize()) + 1, std::min<size_t>(by_memory, 1024));
+}
+#endif
+
+// RFC 2090 - DATA comes to the group from the server's transfer socket (comm_addr), starting wherever the session is.
+// Only the master client ACKs; the others keep what they can and wait to be promoted (a unicast OACK with mc=1)
+// to get the rest. Whoever is done ACKs the final block, so the server drops it from the session.
+static std::streamsize recvMulticast(socket_t sockfd, const struct sockaddr_in& comm_addr, const std::string& multicast_val,
+		uint16_t blksize_val, uint16_t windowsize_val, std::ostream& data, Client::Progress& progress_data, std::chrono::steady_clock::time_point started_at,
+		const std::function<void()>& report_progress) {
+	const Config& config = Config::getInstance();
+
+	// addr,port,mc
+	struct ip_mreq group = {};
+	uint16_t group_port = 0;
+	bool master = false;
+	{
+		size_t first = multicast_val.find(',');
+		size_t second = first == std::string::npos ? std::string::npos : multicast_val.find(',', first + 1);
+		unsigned mc = 0;
+		std::string_view value(multicast_val);
+		if (second == std::string::npos || !parseNumber(value.substr(first + 1, second - first - 1), group_port) || !parseNumber(value.substr(second + 1), mc))
+			throw TftpError(TftpError::ErrorType::Tftp, 0, "Malformed OACK");
+		master = mc != 0;
+		if (inet_pton(AF_INET, multicast_val.substr(0, first).c_str(), &group.imr_multiaddr) != 1)
+			throw TftpError(TftpError::ErrorType::Tftp, 0, "Malformed OACK");
+	}
+	group.imr_interface.s_addr = htonl(INADDR_ANY);
+	if (!config.getMulticastInterface().empty()) inet_pton(AF_INET, config.getMulticastInterface().c_str(), &group.imr_interface);
+
+	struct GroupSocket {
+		socket_t fd;
+		~GroupSocket() {
+		#ifdef _WIN32
+			closesocket(fd);
+		#else
+			close(fd);
+		#endif
+		}
+	} group_socket { socket(AF_INET, SOCK_DGRAM, 0) };
+	socket_t group_sockfd = group_socket.fd;
+	if (group_sockfd < 0) throw TftpError(TftpError::ErrorType::OS, getOsError(), "Failed to create socket");
+
+	// every client on this host listening for the group shares its port
+	int reuse = 1;
+	struct sockaddr_in group_addr = {};
+	group_addr.sin_family = AF_INET;
+	group_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	group_addr.sin_port = htons(group_port);
+	if (setsockopt(group_sockfd, SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<const char*>(&reuse), sizeof(reuse)) == -1 ||
+		bind(group_sockfd, (struct sockaddr*)&group_addr, sizeof(group_addr)) == -1 ||
+		setsockopt(group_sockfd, IPPROTO_IP, IP_ADD_MEMBERSHIP, reinterpret_cast<const char*>(&group), sizeof(group)) == -1)
+		throw TftpError(TftpError::ErrorType::OS, getOsError(), "Failed to join multicast group");
+	reserveWindow(group_sockfd, windowsize_val, blksize_val);
+
+	std::vector<uint8_t> packet(static_cast<size_t>(blksize_val) + 4);
+	std::map<uint64_t, std::vector<uint8_t>> ahead;	// blocks past next, until the gap before them is filled
+	size_t ahead_limit = std::max<size_t>(windowsize_val, static_cast<size_t>(config.getMaxQueueSize() / blksize_val));
+
+	uint64_t next = 1;			// next block for the stream
+	uint64_t final_block = 0;	// unknown until the short block shows up
+	uint64_t acked = 0;			// last block ACKed as master
+	bool gap_acked = false;		// already told the server where to resume
+	std::streamsize total_size = 0;
+	int retries = config.getMaxRetries();
+	auto deadline = std::chrono::steady_clock::now() + config.getRetransmitTimeout();
+
+	auto send_ack = [&](uint64_t block) {
+		uint8_t ack_buffer[4] = { 0, static_cast<uint8_t>(TftpOpcode::Ack), static_cast<uint8_t>((block >> 8) & 0xFF), static_cast<uint8_t>(block & 0xFF) };
+		if (sendto(sockfd, reinterpret_cast<char*>(ack_buffer), 4, 0, (struct sockaddr*)&comm_addr, sizeof(comm_addr)) == -1)
+			throw TftpError(TftpError::ErrorType::OS, getOsError(), "Failed to send ack");
+		acked = block;
+	};
+	auto deliver = [&](const uint8_t* payload, size_t len) {
+		if (next == 1) observe(Metrics::Histogram::FirstData, std::chrono::steady_clock::now() - started_at);
+		count(Metrics::Counter::BytesReceived, len);
+		data.write(reinterpret_cast<const char*>(payload), len);
+		total_size += len;
+		progress_data.transferred_bytes += len;
+		if (len < blksize_val) final_block = next;
+		next++;
+	};
+
+	if (master) send_ack(0);
+
+	while (final_block == 0 || next <= final_block) {
+		report_progress();
+
+		struct pollfd pfds[2] = {};
+		pfds[0].fd = sockfd;
+		pfds[0].events = POLLIN;
+		pfds[1].fd = group_sockfd;
+		pfds[1].events = POLLIN;
+
+		auto wait = std::chrono::ceil<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+	#ifdef _WIN32
+		int ready = wait.count() > 0 ? WSAPoll(pfds, 2, static_cast<int>(wait.count())) : 0;
+	#else
+		int ready = wait.count() > 0 ? poll(pfds, 2, static_cast<int>(wait.count())) : 0;
+	#endif
+		if (ready < 0 && getOsError() == EINTR) continue;
+		if (ready == 0) {
+			// master says where it is, everyone else just keeps waiting for the server
+			count(Metrics::Counter::Timeouts);
+			if (--retries == 0) throw TftpError(TftpError::ErrorType::Tftp, 0, "Max retries exceeded");
+			if (master) send_ack(next - 1);
+			deadline = std::chrono::steady_clock::now() + config.getRetransmitTimeout();
+			continue;
+		}
+
+		for (int i = 0; i < 2; i++) {
+			if (!(pfds[i].revents & (POLLIN | POLLERR))) continue;
+
+			struct sockaddr_in from = {};
+			socklen_t from_len = sizeof(from);
+			int32_t len = recvfrom(pfds[i].fd, reinterpret_cast<char*>(packet.data()), static_cast<int>(packet.size()), 0, (struct sockaddr*)&from, &from_len);
+			if (len < 0) throw TftpError(TftpError::ErrorType::OS, getOsError(), "Failed to receive response");
+			if (!sameAddress(from, comm_addr) || len < 4) continue;
+
+			uint16_t block_num = (packet[2] << 8) | (packet[3] & 0xFF);
+			switch (packet[1]) {
+			case static_cast<uint8_t>(TftpOpcode::Oack): {
+				// promoted (or our answer to it got lost) - tell the server what we already have
+				std::string promoted;
+				std::streamsize tsize_val = 0;
+				uint16_t blksize_ack = blksize_val, windowsize_ack = windowsize_val;
+				parseOack(packet.data(), len, blksize_ack, windowsize_ack, tsize_val, &promoted);
+				if (promoted.empty() || promoted.back() != '1') break;
+				master = true;
+				send_ack(next - 1);
+			} break;
+			case static_cast<uint8_t>(TftpOpcode::Data): {
+				if (len - 4 > blksize_val) throw TftpError(TftpError::ErrorType::Tftp, block_num, "Block too large");
+				retries = config.getMaxRetries();
+				deadline = std::chrono::steady_clock::now() + config.getRetransmitTimeout();
+
+				if (block_num < next) {
+					// retransmission of something we have - server is behind us, ACK once so it skips ahead
+					if (master && !gap_acked) send_ack(next - 1);
+					gap_acked = true;
+				} else if (block_num == next) {
+					deliver(packet.data() + 4, len - 4);
+					for (auto it = ahead.begin(); it != ahead.end() && it->first == next; it = ahead.erase(it)) deliver(it->second.data(), it->second.size());
+					gap_acked = false;
+				} else {
+					if (ahead.size() < ahead_limit) ahead.emplace(block_num, std::vector<uint8_t>(packet.begin() + 4, packet.begin() + len));
+					if (master && !gap_acked) send_ack(next - 1);	// lost one, server goes back to it
+					gap_acked = true;
+				}
+			} break;
+			case static_cast<uint8_t>(TftpOpcode::Error): {
+				throw serverError(packet.data(), static_cast<size_t>(len));
+			}
+			default:
+				break;
+			}
+		}
+
+		// one ACK per window (RFC 7440) - may jump further when buffered blocks filled in
+		if (master && next - 1 >= acked + windowsize_val) send_ack(next - 1);
+	}
+
+	// master or not, we're done - server moves on to the next client
+	send_ack(final_block);
+	return total_size;
+}
+
 void Client::send (
     const std::string& remote_addr_str,
     const std::string& filename,
@@ -37,7 +249,9 @@ void Client::send (
         }
 
         inet_pton(AF_INET, ip.c_str(), &remote_addr.sin_addr);
-        remote_addr.sin_port = htons(std::stoi(port));
+        uint16_t port_val = 0;
+        if (!parseNumber(port, port_val)) throw TftpError(TftpError::ErrorType::OS, 0, "Invalid port");
+        remote_addr.sin_port = htons(port_val);
     }
 
     if (remote_addr.sin_addr.s_addr == INADDR_NONE)
@@ -53,237 +267,241 @@ void Client::send (
 	socket_t sockfd = socket(AF_INET, SOCK_DGRAM, 0);
 	if (sockfd < 0) throw TftpError(TftpError::ErrorType::OS, getOsError(), "Failed to create socket");
 
+	// state shared with the pool tasks - must outlive them
+    Progress progress_data(length);
+#ifdef USE_PARALLEL_FILE_IO
+	SpscRing<Chunk> data_ring(ringCapacity(config));
+#endif
+
 	CleanupGuard guard(sockfd);
 
 	if (bind(sockfd, (struct sockaddr*)&local_addr, sizeof(local_addr)) == -1)
 		throw TftpError(TftpError::ErrorType::OS, getOsError(), "Failed to bind socket");
+	auto retransmit_timeout = config.getRetransmitTimeout();
 #ifdef _WIN32
-	DWORD timeout = config.getTimeout() * 1000;
+	DWORD timeout = static_cast<DWORD>(std::chrono::ceil<std::chrono::milliseconds>(retransmit_timeout).count());
 #else
-	struct timeval timeout = { config.getTimeout(), 0 };
+	struct timeval timeout = { static_cast<time_t>(retransmit_timeout.count() / 1000000), static_cast<suseconds_t>(retransmit_timeout.count() % 1000000) };
 #endif
 	if (setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, reinterpret_cast<const char*>(&timeout), sizeof(timeout)) == -1 ||
 		setsockopt(sockfd, SOL_SOCKET, SO_SNDTIMEO, reinterpret_cast<const char*>(&timeout), sizeof(timeout)) == -1)
 		throw TftpError(TftpError::ErrorType::OS, getOsError(), "Failed to set socket timeout");
 
-	uint8_t* buffer = new uint8_t[config.getBlockSize()]();
-	uint8_t* recv_buffer = new uint8_t[config.getBlockSize()]();
+	uint8_t* buffer = new uint8_t[requestSize(filename)]();
+	uint8_t* recv_buffer = new uint8_t[responseSize(config)]();
 
 	guard.guardNew(buffer);
 	guard.guardNew(recv_buffer);
 
 	/* Create and send the request */
-	uint16_t buffer_offset = 2;
 	int32_t recv_offset = -1;
-	buffer[1] = static_cast<uint8_t>(TftpOpcode::WriteRequest);
-
 	uint16_t blksize_val = config.getBlockSize();
-	std::string blksize_str = std::to_string(blksize_val);
-	std::string tsize_str = std::to_string(length);
-	std::string timeout_str = std::to_string(config.getTimeout());
-
-	strncpy_inc_offset(buffer, filename.c_str(), filename.size(), buffer_offset);
-	strncpy_inc_offset(buffer, "octet", 5, buffer_offset);
-
-	strncpy_inc_offset(buffer, "tsize", 5, buffer_offset);
-	strncpy_inc_offset(buffer, tsize_str.c_str(), tsize_str.size(), buffer_offset);
-
-	strncpy_inc_offset(buffer, "blksize", 7, buffer_offset);
-	strncpy_inc_offset(buffer, blksize_str.c_str(), blksize_str.size(), buffer_offset);
-
-	strncpy_inc_offset(buffer, "timeout", 8, buffer_offset);
-	strncpy_inc_offset(buffer, timeout_str.c_str(), timeout_str.size(), buffer_offset);
-
-	if (sendto(sockfd, reinterpret_cast<char*>(buffer), buffer_offset, 0, (struct sockaddr*)&remote_addr, sizeof(remote_addr)) == -1)
+	uint16_t windowsize_val = config.getWindowSize();
+
+	PacketWriter request(buffer, requestSize(filename));
+	request.opcode(TftpOpcode::WriteRequest).string(filename).string("octet")
+		.option("tsize", length)
+		.option("blksize", blksize_val)
+		.option("timeout", config.getTimeout())
+		.option("windowsize", windowsize_val);
+	if (config.getUTimeout() > 0) request.option("utimeout", config.getUTimeout());
+
+	auto started_at = std::chrono::steady_clock::now();
+	if (sendto(sockfd, reinterpret_cast<char*>(buffer), static_cast<int>(request.size()), 0, (struct sockaddr*)&remote_addr, sizeof(remote_addr)) == -1)
 		throw TftpError(TftpError::ErrorType::OS, getOsError(), "Failed to send request");
+	count(Metrics::Counter::WriteRequests);
 
 	/* Receive the server response and save new address of the server */
 	struct sockaddr_in comm_addr = {};
 	socklen_t comm_addr_len = sizeof(comm_addr);
 
-	if ((recv_offset = recvfrom(sockfd, (char*)(recv_buffer), config.getBlockSize(), 0, (struct sockaddr*)&comm_addr, &comm_addr_len)) == -1)
+	if ((recv_offset = recvfrom(sockfd, (char*)(recv_buffer), static_cast<int>(responseSize(config)), 0, (struct sockaddr*)&comm_addr, &comm_addr_len)) == -1)
 		throw TftpError(TftpError::ErrorType::OS, getOsError(), "Failed to receive response");
 	if (recv_offset < 4) throw TftpError(TftpError::ErrorType::Tftp, 0, "Invalid response");
 
 	/* Parse the response */
 	switch (recv_buffer[1]) {
-	case static_cast<uint8_t>(TftpOpcode::Oack):
-		// TODO: check if params match
+	case static_cast<uint8_t>(TftpOpcode::Oack): {
+		std::streamsize tsize_ack_val = length;
+		parseOack(recv_buffer, recv_offset, blksize_val, windowsize_val, tsize_ack_val);
 		break;
+	}
 	case static_cast<uint8_t>(TftpOpcode::Ack):
 		blksize_val = 512;
+		windowsize_val = 1;
 		break;
 	case static_cast<uint8_t>(TftpOpcode::Error): {
-		// auto err_msg = readStringFromBuffer(recv_buffer + 4, recv_offset - 4);
-		std::string err_msg(recv_offset - 3, '\0');
-		std::copy(recv_buffer + 4, recv_buffer + recv_offset, err_msg.begin());
-		throw TftpError(TftpError::ErrorType::Tftp, (recv_buffer[2] << 8) | (recv_buffer[3] & 0xFF), err_msg);
+		throw serverError(recv_buffer, static_cast<size_t>(recv_offset));
 	}
 	default:
 		throw TftpError(TftpError::ErrorType::Tftp, recv_buffer[1], "Invalid response opcode");
 	}
 
-	bool kill_child_threads = false;
-    Progress progress_data(length);
-
 	try {
-	/* Progress callback thread */
-	std::thread progress_thread;
-
-	if (progress_callback) {
-		progress_thread = std::thread ([&progress_callback, &progress_data, &callback_interval, &kill_child_threads] {
-			while (progress_data.transferred_bytes < progress_data.total_bytes && !kill_child_threads) {
-				std::this_thread::sleep_for(callback_interval);
-				progress_callback(std::ref(progress_data));
-			}
-		});
-
-		guard.guardThread(std::move(progress_thread));
-	}
+	/* Progress is reported by the sending loop itself, between packets */
+	ProgressThrottle progress(callback_interval, static_cast<uint64_t>(std::max<std::streamsize>(config.getProgressBytes(), 0)));
 
 	/* Data chunking and transfer */
-	uint16_t block_num = 1;
-	char data_header[4] = { 0, static_cast<uint8_t>(TftpOpcode::Data), 0, 0 };
+	/* Chunks of blksize_val, the last one is shorter (possibly empty). chunk(i) is block acked_block + 1 + i,
+	 * blocks stay around for retransmission until they're ACKed and dropped. */
 #ifdef USE_PARALLEL_FILE_IO
-	std::queue<std::unique_ptr<std::vector<uint8_t>>> data_queue;
-	std::mutex data_queue_mutex;
-	size_t max_data_queue_size = config.getMaxQueueSize() / blksize_val;
-
-	/* Chunk data into vectors with max. size of config.getBlockSize(), except the last one */
-	std::thread data_chunker([&data, &data_queue, &data_queue_mutex, blksize_val, max_data_queue_size, &kill_child_threads] {
-		std::unique_ptr<std::vector<uint8_t>> data_chunk = std::make_unique<std::vector<uint8_t>>(blksize_val);
-		while (data.read(reinterpret_cast<char*>(data_chunk->data()), blksize_val) && !kill_child_threads) {
-			while (data_queue.size() >= max_data_queue_size) continue;
-
-			std::lock_guard<std::mutex> lock(data_queue_mutex);
-			data_queue.push(std::move(data_chunk));
-			data_chunk = std::make_unique<std::vector<uint8_t>>(blksize_val);
+	// read-ahead on the shared pool - fills whatever room the ring has, every ACKed block makes room again
+	bool read_all = false;	// reader side only
+	SerialTask data_chunker([&data, &data_ring, &read_all, blksize_val] {
+		Chunk* data_chunk;
+		while (!read_all && (data_chunk = data_ring.tryAcquire()) != nullptr) {
+			if (!data_chunk->data) data_chunk->data = BlockPool::getInstance().acquire(blksize_val);
+			data.read(reinterpret_cast<char*>(data_chunk->data.get()), blksize_val);
+			data_chunk->len = static_cast<size_t>(data.gcount());
+
+			read_all = data_chunk->len < blksize_val;
+			data_ring.publish();
 		}
-		data_chunk->resize(data.gcount());
-		std::lock_guard<std::mutex> lock(data_queue_mutex);
-		data_queue.push(std::move(data_chunk));
-		});
+	});
+	data_chunker.schedule();
 
-	guard.guardThread(std::move(data_chunker));
+	auto chunk = [&](size_t i) -> const Chunk& { return *data_ring.peek(i); };
+	auto drop_chunk = [&]() {
+		data_ring.release();
+		data_chunker.schedule();
+	};
+#else
+	std::deque<Chunk> in_flight;
+	auto chunk = [&](size_t i) -> const Chunk& {
+		while (in_flight.size() <= i) {
+			Chunk& data_chunk = in_flight.emplace_back();
+			data_chunk.data = BlockPool::getInstance().acquire(blksize_val);
+			data.read(reinterpret_cast<char*>(data_chunk.data.get()), blksize_val);
+			data_chunk.len = static_cast<size_t>(data.gcount());
+		}
+		return in_flight[i];
+	};
+	auto drop_chunk = [&]() { in_flight.pop_front(); };	// buffer goes back to the pool
 #endif
-	/* Data sending loop */
 
-	// wait for single data chunk to be available (data_queue.front() will throw if empty)
-#ifdef USE_PARALLEL_FILE_IO
-	while (data_queue.size() == 0) continue;
-#endif
+	/* Data sending loop - up to windowsize_val blocks in flight (RFC 7440), 1 is plain lock-step.
+	 * A window goes out in as few syscalls as possible, and responses are drained a batch at a time. */
+	uint64_t acked_block = 0;
+	uint64_t next_block = 1;
+	uint64_t sent_block = 0;	// highest block sent so far - anything above it can't be ACKed
+	uint64_t final_block = 0;	// unknown until the short chunk shows up
+	uint64_t rollback_guard = 0;	// duplicate ACKs below this block don't roll the window back again
 	int retries = config.getMaxRetries();
-	bool size_divisible = length % blksize_val == 0;
-
-	do {
-		// pop the front data chunk
-	#ifdef USE_PARALLEL_FILE_IO
-		std::unique_ptr<std::vector<uint8_t>> data_chunk = nullptr;
-		{
-			std::lock_guard<std::mutex> lock(data_queue_mutex);
-			data_chunk = std::move(data_queue.front());
-			data_queue.pop();
-		}
-	#else
-		std::unique_ptr<std::vector<uint8_t>> data_chunk = std::make_unique<std::vector<uint8_t>>(blksize_val);
-		data.read(reinterpret_cast<char*>(data_chunk->data()), blksize_val);
-		data_chunk->resize(data.gcount());
-	#endif
+	std::chrono::steady_clock::time_point deadline;
+	std::chrono::steady_clock::time_point sent_at;
+	RtoEstimator rto(config.getRetransmitTimeout(), config.getAdaptiveTimeout());
+	bool timed_out = false;		// window was resent - its ACK can't be timed (Karn)
+
+	SendBatch batch;
+	RecvBatch responses(16, config.getBlockSize());
+	auto flush_batch = [&]() {
+		size_t queued = batch.size();
+		if (batch.flush(sockfd, comm_addr) != queued)
+			throw TftpError(TftpError::ErrorType::OS, getOsError(), "Failed to send data");
+	};
 
-		// set the buffer offset to the size of the data chunk
-		buffer_offset = static_cast<uint16_t>(data_chunk->size());	// this is one of conditions for the last chunk detection
+	while (final_block == 0 || acked_block < final_block) {
+		if (progress_callback && progress.due(progress_data.transferred_bytes)) progress_callback(progress_data);
 
-		// create the data Message with multiple buffers (header + data)
-		data_header[2] = block_num >> 8;
-		data_header[3] = block_num & 0xFF;
+		// send everything the window allows
+		uint64_t first_block = next_block;
+		while (next_block <= acked_block + windowsize_val && (final_block == 0 || next_block <= final_block)) {
+			const Chunk& data_chunk = chunk(next_block - acked_block - 1);
+			if (data_chunk.len < blksize_val) final_block = next_block;
 
-#ifdef _WIN32
-		WSABUF packet[2];
-		packet[0].buf = data_header;
-		packet[0].len = 4;
-		packet[1].buf = reinterpret_cast<char*>(data_chunk->data());
-		packet[1].len = buffer_offset;
-#else
-		struct iovec packet[2];
-		packet[0].iov_base = data_header;
-		packet[0].iov_len = 4;
-		packet[1].iov_base = data_chunk->data();
-		packet[1].iov_len = buffer_offset;
-
-		struct msghdr msg = {};
-		msg.msg_name = &comm_addr;
-		msg.msg_namelen = comm_addr_len;
-		msg.msg_iov = packet;
-		msg.msg_iovlen = 2;
-#endif
-		// send the data Message
-	resend_data_packet:
-#ifdef _WIN32
-		DWORD bytes_sent;
-		DWORD flags = 0;
+			batch.add(next_block, data_chunk.data.get(), data_chunk.len);
+			next_block++;
+			if (batch.full()) flush_batch();
+		}
+		if (!batch.empty()) flush_batch();
+		sent_block = std::max(sent_block, next_block - 1);
+		if (next_block != first_block) {
+			sent_at = std::chrono::steady_clock::now();
+			deadline = sent_at + rto.get();
+		}
 
-		if (WSASendTo(sockfd, packet, 2, &bytes_sent, flags, (struct sockaddr*)&comm_addr, comm_addr_len, nullptr, nullptr) == SOCKET_ERROR)
-#else
-		if (sendmsg(sockfd, &msg, 0) == -1)
-#endif
-		throw TftpError(TftpError::ErrorType::OS, getOsError(), "Failed to send data");
-		
-		// receive the server response (exp. ack)
-		if ((recv_offset = recvfrom(sockfd, reinterpret_cast<char*>(recv_buffer), config.getBlockSize(), 0, (struct sockaddr*)&comm_addr, &comm_addr_len)) == -1) {
+		// receive the server responses (exp. acks)
+		if (!waitReadable(sockfd, deadline)) {
+			timed_out = true;
+			count(Metrics::Counter::Timeouts);
+			if (!rto.backoff() && --retries == 0) throw TftpError(TftpError::ErrorType::Tftp, 0, "Max retries exceeded");
+			count(Metrics::Counter::Retransmissions);
+			next_block = acked_block + 1;	// resend the whole window
+			continue;
+		}
+		int received = responses.receive(sockfd);
+		if (received < 0) {
 			auto errn = getOsError();
-
-			switch (errn) {
-			case TIMEOUT_OS_ERR:
-				retries--;
-				if (retries == 0) throw TftpError(TftpError::ErrorType::Tftp, 0, "Max retries exceeded");
-				goto resend_data_packet;
-			default:
-				throw TftpError(TftpError::ErrorType::OS, errn, "Failed to receive response");
-			}
+			if (errn == TIMEOUT_OS_ERR || errn == WOULDBLOCK_OS_ERR || errn == EAGAIN) continue;
+			throw TftpError(TftpError::ErrorType::OS, errn, "Failed to receive response");
 		}
 
-		// parse the server response
-		switch (recv_buffer[1]) {
-		case static_cast<uint8_t>(TftpOpcode::Ack): {
-			uint16_t block_num_ack = (recv_buffer[2] << 8) | (recv_buffer[3] & 0xFF);
-			if (block_num_ack != block_num) {
-				retries--;
-				if (retries == 0) throw TftpError(TftpError::ErrorType::Tftp, 0, "Max retries exceeded");
-				goto resend_data_packet;
+		for (int i = 0; i < received; i++) {
+			uint8_t* packet = responses.data(i);
+			recv_offset = static_cast<int32_t>(responses.length(i));
+			if (!sameAddress(responses.from(i), comm_addr) || recv_offset < 4) continue;
+
+			// parse the server response
+			switch (packet[1]) {
+			case static_cast<uint8_t>(TftpOpcode::Ack): {
+				uint16_t block_num_ack = (packet[2] << 8) | (packet[3] & 0xFF);
+				uint64_t ack = acked_block + static_cast<uint16_t>(block_num_ack - static_cast<uint16_t>(acked_block));
+				if (ack == acked_block) {
+					// server lost the first block of a window that's all out - go back once, later duplicates
+					// may answer blocks it got twice (sorcerer's apprentice) until everything sent by now is ACKed
+					count(Metrics::Counter::DuplicateAcks);
+					bool window_out = sent_block >= acked_block + windowsize_val || (final_block != 0 && sent_block >= final_block);
+					if (window_out && acked_block >= rollback_guard) {
+						rollback_guard = sent_block + 1;
+						timed_out = true;
+						count(Metrics::Counter::Retransmissions);
+						next_block = acked_block + 1;
+					}
+					break;
+				}
+				if (ack > sent_block) break;
+
+				if (!timed_out) {
+					auto rtt = std::chrono::steady_clock::now() - sent_at;
+					rto.sample(std::chrono::duration_cast<RtoEstimator::duration>(rtt));
+					observe(Metrics::Histogram::BlockRtt, rtt);
+				}
+				timed_out = false;
+
+				size_t acked_bytes = 0;
+				for (; acked_block < ack; acked_block++) {
+					acked_bytes += chunk(0).len;
+					drop_chunk();
+				}
+				progress_data.transferred_bytes += acked_bytes;
+				count(Metrics::Counter::BytesSent, acked_bytes);
+				retries = config.getMaxRetries();
+
+				// ACK from the middle of the window - server lost the block after it, go back
+				if (next_block > acked_block + 1) count(Metrics::Counter::Retransmissions);
+				next_block = acked_block + 1;
+			} break;
+			case static_cast<uint8_t>(TftpOpcode::Error): {
+				throw serverError(packet, static_cast<size_t>(recv_offset));
+			}
+			default:
+				throw TftpError(TftpError::ErrorType::Tftp, packet[1], "Invalid response opcode");
 			}
-			block_num++;
-
-			progress_data.transferred_bytes += buffer_offset;
-
-		} break;
-		case static_cast<uint8_t>(TftpOpcode::Error): {
-			// auto err_msg = readStringFromBuffer(recv_buffer + 4, recv_offset - 4);
-			std::string err_msg(recv_offset - 3, '\0');
-			std::copy(recv_buffer + 4, recv_buffer + recv_offset, err_msg.begin());
-			throw TftpError(TftpError::ErrorType::Tftp, (recv_buffer[2] << 8) | (recv_buffer[3] & 0xFF), err_msg);
-		}
-		default:
-			throw TftpError(TftpError::ErrorType::Tftp, recv_buffer[1], "Invalid response opcode");
 		}
-	} while (buffer_offset == blksize_val);
-
-	/* send empty data packet to signal end of transfer if there wasn't any data packet
-	 * with size smaller than config.getBlockSize() */
-	if (size_divisible) {
-		data_header[2] = block_num >> 8;
-		data_header[3] = block_num & 0xFF;
-
-		if (sendto(sockfd, reinterpret_cast<char*>(data_header), 4, 0, (struct sockaddr*)&comm_addr, comm_addr_len) == -1)
-			throw TftpError(TftpError::ErrorType::OS, getOsError(), "Failed to send data");
 	}
 
-	kill_child_threads = true;
+#ifdef USE_PARALLEL_FILE_IO
+	data_ring.close();
+#endif
 
 	} catch(...) {
-		kill_child_threads = true;
+	#ifdef USE_PARALLEL_FILE_IO
+		data_ring.close();	// no more read-ahead
+	#endif
 		throw;
 	}
 
+	observe(Metrics::Histogram::TransferTime, std::chrono::steady_clock::now() - started_at);
 	if (progress_callback) progress_callback(progress_data);
 
 	//guard.forceCleanup();
@@ -294,7 +512,8 @@ std::streamsize Client::recv (
     const std::string& filename,
     std::ostream& data,
     ProgressCallback progress_callback,
-    std::chrono::milliseconds callback_interval
+    std::chrono::milliseconds callback_interval,
+    std::streamsize offset
 ) {
 	// get library config
 	const Config& config = Config::getInstance();
@@ -323,7 +542,9 @@ std::streamsize Client::recv (
         }
 
         inet_pton(AF_INET, ip.c_str(), &remote_addr.sin_addr);
-        remote_addr.sin_port = htons(std::stoi(port));
+        uint16_t port_val = 0;
+        if (!parseNumber(port, port_val)) throw TftpError(TftpError::ErrorType::OS, 0, "Invalid port");
+        remote_addr.sin_port = htons(port_val);
     }
 
     if (remote_addr.sin_addr.s_addr == INADDR_NONE)
@@ -339,232 +560,258 @@ std::streamsize Client::recv (
 	socket_t sockfd = socket(AF_INET, SOCK_DGRAM, 0);
 	if (sockfd < 0) throw TftpError(TftpError::ErrorType::OS, getOsError(), "Failed to create socket");
 
+	// state shared with the pool tasks - must outlive them
+	Progress progress_data(0);
+#ifdef USE_PARALLEL_FILE_IO
+	SpscRing<Chunk> data_ring(ringCapacity(config));
+#endif
+
 	CleanupGuard guard(sockfd);
 
 	if (bind(sockfd, (struct sockaddr*)&local_addr, sizeof(local_addr)) == -1)
 		throw TftpError(TftpError::ErrorType::OS, getOsError(), "Failed to bind socket");
+	auto retransmit_timeout = config.getRetransmitTimeout();
 #ifdef _WIN32
-	DWORD timeout = config.getTimeout() * 1000;
+	DWORD timeout = static_cast<DWORD>(std::chrono::ceil<std::chrono::milliseconds>(retransmit_timeout).count());
 #else
-	struct timeval timeout = { config.getTimeout(), 0 };
+	struct timeval timeout = { static_cast<time_t>(retransmit_timeout.count() / 1000000), static_cast<suseconds_t>(retransmit_timeout.count() % 1000000) };
 #endif
 	if (setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, reinterpret_cast<const char*>(&timeout), sizeof(timeout)) == -1 || 
 		setsockopt(sockfd, SOL_SOCKET, SO_SNDTIMEO, reinterpret_cast<const char*>(&timeout), sizeof(timeout)) == -1)
 		throw TftpError(TftpError::ErrorType::OS, getOsError(), "Failed to set socket timeout");
+	reserveWindow(sockfd, config.getWindowSize(), config.getBlockSize());
 
 	/* Create and send the request */
-	uint8_t* buffer = new uint8_t[config.getBlockSize() + 4]();
-	uint8_t* recv_buffer = new uint8_t[config.getBlockSize() + 4]();
+	uint8_t* buffer = new uint8_t[requestSize(filename)]();
+	uint8_t* recv_buffer = new uint8_t[responseSize(config)]();
 
 	guard.guardNew(buffer);
 	guard.guardNew(recv_buffer);
 
-	uint16_t buffer_offset = 2;
 	int32_t recv_offset = -1;
-	buffer[1] = static_cast<uint8_t>(TftpOpcode::ReadRequest);
-
 	uint16_t blksize_val = config.getBlockSize();
-	std::string blksize_str = std::to_string(blksize_val);
-	std::string tsize_str = std::to_string(0);
+	uint16_t windowsize_val = config.getWindowSize();
 
-	strncpy_inc_offset(buffer, filename.c_str(), filename.size(), buffer_offset);
-	strncpy_inc_offset(buffer, "octet", 5, buffer_offset);
+	PacketWriter request(buffer, requestSize(filename));
+	request.opcode(TftpOpcode::ReadRequest).string(filename).string("octet")
+		.option("blksize", blksize_val)
+		.option("tsize", 0)
+		.option("windowsize", windowsize_val);
+	if (config.getUTimeout() > 0) request.option("utimeout", config.getUTimeout());
 
-	strncpy_inc_offset(buffer, "blksize", 7, buffer_offset);
-	strncpy_inc_offset(buffer, blksize_str.c_str(), blksize_str.size(), buffer_offset);
+	// a resumed read is ours alone - a multicast session starts wherever it is
+	if (offset > 0) request.option("offset", offset);
+	else if (config.getRequestMulticast()) request.option("multicast", "");
 
-	strncpy_inc_offset(buffer, "tsize", 5, buffer_offset);
-	strncpy_inc_offset(buffer, tsize_str.c_str(), tsize_str.size(), buffer_offset);
-
-	if (sendto(sockfd, reinterpret_cast<char*>(buffer), buffer_offset, 0, (struct sockaddr*)&remote_addr, sizeof(remote_addr)) == -1)
+	auto started_at = std::chrono::steady_clock::now();
+	if (sendto(sockfd, reinterpret_cast<char*>(buffer), static_cast<int>(request.size()), 0, (struct sockaddr*)&remote_addr, sizeof(remote_addr)) == -1)
 		throw TftpError(TftpError::ErrorType::OS, getOsError(), "Failed to send request");
+	count(Metrics::Counter::ReadRequests);
 
 	/* Receive the server response and save new address of the server */
 	struct sockaddr_in comm_addr = {};
 	socklen_t comm_addr_len = sizeof(comm_addr);
 
-	if ((recv_offset = recvfrom(sockfd, (char*)(recv_buffer), config.getBlockSize(), 0, (struct sockaddr*)&comm_addr, &comm_addr_len)) == -1)
+	if ((recv_offset = recvfrom(sockfd, (char*)(recv_buffer), static_cast<int>(responseSize(config)), 0, (struct sockaddr*)&comm_addr, &comm_addr_len)) == -1)
 		throw TftpError(TftpError::ErrorType::OS, getOsError(), "Failed to receive a valid response");
 
 	/* Parse the response and send the ack */
 
 	uint8_t ack_buffer[4] = { 0, static_cast<uint8_t>(TftpOpcode::Ack), 0, 0 };
-	uint16_t block_num = 1;
+	uint64_t block_num = 1;		// next block expected
 	std::streamsize total_size = 0;
 	std::streamsize expected_size = 0;
+	bool last_block_received = false;
+	std::string multicast_val;	// set if the server put us into a multicast session
+	std::streamsize skip = offset;	// leading bytes data already has - the server didn't take the offset and starts from 0
 
 	switch (recv_buffer[1]) {
 	case static_cast<uint8_t>(TftpOpcode::Oack): {
-		// read the options - save the tsize
-
-		size_t offset = 2;
-		while (offset < recv_offset) {
-			std::string option = readStringFromBuffer(recv_buffer + offset, recv_offset - offset);
-			offset += option.size() + 1;
-			std::string value = readStringFromBuffer(recv_buffer + offset, recv_offset - offset);
-			offset += value.size() + 1;
-
-			if (option == "tsize") {
-				expected_size = std::stoll(value);
-			}
-			else if (option == "blksize") {
-				uint16_t blksize_ack_val = std::stoi(value);
-
-				if (blksize_ack_val > blksize_val) throw TftpError(TftpError::ErrorType::Tftp, 0, "Invalid block size");
-				blksize_val = blksize_ack_val;
-			}
-		}
-
-	break;
+		std::streamsize offset_ack = 0;
+		parseOack(recv_buffer, recv_offset, blksize_val, windowsize_val, expected_size, &multicast_val, &offset_ack);
+		if (offset_ack < 0 || offset_ack > offset) throw TftpError(TftpError::ErrorType::Tftp, 0, "Invalid offset");
+		skip = offset - offset_ack;
+		progress_data.transferred_bytes = static_cast<size_t>(offset_ack);
+		break;
 	}
 	case static_cast<uint8_t>(TftpOpcode::Data): {	// negotiation broken, received first data packet
 		uint16_t recv_blknum = (recv_buffer[2] << 8) | (recv_buffer[3] & 0xFF);
 		if (recv_blknum != 1)
 			throw TftpError(TftpError::ErrorType::Tftp, recv_blknum, "Invalid block number");
 
-		blksize_val = recv_offset - 4;
-		data.write(reinterpret_cast<char*>(recv_buffer + 4), blksize_val);
+		blksize_val = 512;
+		windowsize_val = 1;
+		observe(Metrics::Histogram::FirstData, std::chrono::steady_clock::now() - started_at);
+		count(Metrics::Counter::BytesReceived, recv_offset - 4);
+		std::streamsize dropped = std::min<std::streamsize>(skip, recv_offset - 4);
+		data.write(reinterpret_cast<char*>(recv_buffer + 4 + dropped), recv_offset - 4 - dropped);
+		skip -= dropped;
 		ack_buffer[3] = recv_buffer[3];
 		block_num++;
-		total_size += blksize_val;
+		total_size += recv_offset - 4 - dropped;
+		progress_data.transferred_bytes += recv_offset - 4;
+		last_block_received = recv_offset - 4 < blksize_val;
 		break;
 	}
 	case static_cast<uint8_t>(TftpOpcode::Error): {
-		// auto err_msg = readStringFromBuffer(recv_buffer + 4, recv_offset - 4);
-		std::string err_msg(recv_offset - 3, '\0');
-		std::copy(recv_buffer + 4, recv_buffer + recv_offset, err_msg.begin());
-		throw TftpError(TftpError::ErrorType::Tftp, (recv_buffer[2] << 8) | (recv_buffer[3] & 0xFF), err_msg);
+		throw serverError(recv_buffer, static_cast<size_t>(recv_offset));
 	}
 	default:
 		throw TftpError(TftpError::ErrorType::Tftp, recv_buffer[1], "Invalid response opcode");
 	}
 
-	if (sendto(sockfd, reinterpret_cast<char*>(ack_buffer), 4, 0, (struct sockaddr*)&comm_addr, comm_addr_len) == -1)
+	// multicast: only the master answers the OACK, recvMulticast takes care of that
+	if (multicast_val.empty() && sendto(sockfd, reinterpret_cast<char*>(ack_buffer), 4, 0, (struct sockaddr*)&comm_addr, comm_addr_len) == -1)
 		throw TftpError(TftpError::ErrorType::OS, getOsError(), "Failed to send ack");
 
 	/* Data receiving loop */
 
-	bool kill_child_threads = false;
-	Progress progress_data(expected_size);
-	bool transfer_done = false;
+	progress_data.total_bytes = expected_size;
 	try {
-	// Progress callback thread
-	std::thread progress_thread;
-
-	if (progress_callback) {
-		progress_thread = std::thread([&progress_callback, &progress_data, &callback_interval, &kill_child_threads] {
-			while (progress_data.transferred_bytes < progress_data.total_bytes && !kill_child_threads) {
-				std::this_thread::sleep_for(callback_interval);
-				progress_callback(std::ref(progress_data));
-			}
-		});
-
-		guard.guardThread(std::move(progress_thread));
-	}
+	// progress is reported by the receiving loop itself, between packets
+	ProgressThrottle progress(callback_interval, static_cast<uint64_t>(std::max<std::streamsize>(config.getProgressBytes(), 0)));
+	auto report_progress = [&]() {
+		if (progress_callback && progress.due(progress_data.transferred_bytes)) progress_callback(progress_data);
+	};
 
 #ifdef USE_PARALLEL_FILE_IO
-    std::queue<std::unique_ptr<std::vector<uint8_t>>> data_queue;
-    std::mutex data_queue_mutex;
-
-	// data writer thread
-	std::thread data_writer([&data, &data_queue, &data_queue_mutex, &transfer_done] {
-		std::this_thread::sleep_for(std::chrono::seconds(2));
-
-		while (true) {
-			if (data_queue.size() == 0) {	// transfer errored-out or finished
-				if (transfer_done) break;
-				continue;
-			}
-			std::unique_ptr<std::vector<uint8_t>> data_chunk = nullptr;
-			{
-				std::lock_guard<std::mutex> lock(data_queue_mutex);
-				data_chunk = std::move(data_queue.front());
-				data_queue.pop();
-			}
-			data.write(reinterpret_cast<char*>(data_chunk->data()), data_chunk->size());
+	// writes on the shared pool - drains whatever is published, every new block schedules it again.
+	// Waited for when the transfer is over (or errored-out), so all of it is written by then.
+	SerialTask data_writer([&data, &data_ring] {
+		while (Chunk* data_chunk = data_ring.tryPeek()) {
+			data.write(reinterpret_cast<char*>(data_chunk->data.get()), data_chunk->len);
+			data_ring.release();
 		}
 	});
-	guard.guardThread(std::move(data_writer));
 #endif
 
 	int retries = config.getMaxRetries();
+	uint16_t window_received = 0;	// in-order blocks since the last ACK
+	bool gap_acked = false;			// already told the server where to resume
+
+	RtoEstimator rto(config.getRetransmitTimeout(), config.getAdaptiveTimeout());
+	bool timed_out = false;		// ACK was repeated - the block after it can't be timed (Karn)
+	std::chrono::steady_clock::time_point sent_at = std::chrono::steady_clock::now();	// ACK 0 / first ACK just went out
+	std::chrono::steady_clock::time_point deadline = sent_at + rto.get();
+
+	auto send_ack = [&](uint64_t ack_block) {
+		ack_buffer[2] = static_cast<uint8_t>((ack_block >> 8) & 0xFF);
+		ack_buffer[3] = static_cast<uint8_t>(ack_block & 0xFF);
+		if (sendto(sockfd, reinterpret_cast<char*>(ack_buffer), 4, 0, (struct sockaddr*)&comm_addr, comm_addr_len) == -1)
+			throw TftpError(TftpError::ErrorType::OS, getOsError(), "Failed to send ack");
+		window_received = 0;
+		sent_at = std::chrono::steady_clock::now();
+	};
+
+	if (!multicast_val.empty()) {
+		total_size = recvMulticast(sockfd, comm_addr, multicast_val, blksize_val, windowsize_val, data, progress_data, started_at, report_progress);
+		last_block_received = true;
+	}
+
+	// DATA is drained a batch (up to a window) at a time, coalesced by the kernel (GRO) where it can
+	bool offload = config.getOffload() && RecvBatch::enableOffload(sockfd);
+	RecvBatch blocks(std::min<size_t>(windowsize_val, 32), static_cast<size_t>(blksize_val) + 4, offload);
+
+	while (!last_block_received) {
+		report_progress();
 
-	do {
 		// receive the server response (exp. data)
-		if ((recv_offset = recvfrom(sockfd, reinterpret_cast<char*>(recv_buffer), config.getBlockSize() + 4, 0, (struct sockaddr*)&comm_addr, &comm_addr_len)) == -1) {
+		if (!waitReadable(sockfd, deadline)) {
+			timed_out = true;
+			count(Metrics::Counter::Timeouts);
+			if (!rto.backoff() && --retries == 0) throw TftpError(TftpError::ErrorType::Tftp, 0, "Max retries exceeded");
+			count(Metrics::Counter::Retransmissions);
+			send_ack(block_num - 1);
+			gap_acked = true;
+			deadline = std::chrono::steady_clock::now() + rto.get();
+			continue;
+		}
+		int received = blocks.receive(sockfd);
+		if (received < 0) {
 			auto errn = getOsError();
+			if (errn == TIMEOUT_OS_ERR || errn == WOULDBLOCK_OS_ERR || errn == EAGAIN) continue;
+			throw TftpError(TftpError::ErrorType::OS, errn, "Failed to receive response");
+		}
 
-			switch (errn) {
-			case TIMEOUT_OS_ERR:
-				if (--retries == 0) throw TftpError(TftpError::ErrorType::Tftp, 0, "Max retries exceeded");				
-
-				block_num--;
-				goto resend_ack;
+		for (int i = 0; i < received && !last_block_received; i++) {
+			uint8_t* packet = blocks.data(i);
+			recv_offset = static_cast<int32_t>(blocks.length(i));
+			if (!sameAddress(blocks.from(i), comm_addr) || recv_offset < 4) continue;
+
+			// parse the server response
+			switch (packet[1]) {
+			case static_cast<uint8_t>(TftpOpcode::Data): {
+				uint16_t recv_blknum = (packet[2] << 8) | (packet[3] & 0xFF);
+				if (recv_blknum != static_cast<uint16_t>(block_num)) {
+					// lost block or a retransmission of something we have - ACK the last good one once, server resumes after it
+					if (!gap_acked) {
+						count(Metrics::Counter::Retransmissions);
+						send_ack(block_num - 1);
+					}
+					gap_acked = true;
+					continue;
+				}
+				if (recv_offset - 4 > blksize_val)
+					throw TftpError(TftpError::ErrorType::Tftp, recv_blknum, "Block too large");
+				retries = config.getMaxRetries();
+				gap_acked = false;
+				if (window_received == 0) {	// first block since our last ACK
+					if (!timed_out) {
+						auto rtt = std::chrono::steady_clock::now() - sent_at;
+						rto.sample(std::chrono::duration_cast<RtoEstimator::duration>(rtt));
+						observe(Metrics::Histogram::BlockRtt, rtt);
+					}
+					timed_out = false;
+				}
+				if (block_num == 1) observe(Metrics::Histogram::FirstData, std::chrono::steady_clock::now() - started_at);
+				deadline = std::chrono::steady_clock::now() + rto.get();
+				break;
+			}
+			case static_cast<uint8_t>(TftpOpcode::Error): {
+				throw serverError(packet, static_cast<size_t>(recv_offset));
+			}
 			default:
-				throw TftpError(TftpError::ErrorType::OS, errn, "Failed to receive response");
+				throw TftpError(TftpError::ErrorType::Tftp, packet[1], "Invalid response opcode");
 			}
-		}
-
-		// parse the server response
-		switch (recv_buffer[1]) {
-		case static_cast<uint8_t>(TftpOpcode::Data): {
-			uint16_t recv_blknum = (recv_buffer[2] << 8) | (recv_buffer[3] & 0xFF);
-			if (recv_blknum != block_num) {
-				// resend the ack
-				if (--retries == 0) throw TftpError(TftpError::ErrorType::Tftp, 0, "Max retries exceeded");				
-
-				block_num--;
-				goto resend_ack;
+			std::streamsize dropped = std::min<std::streamsize>(skip, recv_offset - 4);
+			skip -= dropped;
+			#ifndef USE_PARALLEL_FILE_IO
+	        	data.write(reinterpret_cast<char*>(packet + 4 + dropped), recv_offset - 4 - dropped);
+			#else
+			{
+				Chunk* data_chunk = data_ring.acquire();	// parks while the writer is a full ring behind
+				if (!data_chunk->data) data_chunk->data = BlockPool::getInstance().acquire(blksize_val);
+				data_chunk->len = static_cast<size_t>(recv_offset - 4 - dropped);
+				std::memcpy(data_chunk->data.get(), packet + 4 + dropped, data_chunk->len);
+				data_ring.publish();
+				data_writer.schedule();
 			}
-			retries = config.getMaxRetries();
-			break;
-		}
-		case static_cast<uint8_t>(TftpOpcode::Error): {
-			// auto err_msg = readStringFromBuffer(recv_buffer + 4, recv_offset - 4);
-			std::string err_msg(recv_offset - 3, '\0');
-			std::copy(recv_buffer + 4, recv_buffer + recv_offset, err_msg.begin());
-			throw TftpError(TftpError::ErrorType::Tftp, (recv_buffer[2] << 8) | (recv_buffer[3] & 0xFF), err_msg);
-		}
-		default:
-			throw TftpError(TftpError::ErrorType::Tftp, recv_buffer[1], "Invalid response opcode");
-		}
-		#ifndef USE_PARALLEL_FILE_IO
-        	data.write(reinterpret_cast<char*>(recv_buffer + 4), recv_offset - 4);
-		#else
-		{
-			if (data_queue.size() > (size_t)config.getMaxQueueSize() / blksize_val) continue;
+			#endif
 
-			std::unique_ptr<std::vector<uint8_t>> data_chunk = std::make_unique<std::vector<uint8_t>>(recv_offset - 4);
-			std::copy(recv_buffer + 4, recv_buffer + recv_offset, data_chunk->data());
-			std::lock_guard<std::mutex> lock(data_queue_mutex);
-			data_queue.push(std::move(data_chunk));
-		}
-		#endif
+	        block_num++;
+	        total_size += recv_offset - 4 - dropped;
+			count(Metrics::Counter::BytesReceived, recv_offset - 4);
+			progress_data.transferred_bytes += recv_offset - 4;
+			last_block_received = recv_offset - 4 < blksize_val;
 
-	resend_ack:
-		// create and send the ack packet
-		ack_buffer[2] = recv_buffer[2];
-		ack_buffer[3] = recv_buffer[3];
-		if (sendto(sockfd, reinterpret_cast<char*>(ack_buffer), 4, 0, (struct sockaddr*)&comm_addr, comm_addr_len) == -1) {
-			throw TftpError(TftpError::ErrorType::OS, getOsError(), "Failed to send ack");
+			// one ACK per window (RFC 7440), and always for the last block
+			if (++window_received == windowsize_val || last_block_received)
+				send_ack(block_num - 1);
 		}
+	}
 
-        block_num++;
-        blksize_val = recv_offset - 4;
-        total_size += blksize_val;
-		
-		progress_data.transferred_bytes += blksize_val;
-	} while (blksize_val == config.getBlockSize());
-
-	transfer_done = true;
-	kill_child_threads = true;
+#ifdef USE_PARALLEL_FILE_IO
+	data_ring.close();
+#endif
 	
 	} catch(...) {
-		kill_child_threads = true;
-		transfer_done = true;
+	#ifdef USE_PARALLEL_FILE_IO
+		data_ring.close();
+	#endif
 		throw;
 	}
 
+	observe(Metrics::Histogram::TransferTime, std::chrono::steady_clock::now() - started_at);
 	if (progress_callback) progress_callback(progress_data);
 
 	//guard.forceCleanup();
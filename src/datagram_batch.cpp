@@ -0,0 +1,224 @@
+#include "../inc/datagram_batch.hpp"
+
+using namespace tftp;
+
+namespace {
+#ifdef __linux__
+    constexpr size_t MaxSegments = 64;          // UDP_MAX_SEGMENTS on older kernels
+    constexpr size_t MaxUdpPayload = 65507;     // a GSO send is still one UDP datagram as far as size limits go
+#endif
+}
+
+void SendBatch::add(uint64_t block_num, const uint8_t* payload, size_t payload_len) {
+    uint8_t* header = headers_[count_];
+    header[0] = 0;
+    header[1] = static_cast<uint8_t>(TftpOpcode::Data);
+    header[2] = static_cast<uint8_t>((block_num >> 8) & 0xFF);
+    header[3] = static_cast<uint8_t>(block_num & 0xFF);
+    payloads_[count_] = payload;
+    lengths_[count_] = payload_len;
+    count_++;
+}
+
+size_t SendBatch::flush(socket_t sockfd, const struct sockaddr_in& addr) {
+    size_t sent = sendFrom(sockfd, addr, 0);
+    count_ = 0;
+    return sent;
+}
+
+size_t SendBatch::sendFrom(socket_t sockfd, const struct sockaddr_in& addr, size_t first) {
+    size_t sent = 0;
+
+#ifdef __linux__
+    struct iovec iovecs[MaxBatch][2];
+    struct mmsghdr msgs[MaxBatch] = {};
+    for (size_t i = first; i < count_; i++) {
+        iovecs[i][0].iov_base = headers_[i];
+        iovecs[i][0].iov_len = 4;
+        iovecs[i][1].iov_base = const_cast<uint8_t*>(payloads_[i]);
+        iovecs[i][1].iov_len = lengths_[i];
+
+        msgs[i].msg_hdr.msg_name = const_cast<struct sockaddr_in*>(&addr);
+        msgs[i].msg_hdr.msg_namelen = sizeof(addr);
+        msgs[i].msg_hdr.msg_iov = iovecs[i];
+        msgs[i].msg_hdr.msg_iovlen = lengths_[i] > 0 ? 2 : 1;
+    }
+
+    while (first + sent < count_) {
+        int n = sendmmsg(sockfd, msgs + first + sent, static_cast<unsigned int>(count_ - first - sent), 0);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        sent += static_cast<size_t>(n);
+    }
+#else
+    for (size_t i = first; i < count_; i++, sent++) {
+        if (!sendDatagram(sockfd, addr, headers_[i], 4, payloads_[i], lengths_[i])) break;
+    }
+#endif
+
+    return sent;
+}
+
+size_t SendBatch::flushSegmented(socket_t sockfd, const struct sockaddr_in& addr, bool& offload) {
+#ifdef __linux__
+    if (!offload) return flush(sockfd, addr);
+
+    // iovecs of consecutive datagrams are adjacent, so a run of them is one msg_iov
+    struct iovec iovecs[MaxBatch * 2];
+    for (size_t i = 0; i < count_; i++) {
+        iovecs[2 * i].iov_base = headers_[i];
+        iovecs[2 * i].iov_len = 4;
+        iovecs[2 * i + 1].iov_base = const_cast<uint8_t*>(payloads_[i]);
+        iovecs[2 * i + 1].iov_len = lengths_[i];
+    }
+
+    struct mmsghdr msgs[MaxBatch] = {};
+    alignas(struct cmsghdr) uint8_t controls[MaxBatch][CMSG_SPACE(sizeof(uint16_t))] = {};
+    size_t firsts[MaxBatch];    // first datagram of every message
+    size_t segments[MaxBatch];  // and how many datagrams it carries
+    size_t msg_count = 0;
+
+    for (size_t i = 0; i < count_;) {
+        size_t segment_size = lengths_[i] + 4;
+        size_t max_segments = std::min(MaxSegments, MaxUdpPayload / segment_size);
+
+        // equally sized blocks, optionally closed by one shorter one (the final block) - GSO allows that
+        size_t j = i + 1;
+        while (j < count_ && j - i < max_segments && lengths_[j] == lengths_[i]) j++;
+        if (j < count_ && j - i < max_segments && lengths_[j] < lengths_[i]) j++;
+
+        struct msghdr& msg = msgs[msg_count].msg_hdr;
+        msg.msg_name = const_cast<struct sockaddr_in*>(&addr);
+        msg.msg_namelen = sizeof(addr);
+        msg.msg_iov = &iovecs[2 * i];
+        msg.msg_iovlen = 2 * (j - i);
+
+        if (j - i > 1) {
+            msg.msg_control = controls[msg_count];
+            msg.msg_controllen = sizeof(controls[msg_count]);
+            struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+            cmsg->cmsg_level = SOL_UDP;
+            cmsg->cmsg_type = UDP_SEGMENT;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+            uint16_t gso_size = static_cast<uint16_t>(segment_size);
+            std::memcpy(CMSG_DATA(cmsg), &gso_size, sizeof(gso_size));
+        }
+
+        firsts[msg_count] = i;
+        segments[msg_count] = j - i;
+        msg_count++;
+        i = j;
+    }
+
+    size_t sent = 0;
+    size_t msgs_sent = 0;
+    while (msgs_sent < msg_count) {
+        int n = sendmmsg(sockfd, msgs + msgs_sent, static_cast<unsigned int>(msg_count - msgs_sent), 0);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+
+            // old kernel, no checksum offload, segments over the route MTU, ... - fall back for good
+            bool unsupported = errno == EINVAL || errno == EIO || errno == EMSGSIZE || errno == ENOPROTOOPT || errno == EOPNOTSUPP;
+            if (unsupported && segments[msgs_sent] > 1) {
+                offload = false;
+                sent += sendFrom(sockfd, addr, firsts[msgs_sent]);
+            }
+            break;
+        }
+
+        for (int k = 0; k < n; k++) sent += segments[msgs_sent + k];
+        msgs_sent += static_cast<size_t>(n);
+    }
+
+    count_ = 0;
+    return sent;
+#else
+    offload = false;
+    return flush(sockfd, addr);
+#endif
+}
+
+RecvBatch::RecvBatch(size_t slots, size_t slot_size, bool offload)
+    : slot_size_(offload ? OffloadSlotSize : slot_size), offload_(offload) {
+    slots_ = std::max<size_t>(1, std::min(slots, BlockPool::SlabSize / slot_size_));
+    buffer_ = BlockPool::getInstance().acquire(slots_ * slot_size_);
+    addrs_.resize(slots_);
+
+#ifdef __linux__
+    const size_t control_size = CMSG_SPACE(sizeof(int));
+    iovecs_.resize(slots_);
+    msgs_.resize(slots_);
+    control_.resize(offload_ ? slots_ * control_size : 0);
+    for (size_t i = 0; i < slots_; i++) {
+        iovecs_[i].iov_base = slot(i);
+        iovecs_[i].iov_len = slot_size_;
+        msgs_[i].msg_hdr.msg_iov = &iovecs_[i];
+        msgs_[i].msg_hdr.msg_iovlen = 1;
+    }
+#endif
+}
+
+bool RecvBatch::enableOffload(socket_t sockfd) {
+#ifdef __linux__
+    int on = 1;
+    return setsockopt(sockfd, SOL_UDP, UDP_GRO, &on, sizeof(on)) == 0;
+#else
+    (void)sockfd;
+    return false;
+#endif
+}
+
+int RecvBatch::receive(socket_t sockfd) {
+    datagrams_.clear();
+
+#ifdef __linux__
+    const size_t control_size = CMSG_SPACE(sizeof(int));
+    for (size_t i = 0; i < slots_; i++) {
+        msgs_[i].msg_hdr.msg_name = &addrs_[i];
+        msgs_[i].msg_hdr.msg_namelen = sizeof(addrs_[i]);
+        if (offload_) {
+            msgs_[i].msg_hdr.msg_control = control_.data() + i * control_size;
+            msgs_[i].msg_hdr.msg_controllen = control_size;
+        }
+    }
+
+    int n;
+    do {
+        n = recvmmsg(sockfd, msgs_.data(), static_cast<unsigned int>(slots_), MSG_DONTWAIT, nullptr);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0) return -1;
+
+    for (size_t i = 0; i < static_cast<size_t>(n); i++) {
+        size_t len = msgs_[i].msg_len;
+        size_t segment_size = len;
+
+        if (offload_) {
+            struct msghdr& msg = msgs_[i].msg_hdr;
+            for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+                if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+                    int gso_size;
+                    std::memcpy(&gso_size, CMSG_DATA(cmsg), sizeof(gso_size));
+                    if (gso_size > 0) segment_size = static_cast<size_t>(gso_size);
+                }
+            }
+        }
+
+        // coalesced datagrams are back to back, all segment_size long except maybe the last one
+        size_t offset = 0;
+        do {
+            size_t segment_len = std::min(segment_size, len - offset);
+            datagrams_.push_back(Datagram { slot(i) + offset, segment_len, i });
+            offset += segment_len;
+        } while (offset < len);
+    }
+#else
+    socklen_t addr_len = sizeof(addrs_[0]);
+    int n = recvfrom(sockfd, reinterpret_cast<char*>(slot(0)), static_cast<int>(slot_size_), 0, (struct sockaddr*)&addrs_[0], &addr_len);
+    if (n < 0) return -1;
+    datagrams_.push_back(Datagram { slot(0), static_cast<size_t>(n), 0 });
+#endif
+
+    return static_cast<int>(datagrams_.size());
+}
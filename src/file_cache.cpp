@@ -0,0 +1,133 @@
+#include "../inc/file_cache.hpp"
+#include "../inc/thread_pool.hpp"
+
+using namespace tftp;
+
+FileCache::Handle FileCache::get(const std::filesystem::path& path, const OpenFileCache::Handle& file) {
+    size_t size;
+    std::filesystem::file_time_type mtime;
+    if (!describe(path, file, size, mtime)) return nullptr;
+
+    std::string key = path.string();
+    Handle entry = find(key, size, mtime);
+    if (entry) return entry;
+
+    // read outside the lock, other transfers keep being served meanwhile
+    entry = load(path, file, size, mtime);
+    if (entry) insert(key, entry);
+    return entry;
+}
+
+FileCache::Handle FileCache::lookup(const std::filesystem::path& path, const OpenFileCache::Handle& file) {
+    size_t size;
+    std::filesystem::file_time_type mtime;
+    if (!describe(path, file, size, mtime)) return nullptr;
+
+    std::string key = path.string();
+    Handle entry = find(key, size, mtime);
+    if (entry) return entry;
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!loading_.insert(key).second) return nullptr;   // already on its way
+    }
+    ThreadPool::getInstance().submit([this, path, file, size, mtime, key] {
+        Handle loaded = load(path, file, size, mtime);
+        if (loaded) insert(key, loaded);
+        std::lock_guard<std::mutex> lock(mutex_);
+        loading_.erase(key);
+    });
+    return nullptr;
+}
+
+// size and mtime of a regular file that fits the cache, false otherwise
+bool FileCache::describe(const std::filesystem::path& path, const OpenFileCache::Handle& file, size_t& size, std::filesystem::file_time_type& mtime) {
+    size_t capacity = static_cast<size_t>(std::max<std::streamsize>(Config::getInstance().getCacheSize(), 0));
+    if (capacity == 0) return false;
+
+    if (file) {
+        if (file->fd < 0) return false;
+        size = file->size;
+        mtime = file->mtime;
+    } else {
+        std::error_code ec;
+        if (!std::filesystem::is_regular_file(path, ec)) return false;
+        size = static_cast<size_t>(std::filesystem::file_size(path, ec));
+        if (ec) return false;
+        mtime = std::filesystem::last_write_time(path, ec);
+        if (ec) return false;
+    }
+    return size <= capacity;
+}
+
+FileCache::Handle FileCache::find(const std::string& key, size_t size, std::filesystem::file_time_type mtime) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = entries_.find(key);
+    if (it == entries_.end()) return nullptr;
+
+    const Entry& entry = *it->second.entry;
+    if (entry.size != size || entry.mtime != mtime) {
+        erase(it);      // changed on disk
+        return nullptr;
+    }
+    lru_.splice(lru_.begin(), lru_, it->second.lru);
+    return it->second.entry;
+}
+
+void FileCache::insert(const std::string& key, const Handle& entry) {
+    size_t capacity = static_cast<size_t>(std::max<std::streamsize>(Config::getInstance().getCacheSize(), 0));
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = entries_.find(key);
+    if (it != entries_.end()) erase(it);    // loaded concurrently - ours is as fresh
+    while (bytes_ + entry->size > capacity && !lru_.empty()) erase(entries_.find(lru_.back()));
+    if (bytes_ + entry->size > capacity) return;    // cache was shrunk meanwhile
+
+    lru_.push_front(key);
+    entries_.emplace(key, Slot { entry, lru_.begin() });
+    bytes_ += entry->size;
+}
+
+void FileCache::clear() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    entries_.clear();
+    lru_.clear();
+    bytes_ = 0;
+}
+
+size_t FileCache::getBytes() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return bytes_;
+}
+
+FileCache::Handle FileCache::load(const std::filesystem::path& path, const OpenFileCache::Handle& file, size_t size, std::filesystem::file_time_type mtime) {
+    auto entry = std::make_shared<Entry>();
+    entry->size = size;
+    entry->mtime = mtime;
+    if (size == 0) return entry;
+
+    if (file) {
+        entry->data.reset(new uint8_t[size]);
+        for (size_t got = 0; got < size;) {
+            size_t len = file->read(entry->data.get() + got, size - got, got);
+            if (len == 0) return nullptr;   // shrunk meanwhile
+            got += len;
+        }
+        return entry;
+    }
+
+    std::ifstream in(path, std::ios::binary);
+    if (!in.is_open()) return nullptr;
+    entry->data.reset(new uint8_t[size]);
+    in.read(reinterpret_cast<char*>(entry->data.get()), static_cast<std::streamsize>(size));
+
+    // shrunk while we were reading - don't cache half a file under the old size
+    if (static_cast<size_t>(in.gcount()) != size) return nullptr;
+    return entry;
+}
+
+void FileCache::erase(std::unordered_map<std::string, Slot>::iterator it) {
+    bytes_ -= it->second.entry->size;
+    lru_.erase(it->second.lru);
+    entries_.erase(it);
+}
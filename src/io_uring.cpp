@@ -0,0 +1,165 @@
+#include "../inc/io_uring.hpp"
+
+#ifdef TFTP_HAVE_IO_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+using namespace tftp;
+
+namespace {
+    int ioUringSetup(unsigned entries, struct io_uring_params* params) {
+        return static_cast<int>(syscall(__NR_io_uring_setup, entries, params));
+    }
+
+    int ioUringEnter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags, void* arg, size_t arg_size) {
+        return static_cast<int>(syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, arg_size));
+    }
+
+    int ioUringRegister(int fd, unsigned opcode, const void* arg, unsigned nr_args) {
+        return static_cast<int>(syscall(__NR_io_uring_register, fd, opcode, arg, nr_args));
+    }
+}
+
+IoUring::IoUring(unsigned entries)
+    : sq_ring_(MAP_FAILED), cq_ring_(MAP_FAILED), sqes_(static_cast<struct io_uring_sqe*>(MAP_FAILED)), sqe_tail_(0), submitted_(0) {
+    struct io_uring_params params = {};
+    params.flags = IORING_SETUP_CLAMP;
+
+    ring_fd_ = ioUringSetup(entries, &params);
+    if (ring_fd_ < 0) throw TftpError(TftpError::ErrorType::OS, errno, "Failed to set up io_uring");
+    features_ = params.features;
+
+    sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_size_ = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (features_ & IORING_FEAT_SINGLE_MMAP) sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+    sqes_size_ = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    sq_ring_ = mmap(nullptr, sq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQ_RING);
+    if (features_ & IORING_FEAT_SINGLE_MMAP) cq_ring_ = sq_ring_;
+    else cq_ring_ = mmap(nullptr, cq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_CQ_RING);
+    void* sqes = mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQES);
+    sqes_ = static_cast<struct io_uring_sqe*>(sqes);
+
+    if (sq_ring_ == MAP_FAILED || cq_ring_ == MAP_FAILED || sqes == MAP_FAILED) {
+        auto errnum = errno;
+        release();
+        throw TftpError(TftpError::ErrorType::OS, errnum, "Failed to map io_uring");
+    }
+
+    uint8_t* sq = static_cast<uint8_t*>(sq_ring_);
+    sq_head_ = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+    sq_tail_ = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    sq_mask_ = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    sq_array_ = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    sq_entries_ = params.sq_entries;
+    sqe_tail_ = submitted_ = *sq_tail_;
+
+    uint8_t* cq = static_cast<uint8_t*>(cq_ring_);
+    cq_head_ = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    cq_tail_ = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    cq_mask_ = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    cqes_ = reinterpret_cast<struct io_uring_cqe*>(cq + params.cq_off.cqes);
+}
+
+IoUring::~IoUring() {
+    release();
+}
+
+void IoUring::release() {
+    if (sqes_ != MAP_FAILED) munmap(sqes_, sqes_size_);
+    if (cq_ring_ != MAP_FAILED && cq_ring_ != sq_ring_) munmap(cq_ring_, cq_ring_size_);
+    if (sq_ring_ != MAP_FAILED) munmap(sq_ring_, sq_ring_size_);
+    if (ring_fd_ >= 0) close(ring_fd_);
+    sqes_ = static_cast<struct io_uring_sqe*>(MAP_FAILED);
+    sq_ring_ = cq_ring_ = MAP_FAILED;
+    ring_fd_ = -1;
+}
+
+bool IoUring::supported() {
+    static const bool supported = [] {
+        struct io_uring_params params = {};
+        int fd = ioUringSetup(2, &params);
+        if (fd < 0) return false;   // ENOSYS, or blocked by seccomp/sysctl
+        close(fd);
+
+        unsigned needed = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG;
+        return (params.features & needed) == needed;
+    }();
+    return supported;
+}
+
+struct io_uring_sqe* IoUring::getSqe() {
+    unsigned head = __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+    if (sqe_tail_ - head >= sq_entries_) return nullptr;
+
+    unsigned index = sqe_tail_ & *sq_mask_;
+    sq_array_[index] = index;
+    sqe_tail_++;
+
+    struct io_uring_sqe* sqe = &sqes_[index];
+    std::memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+bool IoUring::submit(unsigned wait_nr, int timeout_ms) {
+    __atomic_store_n(sq_tail_, sqe_tail_, __ATOMIC_RELEASE);
+
+    unsigned flags = wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0;
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg = {};
+    void* arg_ptr = nullptr;
+    size_t arg_size = 0;
+    if (wait_nr > 0 && timeout_ms >= 0) {
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = static_cast<long long>(timeout_ms % 1000) * 1000000;
+        arg.ts = reinterpret_cast<uint64_t>(&ts);
+        flags |= IORING_ENTER_EXT_ARG;
+        arg_ptr = &arg;
+        arg_size = sizeof(arg);
+    }
+
+    int ret = ioUringEnter(ring_fd_, sqe_tail_ - submitted_, wait_nr, flags, arg_ptr, arg_size);
+    if (ret >= 0) {
+        submitted_ += static_cast<unsigned>(ret);
+        return true;
+    }
+
+    // timed out, interrupted, or the completion queue is full (caller reaps first) - none of these are failures
+    return errno == ETIME || errno == EINTR || errno == EAGAIN || errno == EBUSY;
+}
+
+bool IoUring::registerFiles(unsigned n) {
+    struct io_uring_rsrc_register reg = {};
+    reg.nr = n;
+    reg.flags = IORING_RSRC_REGISTER_SPARSE;
+    if (ioUringRegister(ring_fd_, IORING_REGISTER_FILES2, &reg, sizeof(reg)) == 0) return true;
+
+    // older kernels: a table of -1s does the same
+    std::vector<int> fds(n, -1);
+    return ioUringRegister(ring_fd_, IORING_REGISTER_FILES, fds.data(), n) == 0;
+}
+
+bool IoUring::updateFile(unsigned index, int fd) {
+    struct io_uring_files_update update = {};
+    update.offset = index;
+    update.fds = reinterpret_cast<uint64_t>(&fd);
+    return ioUringRegister(ring_fd_, IORING_REGISTER_FILES_UPDATE, &update, 1) == 1;
+}
+
+bool IoUring::registerBuffers(unsigned n) {
+    struct io_uring_rsrc_register reg = {};
+    reg.nr = n;
+    reg.flags = IORING_RSRC_REGISTER_SPARSE;
+    return ioUringRegister(ring_fd_, IORING_REGISTER_BUFFERS2, &reg, sizeof(reg)) == 0;
+}
+
+bool IoUring::updateBuffer(unsigned index, void* base, size_t len) {
+    struct iovec iov = { base, len };
+    struct io_uring_rsrc_update2 update = {};
+    update.offset = index;
+    update.data = reinterpret_cast<uint64_t>(&iov);
+    update.nr = 1;
+    return ioUringRegister(ring_fd_, IORING_REGISTER_BUFFERS_UPDATE, &update, sizeof(update)) == 1;
+}
+#endif
@@ -0,0 +1,82 @@
+#include "../inc/mapped_file.hpp"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+using namespace tftp;
+
+bool MappedFile::map(const std::filesystem::path& path) {
+    unmap();
+
+#ifdef _WIN32
+    HANDLE file = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (file == INVALID_HANDLE_VALUE) return false;
+
+    LARGE_INTEGER file_size;
+    if (!GetFileSizeEx(file, &file_size) || GetFileType(file) != FILE_TYPE_DISK) {
+        CloseHandle(file);
+        return false;
+    }
+
+    size_ = static_cast<size_t>(file_size.QuadPart);
+    if (size_ > 0) {
+        HANDLE mapping = CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (mapping != nullptr) {
+            data_ = static_cast<const uint8_t*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+            CloseHandle(mapping);   // the view keeps the mapping alive
+        }
+    }
+    CloseHandle(file);
+
+    if (size_ > 0 && data_ == nullptr) {
+        size_ = 0;
+        return false;
+    }
+    mapped_ = true;
+    return true;
+#else
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+
+    struct stat st;
+    bool mapped = fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && map(fd, static_cast<size_t>(st.st_size));
+    close(fd);      // the mapping keeps the file alive
+    return mapped;
+#endif
+}
+
+bool MappedFile::map(int fd, size_t size) {
+    unmap();
+
+#ifdef _WIN32
+    (void)fd;
+    (void)size;
+    return false;
+#else
+    if (size > 0) {
+        void* data = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+        if (data == MAP_FAILED) return false;
+        data_ = static_cast<const uint8_t*>(data);
+        size_ = size;
+        madvise(data, size, MADV_SEQUENTIAL);
+    }
+    mapped_ = true;
+    return true;
+#endif
+}
+
+void MappedFile::unmap() {
+    if (data_ != nullptr) {
+    #ifdef _WIN32
+        UnmapViewOfFile(data_);
+    #else
+        munmap(const_cast<uint8_t*>(data_), size_);
+    #endif
+    }
+    data_ = nullptr;
+    size_ = 0;
+    mapped_ = false;
+}
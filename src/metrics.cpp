@@ -0,0 +1,126 @@
+#include "../inc/tftp.hpp"
+#include <iomanip>
+#include <sstream>
+
+using namespace tftp;
+
+namespace {
+    // upper bounds, 100us to 30s - from loopback RTTs up to boot images over a slow link
+    constexpr int64_t BucketBoundsNs[Metrics::Buckets] = {
+        100000, 250000, 500000,
+        1000000, 2500000, 5000000,
+        10000000, 25000000, 50000000,
+        100000000, 250000000, 500000000,
+        1000000000, 2500000000, 5000000000,
+        10000000000, 30000000000,
+    };
+
+    const char* const SideNames[Metrics::Sides] = { "client", "server" };
+
+    struct Family {
+        const char* name;
+        const char* help;
+    };
+
+    const Family CounterFamilies[Metrics::Counters] = {
+        { "tftp_read_requests_total", "Read requests sent (client) or accepted (server)." },
+        { "tftp_write_requests_total", "Write requests sent (client) or accepted (server)." },
+        { "tftp_bytes_sent_total", "Payload bytes sent and acknowledged." },
+        { "tftp_bytes_received_total", "Payload bytes received in order." },
+        { "tftp_retransmissions_total", "Windows or ACKs sent again after a timeout or a reported loss." },
+        { "tftp_timeouts_total", "Retransmission timer expirations." },
+        { "tftp_duplicate_acks_total", "Duplicate ACKs ignored." },
+    };
+
+    const Family HistogramFamilies[Metrics::Histograms] = {
+        { "tftp_first_data_seconds", "Time from read request to the first DATA block." },
+        { "tftp_block_rtt_seconds", "Round trip from a window or ACK to its answer." },
+        { "tftp_transfer_seconds", "Duration of successful transfers." },
+    };
+}
+
+void Metrics::observe(Side side, Histogram histogram, std::chrono::nanoseconds value) {
+    int64_t ns = std::max<int64_t>(value.count(), 0);
+    size_t bucket = 0;
+    while (bucket < Buckets && ns > BucketBoundsNs[bucket]) bucket++;
+
+    AtomicHistogram& h = histograms_[static_cast<size_t>(side)][static_cast<size_t>(histogram)];
+    h.buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+    h.sum_ns.fetch_add(static_cast<uint64_t>(ns), std::memory_order_relaxed);
+}
+
+Metrics::Snapshot Metrics::snapshot() const {
+    Snapshot snap = {};
+    for (size_t side = 0; side < Sides; side++) {
+        for (size_t i = 0; i < Counters; i++) snap.counters[side][i] = counters_[side][i].load(std::memory_order_relaxed);
+        for (size_t i = 0; i < ErrorCodes; i++) {
+            snap.errors_sent[side][i] = errors_sent_[side][i].load(std::memory_order_relaxed);
+            snap.errors_received[side][i] = errors_received_[side][i].load(std::memory_order_relaxed);
+        }
+        for (size_t i = 0; i < Histograms; i++) {
+            const AtomicHistogram& h = histograms_[side][i];
+            HistogramSnapshot& out = snap.histograms[side][i];
+            for (size_t b = 0; b <= Buckets; b++) {
+                out.buckets[b] = h.buckets[b].load(std::memory_order_relaxed);
+                out.count += out.buckets[b];
+            }
+            out.sum = static_cast<double>(h.sum_ns.load(std::memory_order_relaxed)) / 1e9;
+        }
+    }
+    return snap;
+}
+
+void Metrics::reset() {
+    for (size_t side = 0; side < Sides; side++) {
+        for (auto& c : counters_[side]) c.store(0, std::memory_order_relaxed);
+        for (auto& c : errors_sent_[side]) c.store(0, std::memory_order_relaxed);
+        for (auto& c : errors_received_[side]) c.store(0, std::memory_order_relaxed);
+        for (auto& h : histograms_[side]) {
+            for (auto& b : h.buckets) b.store(0, std::memory_order_relaxed);
+            h.sum_ns.store(0, std::memory_order_relaxed);
+        }
+    }
+}
+
+std::string Metrics::Snapshot::toPrometheus() const {
+    std::ostringstream out;
+    out << std::setprecision(9);
+
+    for (size_t i = 0; i < Counters; i++) {
+        out << "# HELP " << CounterFamilies[i].name << " " << CounterFamilies[i].help << "\n";
+        out << "# TYPE " << CounterFamilies[i].name << " counter\n";
+        for (size_t side = 0; side < Sides; side++)
+            out << CounterFamilies[i].name << "{side=\"" << SideNames[side] << "\"} " << counters[side][i] << "\n";
+    }
+
+    out << "# HELP tftp_errors_total ERROR packets, by TFTP error code.\n";
+    out << "# TYPE tftp_errors_total counter\n";
+    for (size_t side = 0; side < Sides; side++) {
+        for (size_t code = 0; code < ErrorCodes; code++) {
+            // untouched codes are left out, there are a lot of them
+            if (errors_sent[side][code] > 0)
+                out << "tftp_errors_total{side=\"" << SideNames[side] << "\",direction=\"sent\",code=\"" << code << "\"} " << errors_sent[side][code] << "\n";
+            if (errors_received[side][code] > 0)
+                out << "tftp_errors_total{side=\"" << SideNames[side] << "\",direction=\"received\",code=\"" << code << "\"} " << errors_received[side][code] << "\n";
+        }
+    }
+
+    for (size_t i = 0; i < Histograms; i++) {
+        const char* name = HistogramFamilies[i].name;
+        out << "# HELP " << name << " " << HistogramFamilies[i].help << "\n";
+        out << "# TYPE " << name << " histogram\n";
+        for (size_t side = 0; side < Sides; side++) {
+            const HistogramSnapshot& h = histograms[side][i];
+            uint64_t cumulative = 0;
+            for (size_t b = 0; b < Buckets; b++) {
+                cumulative += h.buckets[b];
+                out << name << "_bucket{side=\"" << SideNames[side] << "\",le=\"" << static_cast<double>(BucketBoundsNs[b]) / 1e9 << "\"} " << cumulative << "\n";
+            }
+            out << name << "_bucket{side=\"" << SideNames[side] << "\",le=\"+Inf\"} " << h.count << "\n";
+            out << name << "_sum{side=\"" << SideNames[side] << "\"} " << h.sum << "\n";
+            out << name << "_count{side=\"" << SideNames[side] << "\"} " << h.count << "\n";
+        }
+    }
+
+    return out.str();
+}
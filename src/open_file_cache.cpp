@@ -0,0 +1,207 @@
+#include "../inc/open_file_cache.hpp"
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#endif
+
+using namespace tftp;
+
+#ifdef __linux__
+namespace {
+    // something else may be under that name now
+    constexpr uint32_t NameEvents = IN_ATTRIB | IN_MODIFY | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO;
+    // a watched directory is gone or somewhere else, so is every path through it - or events were lost
+    constexpr uint32_t TreeEvents = IN_DELETE_SELF | IN_MOVE_SELF | IN_UNMOUNT | IN_Q_OVERFLOW;
+}
+#endif
+
+OpenFileCache::Entry::~Entry() {
+#ifdef __linux__
+    if (fd >= 0) close(fd);
+#endif
+}
+
+size_t OpenFileCache::Entry::read(uint8_t* buffer, size_t len, uint64_t offset) const {
+#ifdef __linux__
+    ssize_t got = pread(fd, buffer, len, static_cast<off_t>(offset));
+    return got > 0 ? static_cast<size_t>(got) : 0;
+#else
+    (void)buffer;
+    (void)len;
+    (void)offset;
+    return 0;
+#endif
+}
+
+OpenFileCache::OpenFileCache() : inotify_fd_(-1) {}
+
+OpenFileCache::~OpenFileCache() {
+#ifdef __linux__
+    if (inotify_fd_ >= 0) close(inotify_fd_);
+#endif
+}
+
+OpenFileCache::Handle OpenFileCache::get(const std::filesystem::path& root, const std::filesystem::path& path) {
+#ifdef __linux__
+    size_t capacity = Config::getInstance().getOpenFileCacheSize();
+    if (capacity == 0) return nullptr;
+
+    // the same spelling events are matched against - "." and trailing separators dropped
+    std::filesystem::path file = path.lexically_normal();
+    std::filesystem::path base = root.lexically_normal();
+    if (base == ".") base.clear();
+    else if (!base.has_filename() && base.has_relative_path()) base = base.parent_path();
+    std::string key = file.string();
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (inotify_fd_ < 0 && (inotify_fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0) return nullptr;
+    drain();
+
+    auto it = entries_.find(key);
+    if (it != entries_.end()) {
+        lru_.splice(lru_.begin(), lru_, it->second.lru);
+        return it->second.entry;
+    }
+
+    // watched before it's opened - any change from here on drops the entry again.
+    // A symlinked file can change where nothing is watched, it's left to the callers.
+    std::error_code ec;
+    if (!watchTree(base, file.parent_path()) || std::filesystem::is_symlink(file, ec)) return nullptr;
+    Handle entry = open(key);
+    if (!entry) return nullptr;
+
+    while (entries_.size() >= capacity && !lru_.empty()) erase(entries_.find(lru_.back()));
+    lru_.push_front(key);
+    entries_.emplace(key, Slot { entry, lru_.begin() });
+    return entry;
+#else
+    (void)root;
+    (void)path;
+    return nullptr;
+#endif
+}
+
+void OpenFileCache::clear() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    flush();
+}
+
+size_t OpenFileCache::size() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return entries_.size();
+}
+
+// applies whatever the kernel queued since the last call - nothing is waiting on the queue in between
+void OpenFileCache::drain() {
+#ifdef __linux__
+    alignas(struct inotify_event) char buffer[4096];
+    ssize_t len;
+    while ((len = read(inotify_fd_, buffer, sizeof(buffer))) > 0) {
+        const struct inotify_event* event;
+        for (char* p = buffer; p < buffer + len; p += sizeof(struct inotify_event) + event->len) {
+            event = reinterpret_cast<const struct inotify_event*>(p);
+            if (event->mask & TreeEvents) {
+                flush();
+                continue;
+            }
+
+            auto watch = watches_.find(event->wd);
+            if (watch == watches_.end()) continue;
+            if (event->mask & IN_IGNORED) {
+                for (const std::string& dir : watch->second) watched_.erase(dir);
+                watches_.erase(watch);
+                continue;
+            }
+            if (!(event->mask & NameEvents) || event->len == 0) continue;
+
+            for (const std::string& dir : watch->second) {
+                std::string key = (std::filesystem::path(dir) / event->name).string();
+                if (watched_.count(key) != 0) {
+                    flush();    // a directory on the way to cached paths
+                    break;
+                }
+                auto it = entries_.find(key);
+                if (it != entries_.end()) erase(it);
+            }
+        }
+    }
+#endif
+}
+
+bool OpenFileCache::watch(const std::filesystem::path& dir) {
+#ifdef __linux__
+    std::string name = dir.string();
+    if (watched_.count(name) != 0) return true;
+
+    int wd = inotify_add_watch(inotify_fd_, name.empty() ? "." : name.c_str(), NameEvents | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR);
+    if (wd < 0) return false;
+    watched_.emplace(name, wd);
+    watches_[wd].push_back(name);   // same directory through a symlink - same watch
+    return true;
+#else
+    (void)dir;
+    return false;
+#endif
+}
+
+// root and every directory from it down to dir, so a rename anywhere on the way is seen
+bool OpenFileCache::watchTree(const std::filesystem::path& root, const std::filesystem::path& dir) {
+    std::filesystem::path relative = dir.lexically_relative(root);
+    if (relative.empty() || *relative.begin() == "..") return watch(dir);     // not under root, its own directory has to do
+
+    std::filesystem::path current = root;
+    if (!watch(current)) return false;
+    for (const auto& part : relative) {
+        if (part == ".") continue;
+        current /= part;
+        if (!watch(current)) return false;
+    }
+    return true;
+}
+
+// the watched directories' paths can't be trusted anymore - they're watched again as lookups need them
+void OpenFileCache::flush() {
+#ifdef __linux__
+    for (const auto& watch : watches_) inotify_rm_watch(inotify_fd_, watch.first);
+#endif
+    watches_.clear();
+    watched_.clear();
+    entries_.clear();
+    lru_.clear();
+}
+
+OpenFileCache::Handle OpenFileCache::open(const std::string& path) {
+    auto entry = std::make_shared<Entry>();
+#ifdef __linux__
+    // O_NONBLOCK - a FIFO under that name mustn't hang the open
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC | O_NONBLOCK);
+    if (fd < 0) {
+        // nothing there (or nothing for us) is worth remembering, running out of descriptors isn't
+        return errno == ENOENT || errno == ENOTDIR || errno == EACCES ? entry : nullptr;
+    }
+    entry->fd = fd;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) return nullptr;
+    if (!S_ISREG(st.st_mode)) {
+        close(entry->fd);
+        entry->fd = -1;
+        return entry;
+    }
+    entry->size = static_cast<size_t>(st.st_size);
+
+    std::error_code ec;
+    entry->mtime = std::filesystem::last_write_time(path, ec);
+    if (ec) return nullptr;
+#else
+    (void)path;
+#endif
+    return entry;
+}
+
+void OpenFileCache::erase(std::unordered_map<std::string, Slot>::iterator it) {
+    lru_.erase(it->second.lru);
+    entries_.erase(it);
+}
@@ -0,0 +1,109 @@
+#include "../inc/packet.hpp"
+#include <cctype>
+
+using namespace tftp;
+
+namespace {
+    uint16_t opcodeOf(const uint8_t* buffer) {
+        return static_cast<uint16_t>((buffer[0] << 8) | buffer[1]);
+    }
+
+    // the NUL terminated field at the front of text, which loses it - false if there's no NUL
+    bool takeField(std::string_view& text, std::string_view& field) {
+        size_t end = text.find('\0');
+        if (end == std::string_view::npos) return false;
+        field = text.substr(0, end);
+        text.remove_prefix(end + 1);
+        return true;
+    }
+
+    bool validOptions(std::string_view options) {
+        return forEachOption(options, [](std::string_view, std::string_view) {});
+    }
+}
+
+bool tftp::decodeRequest(const uint8_t* buffer, size_t len, RequestView& request) {
+    if (len < 4) return false;
+    uint16_t opcode = opcodeOf(buffer);
+    if (opcode != static_cast<uint16_t>(TftpOpcode::ReadRequest) && opcode != static_cast<uint16_t>(TftpOpcode::WriteRequest)) return false;
+
+    std::string_view rest(reinterpret_cast<const char*>(buffer) + 2, len - 2);
+    if (!takeField(rest, request.filename) || !takeField(rest, request.mode) || !validOptions(rest)) return false;
+    request.opcode = static_cast<TftpOpcode>(opcode);
+    request.options = rest;
+    return true;
+}
+
+bool tftp::decodeOack(const uint8_t* buffer, size_t len, std::string_view& options) {
+    if (len < 2 || opcodeOf(buffer) != static_cast<uint16_t>(TftpOpcode::Oack)) return false;
+    std::string_view rest(reinterpret_cast<const char*>(buffer) + 2, len - 2);
+    if (!validOptions(rest)) return false;
+    options = rest;
+    return true;
+}
+
+bool tftp::decodeError(const uint8_t* buffer, size_t len, ErrorView& error) {
+    if (len < 4 || opcodeOf(buffer) != static_cast<uint16_t>(TftpOpcode::Error)) return false;
+    error.code = static_cast<uint16_t>((buffer[2] << 8) | buffer[3]);
+    error.message = std::string_view(reinterpret_cast<const char*>(buffer) + 4, len - 4);
+    error.message = error.message.substr(0, error.message.find('\0'));
+    return true;
+}
+
+bool tftp::optionIs(std::string_view name, std::string_view option) {
+    if (name.size() != option.size()) return false;
+    for (size_t i = 0; i < name.size(); i++) {
+        if (std::tolower(static_cast<unsigned char>(name[i])) != option[i]) return false;
+    }
+    return true;
+}
+
+void tftp::parseOack(const uint8_t* buffer, int32_t len, uint16_t& blksize_val, uint16_t& windowsize_val, std::streamsize& tsize_val,
+                     std::string* multicast_val, std::streamsize* offset_val) {
+    uint16_t requested_blksize = blksize_val;
+    uint16_t requested_windowsize = windowsize_val;
+    blksize_val = 512;
+    windowsize_val = 1;
+
+    std::string_view options;
+    if (len < 0 || !decodeOack(buffer, static_cast<size_t>(len), options)) throw TftpError(TftpError::ErrorType::Tftp, 0, "Malformed OACK");
+
+    bool valid = true;
+    forEachOption(options, [&](std::string_view option, std::string_view value) {
+        if (optionIs(option, "tsize")) {
+            valid &= parseNumber(value, tsize_val);
+        } else if (optionIs(option, "blksize")) {
+            valid &= parseNumber(value, blksize_val);
+            if (valid && (blksize_val > requested_blksize || blksize_val < Config::MinBlockSize)) throw TftpError(TftpError::ErrorType::Tftp, 0, "Invalid block size");
+        } else if (optionIs(option, "windowsize")) {
+            valid &= parseNumber(value, windowsize_val);
+            if (valid && (windowsize_val > requested_windowsize || windowsize_val == 0)) throw TftpError(TftpError::ErrorType::Tftp, 0, "Invalid window size");
+        } else if (optionIs(option, "multicast") && multicast_val) {
+            multicast_val->assign(value);
+        } else if (optionIs(option, "offset") && offset_val) {
+            valid &= parseNumber(value, *offset_val);
+        }
+    });
+    if (!valid) throw TftpError(TftpError::ErrorType::Tftp, 0, "Malformed OACK");
+}
+
+PacketWriter& PacketWriter::word(uint16_t value) {
+    if (room() < 2) {
+        ok_ = false;
+        return *this;
+    }
+    buffer_[len_++] = static_cast<uint8_t>(value >> 8);
+    buffer_[len_++] = static_cast<uint8_t>(value & 0xFF);
+    return *this;
+}
+
+PacketWriter& PacketWriter::string(std::string_view text) {
+    if (room() < text.size() + 1) {
+        ok_ = false;
+        return *this;
+    }
+    std::copy(text.begin(), text.end(), buffer_ + len_);
+    len_ += text.size();
+    buffer_[len_++] = '\0';
+    return *this;
+}
@@ -0,0 +1,120 @@
+#include "../inc/rate_limiter.hpp"
+
+using namespace tftp;
+
+class RateLimiter::Flow {
+    friend class RateLimiter;
+
+    double weight_ = 1;
+    double finish_ = 0;             // virtual time its last grant ends at
+    Bucket* client_ = nullptr;      // nullptr without a per client limit
+    uint32_t client_key_ = 0;
+    Bucket* waiting_on_ = nullptr;
+    double waiting_tag_ = 0;
+};
+
+RateLimiter::Handle RateLimiter::open(const struct sockaddr_in& client, std::streamsize total_bytes) {
+    const Config& config = Config::getInstance();
+    double rate = static_cast<double>(std::max<std::streamsize>(config.getRateLimit(), 0));
+    double client_rate = static_cast<double>(std::max<std::streamsize>(config.getClientRateLimit(), 0));
+    if (rate == 0 && client_rate == 0) return nullptr;
+
+    Handle flow(new Flow());
+    std::streamsize small_file = config.getRateSmallFile();
+    if (small_file > 0 && total_bytes <= small_file) flow->weight_ = SmallFileWeight;
+
+    auto now = clock::now();
+    std::lock_guard<std::mutex> lock(mutex_);
+    setRate(global_, rate, now);
+    if (client_rate > 0) {
+        uint8_t prefix = std::min<uint8_t>(config.getClientRatePrefix(), 32);
+        uint32_t mask = prefix == 0 ? 0 : ~uint32_t(0) << (32 - prefix);
+        flow->client_key_ = ntohl(client.sin_addr.s_addr) & mask;
+
+        Bucket& bucket = clients_[flow->client_key_];
+        bucket.flows++;
+        setRate(bucket, client_rate, now);
+        flow->client_ = &bucket;
+    }
+    return flow;
+}
+
+size_t RateLimiter::acquire(Flow& flow, size_t wanted, size_t unit, clock::time_point& retry_at, clock::time_point now) {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    // client bucket first - a flow held up by its own client's limit doesn't keep a place in the global queue
+    Bucket* buckets[] = { flow.client_, &global_ };
+    double start = startTag(flow);
+    size_t packets = wanted;
+    for (Bucket* bucket : buckets) {
+        if (bucket == nullptr || bucket->rate == 0) continue;
+        refill(*bucket, unit, now);
+
+        // someone who's had less is already waiting for these tokens - their turn first
+        bool behind = !bucket->waiting.empty() && bucket->waiting.begin()->second != &flow && bucket->waiting.begin()->first < start;
+        packets = behind ? 0 : std::min(packets, static_cast<size_t>(bucket->tokens / static_cast<double>(unit)));
+        if (packets > 0) continue;
+
+        wait(flow, *bucket);
+        double missing = static_cast<double>(unit) * (behind ? 2 : 1) - bucket->tokens;
+        auto delay = std::chrono::duration<double>(std::max(missing, 0.0) / bucket->rate);
+        retry_at = now + std::max<clock::duration>(std::chrono::duration_cast<clock::duration>(delay), std::chrono::milliseconds(1));
+        return 0;
+    }
+
+    unwait(flow);
+    double bytes = static_cast<double>(packets * unit);
+    for (Bucket* bucket : buckets) {
+        if (bucket != nullptr && bucket->rate != 0) bucket->tokens -= bytes;
+    }
+    flow.finish_ = start + bytes / flow.weight_;
+    virtual_time_ = start;
+
+    if (packets < wanted) retry_at = now + std::chrono::milliseconds(1);
+    return packets;
+}
+
+void RateLimiter::close(Flow* flow) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    unwait(*flow);
+    if (flow->client_ != nullptr && --flow->client_->flows == 0) clients_.erase(flow->client_key_);
+    delete flow;
+}
+
+void RateLimiter::setRate(Bucket& bucket, double rate, clock::time_point now) {
+    if (bucket.rate == 0 && rate != 0) {
+        // (re)starts full
+        bucket.tokens = rate * std::chrono::duration<double>(BurstTime).count();
+        bucket.refilled = now;
+    }
+    bucket.rate = rate;
+}
+
+void RateLimiter::refill(Bucket& bucket, size_t unit, clock::time_point now) {
+    double elapsed = std::chrono::duration<double>(now - bucket.refilled).count();
+    if (elapsed <= 0) return;
+
+    // always room for one packet, however low the rate
+    double depth = std::max(bucket.rate * std::chrono::duration<double>(BurstTime).count(), static_cast<double>(unit));
+    bucket.tokens = std::min(bucket.tokens + elapsed * bucket.rate, depth);
+    bucket.refilled = now;
+}
+
+// no credit for time spent idle - a flow (re)starts at the virtual time of whatever was sent last
+double RateLimiter::startTag(const Flow& flow) const {
+    return std::max(flow.finish_, virtual_time_);
+}
+
+void RateLimiter::wait(Flow& flow, Bucket& bucket) {
+    if (flow.waiting_on_ == &bucket) return;    // keeps its place
+    unwait(flow);
+    flow.waiting_on_ = &bucket;
+    flow.waiting_tag_ = startTag(flow);
+    bucket.waiting.emplace(flow.waiting_tag_, &flow);
+}
+
+void RateLimiter::unwait(Flow& flow) {
+    if (flow.waiting_on_ == nullptr) return;
+    flow.waiting_on_->waiting.erase({ flow.waiting_tag_, &flow });
+    flow.waiting_on_ = nullptr;
+}
@@ -1,27 +1,25 @@
 #include "../inc/tftp.hpp"
+#include "../inc/block_pool.hpp"
+#include "../inc/datagram_batch.hpp"
+#include "../inc/file_cache.hpp"
+#include "../inc/mapped_file.hpp"
+#include "../inc/open_file_cache.hpp"
+#include "../inc/packet.hpp"
+#include "../inc/poller.hpp"
+#include "../inc/progress.hpp"
+#include "../inc/rate_limiter.hpp"
+#include "../inc/rto.hpp"
+#include "../inc/thread_pool.hpp"
+#include "../inc/write_behind.hpp"
+#include <map>
+#include <tuple>
+#include <unordered_map>
+#ifdef __linux__
+#include <sched.h>
+#endif
 
 using namespace tftp;
 
-bool checkFileWriteable(const std::filesystem::path& file_path) {
-    if (std::filesystem::exists(file_path)) {
-        if (!std::filesystem::is_regular_file(file_path)) {
-            return false;
-        }
-    }
-
-    std::ofstream test_file;
-    try {
-        test_file = std::ofstream(file_path);
-        if (!test_file.is_open()) {
-            return false;
-        }
-    } catch (const std::exception&) {
-        return false;
-    }
-    
-    return true;
-}
-
 bool checkFileReadable(const std::filesystem::path& file_path) {
     if (!std::filesystem::exists(file_path) || !std::filesystem::is_regular_file(file_path)) {
         return false;
@@ -40,315 +38,1152 @@ bool checkFileReadable(const std::filesystem::path& file_path) {
     return true;
 }
 
-void sendErrorPacket(socket_t sockfd, const struct sockaddr_in& client_addr, TftpError::ErrorCode error_code, const std::string& error_msg) {
-    uint8_t* buffer = new uint8_t[error_msg.size() + 5]();
-    buffer[0] = 0;
-    buffer[1] = static_cast<uint8_t>(TftpOpcode::Error);
-    buffer[2] = 0;
-    buffer[3] = static_cast<uint8_t>(error_code);
-    std::copy(error_msg.begin(), error_msg.end(), buffer + 4);
-    buffer[error_msg.size() + 4] = '\0';
+void sendErrorPacket(socket_t sockfd, const struct sockaddr_in& client_addr, TftpError::ErrorCode error_code, std::string_view error_msg) {
+    Metrics::getInstance().error(Metrics::Side::Server, true, static_cast<uint16_t>(error_code));
 
-    if (sendto(sockfd, reinterpret_cast<char*>(buffer), error_msg.size() + 5, 0, (struct sockaddr*)&client_addr, sizeof(client_addr)) < 0)
-        throw std::runtime_error("Failed to send error packet to client");
+    uint8_t buffer[4 + 512];    // a message longer than a default block is cut
+    PacketWriter packet(buffer, sizeof(buffer));
+    packet.opcode(TftpOpcode::Error).word(static_cast<uint16_t>(error_code)).string(error_msg.substr(0, sizeof(buffer) - 5));
+    if (!packet.ok()) throw std::runtime_error("Failed to build error packet");
 
-    delete[] buffer;
+    if (sendto(sockfd, reinterpret_cast<char*>(buffer), static_cast<int>(packet.size()), 0, (struct sockaddr*)&client_addr, sizeof(client_addr)) < 0)
+        throw std::runtime_error("Failed to send error packet to client");
 }
 
-void Server::handleClient (
-    socket_t sockfd,
-    const std::string& root_dir,
-    TransferCallback callback,
-    std::chrono::milliseconds callback_interval
-){
-    Config config = Config::getInstance();
-    ServerCleanupGuard guard;
+namespace {
+    constexpr uint16_t DefaultBlockSize = 512;  // RFC 1350, used when client doesn't negotiate blksize
+    constexpr std::chrono::milliseconds CloseCheckInterval(1);  // WRQ waiting on the writer to sync its file
 
-    uint8_t* buffer = new uint8_t[config.getBlockSize() + 4]();
-    uint8_t* recv_buffer = new uint8_t[config.getBlockSize() + 4]();
-    guard.guardNew(buffer);
-    guard.guardNew(recv_buffer);
+    void count(Metrics::Counter counter, uint64_t n = 1) {
+        Metrics::getInstance().add(Metrics::Side::Server, counter, n);
+    }
 
-    struct sockaddr_in client_addr = {};
-    socklen_t client_addr_len = sizeof(client_addr);
+    void observe(Metrics::Histogram histogram, std::chrono::steady_clock::time_point since) {
+        Metrics::getInstance().observe(Metrics::Side::Server, histogram, std::chrono::steady_clock::now() - since);
+    }
 
-    int recv_offset = -1;
+    struct Request {
+        TftpOpcode opcode;
+        std::string filename;
+        bool has_options = false;
 
-    if ((recv_offset = recvfrom(sockfd, reinterpret_cast<char*>(recv_buffer), config.getBlockSize() + 4, 0, (struct sockaddr*)&client_addr, &client_addr_len)) < 0)
-        return;
-    
-    if (recv_buffer[1] != static_cast<uint8_t>(TftpOpcode::ReadRequest) && recv_buffer[1] != static_cast<uint8_t>(TftpOpcode::WriteRequest)) {
-        sendErrorPacket(sockfd, client_addr, TftpError::ErrorCode::IllegalOperation, "Illegal TFTP operation");
-        return;
+        bool has_tsize = false;
+        std::streamsize tsize = 0;
+        bool has_blksize = false;
+        uint16_t blksize = DefaultBlockSize;
+        bool has_timeout = false;
+        uint16_t timeout = 0;
+        bool has_utimeout = false;      // same thing in microseconds, wins over timeout
+        uint32_t utimeout = 0;
+        bool has_windowsize = false;
+        uint16_t windowsize = 1;
+        bool has_multicast = false;     // RFC 2090, value is always empty in a request
+        bool has_offset = false;        // RRQ resuming at a byte offset - not an RFC, just ours
+        std::streamsize offset = 0;
+    };
+
+    // throws TftpError on malformed requests - checked in place first, garbage costs no allocations
+    Request parseRequest(const uint8_t* buffer, size_t len) {
+        RequestView view;
+        if (!decodeRequest(buffer, len, view))
+            throw TftpError(TftpError::ErrorType::Tftp, static_cast<int>(TftpError::ErrorCode::IllegalOperation), "Illegal TFTP operation");
+
+        Request request;
+        request.opcode = view.opcode;
+        forEachOption(view.options, [&request](std::string_view option, std::string_view value) {
+            if (optionIs(option, "multicast")) {
+                request.has_multicast = true;   // only acknowledged if the server has a group configured
+                return;
+            }
+
+            unsigned long long value_int;
+            if (!parseNumber(value, value_int)) return;     // unknown or garbage options are ignored, as RFC 2347 says
+
+            if (optionIs(option, "tsize")) {
+                if (value_int > static_cast<unsigned long long>(std::numeric_limits<std::streamsize>::max())) return;
+                request.has_tsize = true;
+                request.tsize = static_cast<std::streamsize>(value_int);
+            } else if (optionIs(option, "blksize")) {
+                if (value_int < Config::MinBlockSize) return;     // can't be met without going above it, so not acknowledged
+                request.has_blksize = true;
+                request.blksize = static_cast<uint16_t>(std::min<unsigned long long>(value_int, Config::MaxBlockSize));
+            } else if (optionIs(option, "timeout")) {
+                request.has_timeout = true;
+                request.timeout = static_cast<uint16_t>(std::min<unsigned long long>(value_int, 255));
+            } else if (optionIs(option, "utimeout")) {
+                if (value_int < 1000) return;     // below a millisecond nothing could keep up
+                request.has_utimeout = true;
+                request.utimeout = static_cast<uint32_t>(std::min<unsigned long long>(value_int, 255000000));
+            } else if (optionIs(option, "windowsize")) {
+                if (value_int == 0) return;
+                request.has_windowsize = true;
+                request.windowsize = static_cast<uint16_t>(std::min<unsigned long long>(value_int, 65535));
+            } else if (optionIs(option, "offset")) {
+                if (request.opcode != TftpOpcode::ReadRequest || value_int > static_cast<unsigned long long>(std::numeric_limits<std::streamsize>::max())) return;
+                request.has_offset = true;
+                request.offset = static_cast<std::streamsize>(value_int);
+            } else {
+                return;
+            }
+            request.has_options = true;
+        });
+        request.filename.assign(view.filename);
+
+        count(request.opcode == TftpOpcode::ReadRequest ? Metrics::Counter::ReadRequests : Metrics::Counter::WriteRequests);
+        return request;
     }
 
-    TransferInfo info;
+    // values the server settles on for a request - same for every client of a multicast session
+    uint16_t negotiatedBlockSize(const Request& request, const Config& config) {
+        if (!request.has_blksize) return DefaultBlockSize;
+        return std::min(request.blksize, config.getBlockSize());
+    }
+
+    uint16_t negotiatedWindowSize(const Request& request, const Config& config) {
+        if (!request.has_windowsize) return 1;
+        return std::min(request.windowsize, config.getWindowSize());
+    }
 
-    uint16_t buffer_offset = 2;
-    std::string request_filename = readStringFromBuffer(recv_buffer + 2, config.getBlockSize() + 4 - buffer_offset);
-    buffer_offset += request_filename.size() + 1;
-    std::string mode = readStringFromBuffer(recv_buffer + buffer_offset, config.getBlockSize() + 4 - buffer_offset);
-    buffer_offset += mode.size() + 1;
+    // largest block a DATA packet to addr can carry without IP fragmentation, 0 if the platform can't tell.
+    // A throwaway connected socket is enough - nothing is sent, the kernel looks up the route and its PMTU cache.
+    // The answer is kept per host for a while, so a client asking again and again costs a lookup.
+    uint16_t pathMtuBlockSize(const struct sockaddr_in& addr) {
+    #ifdef __linux__
+        static constexpr std::chrono::seconds KeepFor(60);
+        static constexpr size_t MaxHosts = 4096;
+        static std::mutex mutex;
+        static std::unordered_map<uint32_t, std::pair<uint16_t, std::chrono::steady_clock::time_point>> hosts;
 
-    bool option_negotiation = false;
-    size_t tsize = 0;
-    uint16_t blksize = config.getBlockSize();   // is treated as max block size
-    uint16_t timeout = config.getTimeout();
+        auto now = std::chrono::steady_clock::now();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = hosts.find(addr.sin_addr.s_addr);
+            if (it != hosts.end() && now < it->second.second) return it->second.first;
+        }
+
+        socket_t probe = socket(AF_INET, SOCK_DGRAM, 0);
+        if (probe == INVALID_SOCKET) return 0;
+        int mtu = 0;
+        socklen_t len = sizeof(mtu);
+        bool known = connect(probe, (struct sockaddr*)&addr, sizeof(addr)) == 0 && getsockopt(probe, IPPROTO_IP, IP_MTU, &mtu, &len) == 0;
+        close(probe);
+        uint16_t block = !known || mtu <= 32 ? 0 : static_cast<uint16_t>(std::min(mtu - 32, static_cast<int>(Config::MaxBlockSize)));     // IPv4 20, UDP 8, TFTP 4
 
-    while (buffer_offset < recv_offset) {
-        option_negotiation = true;
+        std::lock_guard<std::mutex> lock(mutex);
+        if (hosts.size() >= MaxHosts) hosts.clear();
+        hosts[addr.sin_addr.s_addr] = { block, now + KeepFor };
+        return block;
+    #else
+        (void)addr;
+        return 0;
+    #endif
+    }
+
+    // pins the calling thread to the worker-th core it's allowed on, wrapping around - a no-op elsewhere
+    void pinToCore(size_t worker) {
+    #ifdef __linux__
+        cpu_set_t allowed;
+        if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0 || CPU_COUNT(&allowed) == 0) return;
+        size_t nth = worker % static_cast<size_t>(CPU_COUNT(&allowed));
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (!CPU_ISSET(cpu, &allowed) || nth-- != 0) continue;
+            cpu_set_t one;
+            CPU_ZERO(&one);
+            CPU_SET(cpu, &one);
+            sched_setaffinity(0, sizeof(one), &one);
+            return;
+        }
+    #else
+        (void)worker;
+    #endif
+    }
 
-        std::string option = readStringFromBuffer(recv_buffer + buffer_offset, config.getBlockSize() + 4 - buffer_offset);
-        buffer_offset += option.size() + 1;
-        std::string value = readStringFromBuffer(recv_buffer + buffer_offset, config.getBlockSize() + 4 - buffer_offset);
-        buffer_offset += value.size() + 1;
+    // OACK acknowledging the options request asked for, returns its length - 0 if it doesn't fit into capacity.
+    // multicast is "addr,port,mc" or empty.
+    size_t buildOack(uint8_t* buffer, size_t capacity, const Request& request, uint16_t blksize, std::chrono::microseconds timeout,
+                     std::streamsize tsize, uint16_t windowsize, std::string_view multicast, std::streamsize offset = 0) {
+        PacketWriter packet(buffer, capacity);
+        packet.opcode(TftpOpcode::Oack);
 
-        uint32_t value_int = std::stoul(value);
+        if (request.has_blksize) packet.option("blksize", blksize);
+        if (request.has_utimeout) packet.option("utimeout", timeout.count());
+        else if (request.has_timeout) packet.option("timeout", std::chrono::duration_cast<std::chrono::seconds>(timeout).count());
+        if (request.has_tsize) packet.option("tsize", tsize);
+        if (request.has_windowsize) packet.option("windowsize", windowsize);
+        if (!multicast.empty()) packet.option("multicast", multicast);
+        if (request.has_offset) packet.option("offset", offset);
 
-        if (option == "tsize") tsize = value_int;
-        else if (option == "blksize") blksize = static_cast<uint16_t>(value_int);
-        else if (option == "timeout") timeout = static_cast<uint16_t>(value_int);
+        return packet.ok() ? packet.size() : 0;
     }
 
-    if (blksize > config.getBlockSize()) {
-        blksize = config.getBlockSize();
+    // keeps clients inside of root_dir
+    bool resolvePath(const std::string& root_dir, const std::string& filename, std::filesystem::path& out) {
+        std::filesystem::path relative = std::filesystem::path(filename).relative_path();
+        for (const auto& part : relative) {
+            if (part == "..") return false;
+        }
+        if (relative.empty()) return false;
+
+        out = std::filesystem::path(root_dir) / relative;
+        return true;
     }
 
-    info.type = (recv_buffer[1] == static_cast<uint8_t>(TftpOpcode::ReadRequest)) ? TransferInfo::Type::Read : TransferInfo::Type::Write;
-    info.client_addr = client_addr;
-    info.filename = request_filename;
-    info.total_bytes = tsize;
-    info.transferred_bytes = 0;
+    // manifest: one file per line, relative to root_dir; blank lines and # comments are skipped
+    void preloadCache(const std::string& root_dir, const std::string& manifest) {
+        if (manifest.empty() || Config::getInstance().getCacheSize() <= 0) return;
 
-    std::filesystem::path file_path = std::filesystem::path(root_dir) / request_filename;
-    socket_t comm_sockfd;
+        std::ifstream in(manifest);
+        if (!in.is_open()) throw TftpError(TftpError::ErrorType::OS, errno, "Failed to open cache manifest");
 
-    struct sockaddr_in comm_addr = {};
-    comm_addr.sin_family = AF_INET;
-    comm_addr.sin_port = 0;
-    comm_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+        std::string line;
+        while (std::getline(in, line)) {
+            size_t first = line.find_first_not_of(" \t\r");
+            if (first == std::string::npos || line[first] == '#') continue;
+            size_t last = line.find_last_not_of(" \t\r");
 
-    if ((comm_sockfd = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
-        throw std::runtime_error("Failed to create communication socket");
-    guard.guardSocket(comm_sockfd);
-    if (bind(comm_sockfd, (struct sockaddr*)&comm_addr, sizeof(comm_addr)) < 0)
-        throw std::runtime_error("Failed to bind communication socket");
+            std::filesystem::path file_path;
+            if (resolvePath(root_dir, line.substr(first, last - first + 1), file_path))
+                FileCache::getInstance().get(file_path, OpenFileCache::getInstance().get(root_dir, file_path));
+        }
+    }
+}
 
-#ifdef _WIN32
-    DWORD timeout_val = timeout * 1000;
-#else
-    struct timeval timeout_val = {timeout, 0};
+/* Single transfer state machine - everything after the request, for both RRQ and WRQ.
+ * Never blocks: it's fed with packets (onReadable) and timer expirations (onTimeout)
+ * by either handleClient or the event loop in Server::run. */
+class Server::Transfer {
+public:
+    TransferInfo info;
+    socket_t sockfd;
+    bool done;
+    std::exception_ptr failure;
+    std::chrono::steady_clock::time_point deadline;
+    ProgressThrottle progress;     // when the owner should call its TransferCallback next
 
-#endif
-    if (setsockopt(comm_sockfd, SOL_SOCKET, SO_RCVTIMEO, reinterpret_cast<const char*>(&timeout_val), sizeof(timeout_val)) < 0)
-        throw TftpError(TftpError::ErrorType::OS, getOsError(), "Failed to set socket timeout");
+    Transfer(const Request& request, const struct sockaddr_in& client_addr, const std::string& root_dir, const std::filesystem::path& file_path,
+             WriteBehind& writer, std::chrono::milliseconds callback_interval)
+        : sockfd(INVALID_SOCKET), done(false),
+          progress(callback_interval, static_cast<uint64_t>(std::max<std::streamsize>(Config::getInstance().getProgressBytes(), 0))), request_(request), root_dir_(root_dir), file_path_(file_path),
+          memory_(nullptr), memory_size_(0), in_memory_(false), writer_(writer), blksize_(DefaultBlockSize), windowsize_(1), timeout_(Config::getInstance().getRetransmitTimeout()), rto_(timeout_, false), max_retries_(Config::getInstance().getMaxRetries()),
+          adaptive_timeout_(Config::getInstance().getAdaptiveTimeout()), timed_out_(false), data_sent_(false), retries_(0), oack_pending_(false), offload_(Config::getInstance().getOffload()), block_(0), window_received_(0),
+          gap_acked_(false), closing_(false), dallying_(false), send_len_(0), acked_(0), next_(1), rollback_guard_(0), loaded_(0), final_block_(0), offset_(0), read_at_(0), pacing_(false), multicast_(false), registered_(false) {
+        info.type = request.opcode == TftpOpcode::ReadRequest ? TransferInfo::Type::Read : TransferInfo::Type::Write;
+        info.client_addr = client_addr;
+        info.filename = request.filename;
+        info.total_bytes = request.tsize;
+        info.transferred_bytes = 0;
+        started_at_ = std::chrono::steady_clock::now();
+    }
 
-    if (info.type == TransferInfo::Type::Read && !checkFileReadable(file_path)) {
-        sendErrorPacket(comm_sockfd, info.client_addr, TftpError::ErrorCode::FileNotFound, "File not found");
-        return;
-    } else if (info.type == TransferInfo::Type::Write && !checkFileWriteable(file_path)) {
-        sendErrorPacket(comm_sockfd, info.client_addr, TftpError::ErrorCode::AccessViolation, "Access violation");
-        return;
+    ~Transfer() {
+        if (upload_ && !closing_) writer_.close(upload_, false);     // never completed - don't leave a partial file behind
+        closeSession();
+        if (sockfd == INVALID_SOCKET) return;
+    #ifdef _WIN32
+        closesocket(sockfd);
+    #else
+        close(sockfd);
+    #endif
+    }
+
+    // RRQ for a file that already has a multicast session - the client is sent an OACK from the session's socket
+    // and gets the blocks from the group, or gets promoted to master later. False if there's no session to join.
+    static bool joinMulticast(const Request& request, const struct sockaddr_in& client_addr, const std::filesystem::path& file_path) {
+        const Config& config = Config::getInstance();
+        if (request.opcode != TftpOpcode::ReadRequest || !request.has_multicast || request.has_offset || config.getMulticastAddress().empty()) return false;
+
+        std::lock_guard<std::mutex> lock(sessions_mutex_);
+        auto it = sessions_.find(SessionKey(file_path.string(), negotiatedBlockSize(request, config), negotiatedWindowSize(request, config)));
+        if (it == sessions_.end()) return false;
+
+        Transfer& session = *it->second;
+        uint8_t buffer[DefaultBlockSize + 4];
+        size_t len = buildOack(buffer, sizeof(buffer), request, session.blksize_, session.timeout_, session.info.total_bytes, session.windowsize_, session.multicastOption(false));
+        if (len == 0 || sendto(session.sockfd, reinterpret_cast<char*>(buffer), static_cast<int>(len), 0, (struct sockaddr*)&client_addr, sizeof(client_addr)) < 0)
+            return false;   // gets a transfer of its own instead
+
+        session.members_.push_back(Member { client_addr, request });
+        return true;
     }
 
-    
-    if (option_negotiation) {
-        buffer[1] = static_cast<uint8_t>(TftpOpcode::Oack);
-        buffer_offset = 2;
+    // creates the transfer socket, validates the file and sends OACK / first DATA / ACK 0
+    void start() {
+        const Config& config = Config::getInstance();
+        struct sockaddr_in comm_addr = {};
+        comm_addr.sin_family = AF_INET;
+        comm_addr.sin_port = 0;
+        comm_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+
+        if ((sockfd = socket(AF_INET, SOCK_DGRAM, 0)) == INVALID_SOCKET)
+            throw TftpError(TftpError::ErrorType::OS, getOsError(), "Failed to create communication socket");
+        if (bind(sockfd, (struct sockaddr*)&comm_addr, sizeof(comm_addr)) < 0)
+            throw TftpError(TftpError::ErrorType::OS, getOsError(), "Failed to bind communication socket");
+        setNonBlocking(sockfd);
 
-        std::string blksize_str = std::to_string(blksize);
-        std::string timeout_str = std::to_string(timeout);
-        
+        // one lookup says whether it's there, how big it is and what to read it through
         if (info.type == TransferInfo::Type::Read) {
-            info.total_bytes = getStreamLength(std::ifstream(file_path));
+            file_ = OpenFileCache::getInstance().get(root_dir_, file_path_);
+            if (file_ && file_->fd < 0) return fail(TftpError::ErrorCode::FileNotFound, "File not found");
+        }
+
+        if (info.type == TransferInfo::Type::Read && (cached_ = FileCache::getInstance().lookup(file_path_, file_))) {
+            memory_ = cached_->data.get();
+            memory_size_ = cached_->size;
+            in_memory_ = true;
+            info.total_bytes = static_cast<std::streamsize>(memory_size_);
+        } else if (info.type == TransferInfo::Type::Read && (config.getMappedReads() || wantsMulticast())) {
+            if (!(file_ ? map_.map(file_->fd, file_->size) : map_.map(file_path_))) return fail(TftpError::ErrorCode::FileNotFound, "File not found");
+            memory_ = map_.data();
+            memory_size_ = map_.size();
+            in_memory_ = true;
+            info.total_bytes = static_cast<std::streamsize>(memory_size_);
+        } else if (info.type == TransferInfo::Type::Read && file_) {
+            info.total_bytes = static_cast<std::streamsize>(file_->size);
+        } else if (info.type == TransferInfo::Type::Read) {
+            if (!checkFileReadable(file_path_)) return fail(TftpError::ErrorCode::FileNotFound, "File not found");
+            in_.open(file_path_, std::ios::binary);
+            if (!in_.is_open()) return fail(TftpError::ErrorCode::FileNotFound, "File not found");
+            info.total_bytes = static_cast<std::streamsize>(std::filesystem::file_size(file_path_));
+        } else {
+            upload_ = writer_.open(file_path_, request_.has_tsize ? request_.tsize : 0);
+            if (!upload_) return fail(TftpError::ErrorCode::AccessViolation, "Access violation");
+        }
+
+        // resumed read - tsize is still the whole file, only the blocks start further in
+        if (request_.has_offset) {
+            if (request_.offset > info.total_bytes) return fail(TftpError::ErrorCode::OptionNegotiation, "Offset past end of file");
+            offset_ = request_.offset;
+            info.transferred_bytes = offset_;
+            if (in_memory_) {
+                memory_ += offset_;
+                memory_size_ -= static_cast<size_t>(offset_);
+            } else if (file_) {
+                read_at_ = static_cast<uint64_t>(offset_);
+            } else {
+                in_.seekg(offset_);
+            }
         }
 
-        std::string tsize_str = std::to_string(info.total_bytes);
+        blksize_ = negotiatedBlockSize(request_, config);
+        // a fragment lost is the whole block lost - the group has no single path, so multicast keeps what it negotiated
+        if (config.getPathMtu() && request_.has_blksize && !wantsMulticast()) {
+            uint16_t path_max = pathMtuBlockSize(info.client_addr);
+            if (path_max > 0) blksize_ = std::max(Config::MinBlockSize, std::min(blksize_, path_max));
+        }
+        if (request_.has_utimeout) {
+            timeout_ = std::chrono::microseconds(request_.utimeout);
+        } else if (request_.has_timeout && request_.timeout > 0) {
+            timeout_ = std::chrono::seconds(request_.timeout);
+        }
+        rto_ = RtoEstimator(timeout_, adaptive_timeout_);
+        windowsize_ = negotiatedWindowSize(request_, config);
+        if (info.type == TransferInfo::Type::Read) pacer_ = RateLimiter::getInstance().open(info.client_addr, info.total_bytes - offset_);
 
-        strncpy_inc_offset(buffer, "blksize", 7, buffer_offset);
-        strncpy_inc_offset(buffer, blksize_str.c_str(), blksize_str.size(), buffer_offset);
-        strncpy_inc_offset(buffer, "timeout", 7, buffer_offset);
-        strncpy_inc_offset(buffer, timeout_str.c_str(), timeout_str.size(), buffer_offset);
-        strncpy_inc_offset(buffer, "tsize", 5, buffer_offset);
-        strncpy_inc_offset(buffer, tsize_str.c_str(), tsize_str.size(), buffer_offset);
+        send_buffer_.resize(DefaultBlockSize + 4);
+        // RRQ only gets ACKs (and maybe an ERROR), WRQ up to a window of DATA
+        if (info.type == TransferInfo::Type::Read) recv_batch_ = std::make_unique<RecvBatch>(16, DefaultBlockSize + 4);
+        else {
+            recv_batch_ = std::make_unique<RecvBatch>(std::min<size_t>(windowsize_, 32), static_cast<size_t>(blksize_) + 4);
+            reserveWindow(sockfd, windowsize_, blksize_);
+        }
+        if (in_memory_) {
+            // every block is already in memory, the last one is short (possibly empty)
+            final_block_ = memory_size_ / blksize_ + 1;
+            loaded_ = final_block_;
+        } else if (info.type == TransferInfo::Type::Read) {
+            // payload only, headers are built when a block goes out
+            for (uint16_t i = 0; i < windowsize_; i++) window_.push_back(BlockPool::getInstance().acquire(blksize_));
+            window_len_.assign(windowsize_, 0);
+        }
+        retries_ = max_retries_;
 
-        // send oack
-        if (sendto(comm_sockfd, reinterpret_cast<char*>(buffer), buffer_offset, 0, (struct sockaddr*)&client_addr, sizeof(client_addr)) < 0)
-            throw std::runtime_error("Failed to send OACK packet to client");
-        // recv 0 ack
-        if ((recv_offset = recvfrom(comm_sockfd, reinterpret_cast<char*>(recv_buffer), config.getBlockSize() + 4, 0, (struct sockaddr*)&client_addr, &client_addr_len)) < 0)
-            throw std::runtime_error("Failed to receive data from client");
+        // block numbers on the group have to be absolute - clients join at any point and can't widen them
+        if (wantsMulticast() && in_memory_ && final_block_ < 65536) startMulticast();
 
-        if (recv_buffer[1] != static_cast<uint8_t>(TftpOpcode::Ack)) {
-            sendErrorPacket(comm_sockfd, client_addr, TftpError::ErrorCode::IllegalOperation, "Illegal TFTP operation");
-            return;
+        if (request_.has_options || multicast_) {
+            send_len_ = buildOack(send_buffer_.data(), send_buffer_.size(), request_, blksize_, timeout_, info.total_bytes, windowsize_, multicastOption(true), offset_);
+            if (send_len_ == 0) return fail(TftpError::ErrorCode::OptionNegotiation, "Options don't fit into an OACK");
+            oack_pending_ = true;
+        } else if (info.type == TransferInfo::Type::Read) {
+            return sendWindow();
         } else {
-            buffer_offset = 2;
-            uint16_t block_num = ntohs(*reinterpret_cast<uint16_t*>(recv_buffer + 2));
-            if (block_num != 0) {
-                sendErrorPacket(comm_sockfd, client_addr, TftpError::ErrorCode::IllegalOperation, "Illegal TFTP operation");
-                return;
-            }
+            setAck(0);
         }
-    } // else we just send data
 
-    // callback thread:
-    if (callback) {
-        std::thread callback_thread = std::thread([callback, &info, callback_interval] {
-            while (info.transferred_bytes < info.total_bytes) {
-                std::this_thread::sleep_for(callback_interval);
-                callback(info);
+        resend();
+    }
+
+    void onReadable() {
+        while (!done) {
+            int received = recv_batch_->receive(sockfd);
+            if (received < 0) {
+                auto errnum = getOsError();
+                if (errnum == WOULDBLOCK_OS_ERR || errnum == EAGAIN || errnum == EINTR) return;
+                return abort(TftpError(TftpError::ErrorType::OS, errnum, "Failed to receive data from client"));
             }
-        });
-        guard.guardThread(std::move(callback_thread));
+
+            for (int i = 0; i < received && !done; i++) {
+                if (!sameAddress(recv_batch_->from(i), info.client_addr)) {
+                    if (multicast_ && memberPacket(recv_batch_->from(i), recv_batch_->data(i), recv_batch_->length(i))) continue;
+                    try { sendErrorPacket(sockfd, recv_batch_->from(i), TftpError::ErrorCode::UnknownTransferId, "Transfer ID unknown"); } catch (...) {}
+                    continue;
+                }
+                if (recv_batch_->length(i) < 4) continue;
+
+                handlePacket(recv_batch_->data(i), recv_batch_->length(i));
+            }
+        }
     }
-    
-    if (info.type == TransferInfo::Type::Read) {
-        std::ifstream file(file_path, std::ios::binary);
-        if (!file.is_open()) {
-            sendErrorPacket(comm_sockfd, info.client_addr, TftpError::ErrorCode::FileNotFound, "File not found");
-            return;
+
+    void onTimeout() {
+        if (done) return;
+        if (closing_) return uploadClosed();
+        if (dallying_) return finish();     // final ACK wasn't repeated for a whole timeout - client got it
+        if (pacing_) return sendWindow();   // not a lost packet - the rate limit lets more of the window out by now
+        timed_out_ = true;
+        count(Metrics::Counter::Timeouts);
+        if (!rto_.backoff() && --retries_ <= 0) {
+            try { sendErrorPacket(sockfd, info.client_addr, TftpError::ErrorCode::None, "Transfer timed out"); } catch (...) {}
+            if (multicast_ && promoteNext()) return;    // master is gone, the rest of the group isn't
+            return abort(TftpError(TftpError::ErrorType::Timeout, 0, "Max retries exceeded"));
+        }
+        count(Metrics::Counter::Retransmissions);
+
+        if (info.type == TransferInfo::Type::Read && !oack_pending_) {
+            next_ = acked_ + 1;     // whole window is resent
+            sendWindow();
+        } else {
+            // WRQ: whatever arrived of the window since our last ACK is acknowledged, the client goes on from there
+            window_received_ = 0;
+            if (!oack_pending_) setAck(block_);
+            resend();
+        }
+    }
+
+private:
+    Request request_;
+    std::string root_dir_;
+    std::filesystem::path file_path_;
+    OpenFileCache::Handle file_;    // RRQ, unless the open file cache is off
+    std::ifstream in_;          // RRQ without file_ or a mapping
+    MappedFile map_;            // RRQ with mapped reads
+    FileCache::Handle cached_;  // RRQ of a cached file
+    const uint8_t* memory_;     // whole file, from either of the above - blocks are sent straight out of it, no window buffers
+    size_t memory_size_;
+    bool in_memory_;
+    WriteBehind& writer_;
+    std::shared_ptr<WriteBehind::File> upload_;
+
+    uint16_t blksize_;
+    uint16_t windowsize_;
+    std::chrono::microseconds timeout_;    // negotiated - the most we wait, and how long we dally
+    RtoEstimator rto_;          // what we actually wait before retransmitting
+    int max_retries_;
+    bool adaptive_timeout_;
+    std::chrono::steady_clock::time_point sent_at_;    // last window/control packet, for RTT samples
+    bool timed_out_;            // retransmitted since sent_at_ - the next answer can't be timed (Karn)
+    std::chrono::steady_clock::time_point started_at_;     // request arrived
+    bool data_sent_;            // RRQ: first DATA is out
+    int retries_;
+    bool oack_pending_;
+    bool offload_;          // RRQ: send runs of blocks as GSO super-packets, cleared if the kernel refuses
+    uint64_t block_;        // WRQ: last block received - block numbers wrap on the wire, not here
+    uint16_t window_received_;  // WRQ: blocks received since the last ACK
+    bool gap_acked_;        // WRQ: out-of-order block already answered, wait for the client to go back
+    bool closing_;          // WRQ: final block handed to the writer, its ACK waits for the close
+    bool dallying_;         // WRQ: final ACK sent, still around in case it got lost
+    std::vector<uint8_t> send_buffer_;  // control packet in flight (OACK or ACK), kept for retransmission
+    size_t send_len_;
+    std::unique_ptr<RecvBatch> recv_batch_;
+
+    // RRQ window (RFC 7440) - block b lives in window_[b % windowsize_] while acked_ < b <= loaded_,
+    // a slot is reused for the next block as soon as its block is acknowledged
+    std::vector<BlockPool::Buffer> window_;
+    std::vector<size_t> window_len_;
+    uint64_t acked_;        // last block acknowledged by client
+    uint64_t next_;         // next block to (re)send
+    uint64_t rollback_guard_;   // duplicate ACKs below this block don't roll the window back again
+    uint64_t loaded_;       // last block read from file
+    uint64_t final_block_;  // number of the final (short) block, 0 until it's read
+    std::streamsize offset_;    // RRQ resumed at this byte - it's where block 1 starts
+    uint64_t read_at_;          // next byte loadNextBlock() reads through file_
+    RateLimiter::Handle pacer_;     // RRQ under a rate limit, nullptr otherwise
+    bool pacing_;           // limiter cut the last window short, the rest may go out at pace_at_
+    std::chrono::steady_clock::time_point pace_at_;
+
+    // RFC 2090 - one session per file (and block/window size): DATA goes to the group, only the master client ACKs.
+    // Everyone else waits in members_ and is promoted when the master is done, to get the blocks it missed.
+    struct Member {
+        struct sockaddr_in addr;
+        Request request;        // its own options, for the OACK it gets on promotion
+    };
+    typedef std::tuple<std::string, uint16_t, uint16_t> SessionKey;
+    static constexpr unsigned MulticastPorts = 64;  // concurrent sessions get their own group ports, from Config's base port up
+
+    static inline std::mutex sessions_mutex_;       // handleClient runs transfers on many threads
+    static inline std::map<SessionKey, Transfer*> sessions_;
+    static inline unsigned sessions_started_ = 0;
+
+    bool multicast_;
+    bool registered_;           // in sessions_ - new clients for the file join this transfer
+    struct sockaddr_in group_addr_;
+    std::deque<Member> members_;    // guarded by sessions_mutex_
+
+    bool wantsMulticast() const {
+        return info.type == TransferInfo::Type::Read && request_.has_multicast && !request_.has_offset && !Config::getInstance().getMulticastAddress().empty();
+    }
+
+    SessionKey sessionKey() const {
+        return SessionKey(file_path_.string(), blksize_, windowsize_);
+    }
+
+    // "addr,port,mc" for the OACK, empty if this isn't a multicast transfer
+    std::string multicastOption(bool master) const {
+        if (!multicast_) return "";
+        char group[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &group_addr_.sin_addr, group, sizeof(group));
+        return std::string(group) + "," + std::to_string(ntohs(group_addr_.sin_port)) + (master ? ",1" : ",0");
+    }
+
+    // points DATA at the group - if the socket can't be set up for it the option just isn't acknowledged
+    void startMulticast() {
+        const Config& config = Config::getInstance();
+        group_addr_ = {};
+        group_addr_.sin_family = AF_INET;
+        if (inet_pton(AF_INET, config.getMulticastAddress().c_str(), &group_addr_.sin_addr) != 1) return;
+
+        int ttl = config.getMulticastTtl();
+        if (setsockopt(sockfd, IPPROTO_IP, IP_MULTICAST_TTL, reinterpret_cast<const char*>(&ttl), sizeof(ttl)) < 0) return;
+        if (!config.getMulticastInterface().empty()) {
+            struct in_addr iface = {};
+            if (inet_pton(AF_INET, config.getMulticastInterface().c_str(), &iface) != 1 ||
+                setsockopt(sockfd, IPPROTO_IP, IP_MULTICAST_IF, reinterpret_cast<const char*>(&iface), sizeof(iface)) < 0) return;
         }
 
-        uint16_t block_num = 1;
-        char data_header[4] = {0, static_cast<char>(TftpOpcode::Data), 0, 0};
-    #ifdef USE_PARALLEL_FILE_IO
-        std::queue<std::unique_ptr<std::vector<uint8_t>>> data_queue;
-        std::mutex data_queue_mutex;
-        size_t max_queue_size = config.getMaxQueueSize() / blksize;
+        std::lock_guard<std::mutex> lock(sessions_mutex_);
+        group_addr_.sin_port = htons(static_cast<uint16_t>(config.getMulticastPort() + sessions_started_++ % MulticastPorts));
+        multicast_ = true;
+        // two handleClient threads can race to start one - the loser just runs a session of its own
+        registered_ = sessions_.emplace(sessionKey(), this).second;
+    }
 
-        std::thread data_chunker([&file, &data_queue, &data_queue_mutex, blksize, max_queue_size] {
-            std::unique_ptr<std::vector<uint8_t>> data_chunk = std::make_unique<std::vector<uint8_t>>(blksize + 4);
+    // caller holds sessions_mutex_
+    void unregisterSession() {
+        if (!registered_) return;
+        sessions_.erase(sessionKey());
+        registered_ = false;
+    }
 
-            while (file.read(reinterpret_cast<char*>(data_chunk->data() + 4), blksize)) {
-                while (data_queue.size() >= max_queue_size) continue;
+    void closeSession() {
+        if (!registered_) return;
+        std::lock_guard<std::mutex> lock(sessions_mutex_);
+        unregisterSession();
+    }
 
-                {std::lock_guard<std::mutex> lock(data_queue_mutex);
-                data_queue.push(std::move(data_chunk));}
-                data_chunk = std::make_unique<std::vector<uint8_t>>(blksize + 4);
+    // packet from someone other than the master - a member only ever says it's done (ACK of the final block)
+    // or gone (ERROR), anything else is ignored. False if the sender isn't a member.
+    bool memberPacket(const struct sockaddr_in& from, const uint8_t* buffer, size_t len) {
+        std::lock_guard<std::mutex> lock(sessions_mutex_);
+        auto it = std::find_if(members_.begin(), members_.end(), [&](const Member& m) { return sameAddress(m.addr, from); });
+        if (it == members_.end()) return false;
+        if (len < 4) return true;
+
+        auto opcode = static_cast<TftpOpcode>(buffer[1]);
+        uint16_t block_num = (buffer[2] << 8) | (buffer[3] & 0xFF);
+        if (opcode == TftpOpcode::Error || (opcode == TftpOpcode::Ack && block_num == final_block_)) members_.erase(it);
+        return true;
+    }
+
+    // master is done (or gone) - the longest-waiting member takes over, false if nobody's left
+    bool promoteNext() {
+        Member member;
+        {
+            std::lock_guard<std::mutex> lock(sessions_mutex_);
+            if (members_.empty()) {
+                unregisterSession();    // under the same lock, so nobody joins a session that's about to end
+                return false;
             }
+            member = members_.front();
+            members_.pop_front();
+        }
 
-            data_chunk->resize(file.gcount() + 4);
-            std::lock_guard<std::mutex> lock(data_queue_mutex);
-            data_queue.push(std::move(data_chunk));
-        });
+        info.client_addr = member.addr;
+        info.transferred_bytes = 0;
+        send_len_ = buildOack(send_buffer_.data(), send_buffer_.size(), member.request, blksize_, timeout_, info.total_bytes, windowsize_, multicastOption(true));
+        if (send_len_ == 0) {
+            try { sendErrorPacket(sockfd, member.addr, TftpError::ErrorCode::OptionNegotiation, "Options don't fit into an OACK"); } catch (...) {}
+            return promoteNext();
+        }
+        oack_pending_ = true;
+        acked_ = 0;
+        next_ = 1;
+        rollback_guard_ = 0;
+        retries_ = max_retries_;
+        rto_ = RtoEstimator(timeout_, adaptive_timeout_);    // different client, different path
+        resend();
+        return true;
+    }
 
-        guard.guardThread(std::move(data_chunker));
+    void handlePacket(uint8_t* buffer, size_t len) {
+        uint16_t recv_block_num = (buffer[2] << 8) | (buffer[3] & 0xFF);
 
-        while (data_queue.size() == 0) continue;
-    #endif
+        switch (static_cast<TftpOpcode>(buffer[1])) {
+        case TftpOpcode::Ack:
+            if (info.type != TransferInfo::Type::Read) return fail(TftpError::ErrorCode::IllegalOperation, "Illegal TFTP operation");
 
-        int retries = config.getMaxRetries();
-        bool size_divisible = info.total_bytes % blksize == 0;
+            if (multicast_) {
+                // absolute block numbers - a promoted master ACKs whatever it already has, which may be
+                // past anything sent to it
+                uint64_t ack = recv_block_num;
+                if (!oack_pending_ && ack == acked_) return duplicateAck();     // master saw a gap in what the group got
+                if (ack > final_block_ || (!oack_pending_ && ack < acked_)) return;
 
-        do {
-        #ifdef USE_PARALLEL_FILE_IO
-            std::unique_ptr<std::vector<uint8_t>> data_chunk = nullptr;
-            {
-                std::lock_guard<std::mutex> lock(data_queue_mutex);
-                data_chunk = std::move(data_queue.front());
-                data_queue.pop();
+                oack_pending_ = false;
+                sampleRtt();
+                acked_ = ack;
+                acknowledged(std::min(offset_ + static_cast<std::streamsize>(acked_ * blksize_), info.total_bytes));
+                if (acked_ == final_block_) {
+                    if (!promoteNext()) finish();
+                    return;
+                }
+                next_ = acked_ + 1;
+            } else if (oack_pending_) {
+                if (recv_block_num != 0) return;
+                oack_pending_ = false;
+                sampleRtt();
+            } else {
+                // widen the 16-bit block number relative to what's already acknowledged
+                uint64_t ack = acked_ + static_cast<uint16_t>(recv_block_num - static_cast<uint16_t>(acked_));
+                if (ack == acked_) return duplicateAck();
+                if (ack >= next_) return;       // bogus, don't answer
+
+                sampleRtt();
+                acked_ = ack;
+                acknowledged(std::min(offset_ + static_cast<std::streamsize>(acked_ * blksize_), info.total_bytes));
+                if (acked_ == final_block_) return finish();
+
+                // ACK in the middle of a window means the client lost the block after it - roll back
+                if (next_ > acked_ + 1) count(Metrics::Counter::Retransmissions);
+                next_ = acked_ + 1;
             }
-        #else
-            std::unique_ptr<std::vector<uint8_t>> data_chunk = std::make_unique<std::vector<uint8_t>>(blksize_val);
-            file.read(reinterpret_cast<char*>(data_chunk->data()), blksize_val);
-            data_chunk->resize(file.gcount());
-        #endif
-            
-            buffer_offset = static_cast<uint16_t>(data_chunk->size());
-
-            data_header[2] = block_num >> 8;
-            data_header[3] = block_num & 0xFF;
-
-        #ifdef _WIN32
-            WSABUF packet[2];
-            packet[0].buf = data_header;    
-            packet[0].len = 4;
-            packet[1].buf = reinterpret_cast<char*>(data_chunk->data());
-            packet[1].len = buffer_offset;
-
-            DWORD bytes_sent;
-            DWORD flags = 0;
-
-            if (WSASendTo(comm_sockfd, packet, 2, &bytes_sent, flags, (struct sockaddr*)&client_addr, sizeof(client_addr), nullptr, nullptr) == SOCKET_ERROR)
-                throw std::runtime_error("Failed to send data packet to client");
-        #else
-            struct iovec packet[2];
-            packet[0].iov_base = data_header;
-            packet[0].iov_len = 4;
-            packet[1].iov_base = reinterpret_cast<char*>(data_chunk->data());
-            packet[1].iov_len = buffer_offset;
-
-            struct msghdr msg = {};
-            msg.msg_name = &client_addr;
-            msg.msg_namelen = sizeof(client_addr);
-            msg.msg_iov = packet;
-            msg.msg_iovlen = 2;
-
-            if (sendmsg(comm_sockfd, &msg, 0) < 0)
-                throw std::runtime_error("Failed to send data packet to client");
-        #endif
-
-            if ((recv_offset = recvfrom(comm_sockfd, reinterpret_cast<char*>(recv_buffer), config.getBlockSize() + 4, 0, (struct sockaddr*)&client_addr, &client_addr_len)) < 0) {
-                auto errnum = getOsError();
 
-                if (errnum == TIMEOUT_OS_ERR) {
-                    if (retries == 0) {
-                        sendErrorPacket(comm_sockfd, client_addr, TftpError::ErrorCode::UnknownTransferId, "Transfer ID unknown");
-                        return;
-                    }
-                    retries--;
-                    continue;
+            retries_ = max_retries_;
+            sendWindow();
+            break;
+        case TftpOpcode::Data: {
+            if (info.type != TransferInfo::Type::Write) return fail(TftpError::ErrorCode::IllegalOperation, "Illegal TFTP operation");
+
+            size_t payload_len = len - 4;
+            if (closing_) return;      // final block is in, its ACK is on the way
+            if (dallying_) {
+                if (recv_block_num == static_cast<uint16_t>(block_)) resend();     // final ACK got lost
+                return;
+            }
+
+            if (recv_block_num == static_cast<uint16_t>(block_ + 1)) {
+                if (payload_len > blksize_) return fail(TftpError::ErrorCode::IllegalOperation, "Block too large");
+                if (upload_->failed()) return fail(TftpError::ErrorCode::DiskFull, "Disk full or allocation exceeded");
+
+                // writer is too far behind - treat the block as lost, client retransmits it
+                if (!writer_.write(upload_, buffer + 4, payload_len)) return;
+
+                oack_pending_ = false;
+                gap_acked_ = false;
+                if (window_received_ == 0) sampleRtt();    // first block since our ACK
+                block_++;
+                info.transferred_bytes += static_cast<std::streamsize>(payload_len);
+                count(Metrics::Counter::BytesReceived, payload_len);
+                retries_ = max_retries_;
+
+                if (payload_len < blksize_) {
+                    // the final ACK tells the client its file is safe - not before the writer says it's on disk
+                    window_received_ = 0;
+                    writer_.close(upload_, true);
+                    closing_ = true;
+                    deadline = std::chrono::steady_clock::now() + CloseCheckInterval;
+                } else if (++window_received_ >= windowsize_) {
+                    window_received_ = 0;
+                    setAck(block_);
+                    resend();
                 } else {
-                    throw std::runtime_error("Failed to receive data from client");
+                    deadline = std::chrono::steady_clock::now() + rto_.get();
                 }
+            } else if (!gap_acked_) {
+                // lost block (or our ACK got lost) - tell the client where to restart, once
+                gap_acked_ = true;
+                window_received_ = 0;
+                setAck(block_);
+                count(Metrics::Counter::Retransmissions);
+                resend();
             }
+            break;
+        }
+        case TftpOpcode::Error: {
+            Metrics::getInstance().error(Metrics::Side::Server, false, recv_block_num);
+            if (multicast_ && promoteNext()) return;
+            std::string error_msg(reinterpret_cast<char*>(buffer + 4), strnlen(reinterpret_cast<char*>(buffer + 4), len - 4));
+            return abort(TftpError(TftpError::ErrorType::Tftp, recv_block_num, error_msg));
+        }
+        default:
+            return fail(TftpError::ErrorCode::IllegalOperation, "Illegal TFTP operation");
+        }
+    }
 
-            switch (static_cast<TftpOpcode>(recv_buffer[1])) {
-                case TftpOpcode::Ack: {
-                    uint16_t recv_block_num = ntohs(*reinterpret_cast<uint16_t*>(recv_buffer + 2));
-                    if (recv_block_num != block_num) {
-                        sendErrorPacket(comm_sockfd, client_addr, TftpError::ErrorCode::UnknownTransferId, "Transfer ID unknown");
-                        return;
-                    }
-                    block_num++;
-                    retries = config.getMaxRetries();
-                    break;
-                }
-                case TftpOpcode::Error: {
-                    std::string error_msg = readStringFromBuffer(recv_buffer + 4, config.getBlockSize() + 4 - 4);
-                    throw TftpError(TftpError::ErrorType::Tftp, (recv_buffer[2] << 8) | (recv_buffer[3] & 0xFF), error_msg);
-                }
-                default:
-                    sendErrorPacket(comm_sockfd, client_addr, TftpError::ErrorCode::IllegalOperation, "Illegal TFTP operation");
-                    return;
+    void loadNextBlock() {
+        loaded_++;
+        size_t slot = loaded_ % windowsize_;
+
+        size_t read_len;
+        if (file_) {
+            read_len = file_->read(window_[slot].get(), blksize_, read_at_);
+            read_at_ += read_len;
+        } else {
+            in_.read(reinterpret_cast<char*>(window_[slot].get()), blksize_);
+            read_len = static_cast<size_t>(in_.gcount());
+        }
+        window_len_[slot] = read_len;
+        if (read_len < blksize_) final_block_ = loaded_;
+    }
+
+    // sends every block the window allows, starting at next_ - in batches of one syscall each
+    void sendWindow() {
+        SendBatch batch;
+        uint64_t batch_start = next_;
+        uint64_t first = next_;
+
+        // rate limited - as many blocks as the limiter grants, the rest goes out when it says
+        size_t allowed = std::numeric_limits<size_t>::max();
+        pacing_ = false;
+        if (pacer_) {
+            uint64_t last = final_block_ == 0 ? acked_ + windowsize_ : std::min<uint64_t>(acked_ + windowsize_, final_block_);
+            size_t wanted = next_ <= last ? static_cast<size_t>(last - next_ + 1) : 0;
+            allowed = wanted == 0 ? 0 : RateLimiter::getInstance().acquire(*pacer_, wanted, static_cast<size_t>(blksize_) + 4, pace_at_);
+            pacing_ = allowed < wanted;
+        }
+
+        // false if the socket buffer is full (rest goes out on next ACK/timeout) or sending failed
+        auto flush = [&]() {
+            size_t queued = static_cast<size_t>(next_ - batch_start);
+            size_t sent = batch.flushSegmented(sockfd, multicast_ ? group_addr_ : info.client_addr, offload_);
+            next_ = batch_start + sent;
+            batch_start = next_;
+            if (sent == queued) return true;
+
+            auto errnum = getOsError();
+            if (errnum != WOULDBLOCK_OS_ERR && errnum != EAGAIN && errnum != ENOBUFS)
+                abort(TftpError(TftpError::ErrorType::OS, errnum, "Failed to send data packet to client"));
+            return false;
+        };
+
+        while (next_ - first < allowed && next_ <= acked_ + windowsize_ && (final_block_ == 0 || next_ <= final_block_)) {
+            if (next_ > loaded_) loadNextBlock();
+
+            const uint8_t* payload;
+            size_t payload_len;
+            if (in_memory_) {
+                size_t offset = static_cast<size_t>(next_ - 1) * blksize_;
+                payload = memory_ + offset;
+                payload_len = std::min<size_t>(blksize_, memory_size_ - offset);
+            } else {
+                size_t slot = next_ % windowsize_;
+                payload = window_[slot].get();
+                payload_len = window_len_[slot];
             }
 
-            info.transferred_bytes += buffer_offset;
-    #ifdef USE_PARALLEL_FILE_IO
-        } while (buffer_offset == blksize && data_queue.size() != 0);
-    #else
-        } while (buffer_offset == blksize);
-    #endif
+            batch.add(next_, payload, payload_len);
+            next_++;
+            if (batch.full() && !flush()) break;
+        }
+        if (!batch.empty()) flush();
+        if (done) return;
+        // the client only ACKs a whole window - no ACK is due while part of it is still held back
+        if (pacing_) deadline = pace_at_;
+        if (next_ == first && pacing_) return;
+        if (!data_sent_) {
+            data_sent_ = true;
+            observe(Metrics::Histogram::FirstData, started_at_);
+        }
+        sent_at_ = std::chrono::steady_clock::now();
+        if (!pacing_) deadline = sent_at_ + rto_.get();
+    }
+
+    // RRQ: ACK of what's already acknowledged - the client lost the first block of the window, go back once.
+    // Until everything sent by then is acknowledged further duplicates are answers to blocks it got twice,
+    // resending on those would double every block from there on (sorcerer's apprentice).
+    void duplicateAck() {
+        count(Metrics::Counter::DuplicateAcks);
+        bool window_out = next_ > acked_ + windowsize_ || (final_block_ != 0 && next_ > final_block_);
+        if (!window_out || acked_ < rollback_guard_) return;
+
+        rollback_guard_ = next_;
+        timed_out_ = true;      // whatever answers now can't be timed (Karn)
+        count(Metrics::Counter::Retransmissions);
+        next_ = acked_ + 1;
+        sendWindow();
+    }
+
+    // answer to what went out at sent_at_ - only if nothing was retransmitted in between
+    void sampleRtt() {
+        if (!timed_out_) {
+            auto rtt = std::chrono::steady_clock::now() - sent_at_;
+            rto_.sample(std::chrono::duration_cast<RtoEstimator::duration>(rtt));
+            Metrics::getInstance().observe(Metrics::Side::Server, Metrics::Histogram::BlockRtt, rtt);
+        }
+        timed_out_ = false;
+    }
+
+    // RRQ: client has everything up to transferred bytes
+    void acknowledged(std::streamsize transferred) {
+        if (transferred > info.transferred_bytes) count(Metrics::Counter::BytesSent, static_cast<uint64_t>(transferred - info.transferred_bytes));
+        info.transferred_bytes = transferred;
+    }
+
+    void setAck(uint64_t block_num) {
+        send_buffer_[0] = 0;
+        send_buffer_[1] = static_cast<uint8_t>(TftpOpcode::Ack);
+        send_buffer_[2] = static_cast<uint8_t>((block_num >> 8) & 0xFF);
+        send_buffer_[3] = static_cast<uint8_t>(block_num & 0xFF);
+        send_len_ = 4;
+    }
+
+    // WRQ: the writer is done with the upload - final ACK if it made it to disk, polled until then
+    void uploadClosed() {
+        if (!upload_->closed()) {
+            deadline = std::chrono::steady_clock::now() + CloseCheckInterval;
+            return;
+        }
+        bool failed = upload_->failed();
+        closing_ = false;
+        upload_.reset();
+        if (failed) return fail(TftpError::ErrorCode::DiskFull, "Disk full or allocation exceeded");
+
+        dallying_ = true;
+        setAck(block_);
+        resend();
+    }
+
+    void resend() {
+        if (!sendDatagram(sockfd, info.client_addr, send_buffer_.data(), 4, send_buffer_.data() + 4, send_len_ - 4))
+            return abort(TftpError(TftpError::ErrorType::OS, getOsError(), "Failed to send packet to client"));
+        sent_at_ = std::chrono::steady_clock::now();
+        deadline = sent_at_ + (dallying_ ? timeout_ : rto_.get());
+    }
+
+    void finish() {
+        if (!done && !failure) observe(Metrics::Histogram::TransferTime, started_at_);
+        done = true;
+        closeSession();
+        pacer_.reset();
+        in_.close();
+        file_.reset();
+        map_.unmap();
+        cached_.reset();
+        in_memory_ = false;
+        if (upload_ && !closing_) writer_.close(upload_, false);
+        upload_.reset();
+    }
+
+    void abort(const TftpError& err) {
+        failure = std::make_exception_ptr(err);
+        finish();
+    }
+
+    void fail(TftpError::ErrorCode code, const std::string& msg) {
+        try { sendErrorPacket(sockfd, info.client_addr, code, msg); } catch (...) {}
+        abort(TftpError(TftpError::ErrorType::Tftp, static_cast<int>(code), msg));
+    }
+};
+
+void Server::handleClient (
+    socket_t sockfd,
+    const std::string& root_dir,
+    TransferCallback callback,
+    std::chrono::milliseconds callback_interval
+){
+    uint8_t recv_buffer[MaxRequestSize];
+
+    struct sockaddr_in client_addr = {};
+    socklen_t client_addr_len = sizeof(client_addr);
+
+    int recv_offset = -1;
+
+    if ((recv_offset = recvfrom(sockfd, reinterpret_cast<char*>(recv_buffer), static_cast<int>(sizeof(recv_buffer)), 0, (struct sockaddr*)&client_addr, &client_addr_len)) < 0)
+        return;
+
+    Request request;
+    try {
+        request = parseRequest(recv_buffer, static_cast<size_t>(recv_offset));
+    } catch (const TftpError&) {
+        sendErrorPacket(sockfd, client_addr, TftpError::ErrorCode::IllegalOperation, "Illegal TFTP operation");
+        return;
+    }
+
+    std::filesystem::path file_path;
+    if (!resolvePath(root_dir, request.filename, file_path)) {
+        sendErrorPacket(sockfd, client_addr, TftpError::ErrorCode::AccessViolation, "Access violation");
+        return;
+    }
+
+    // someone else's thread is already sending this file to the group
+    if (Transfer::joinMulticast(request, client_addr, file_path)) return;
+
+    // one writer for every handleClient thread - their uploads share the backlog and get synced together, as in the event loop
+    static WriteBehind writer;
+    Transfer transfer(request, client_addr, root_dir, file_path, writer, callback_interval);
+    transfer.start();
 
-        if (size_divisible) {
-            data_header[2] = block_num >> 8;
-            data_header[3] = block_num & 0xFF;
+    Poller poller;
+    poller.add(transfer.sockfd, 0);
+    std::vector<Poller::Event> events(1);
 
-            if (sendto(comm_sockfd, reinterpret_cast<char*>(data_header), 4, 0, (struct sockaddr*)&client_addr, sizeof(client_addr)) < 0)
-                throw std::runtime_error("Failed to send last data packet to client");
+    // progress is reported from this loop too, between packets - no thread of its own
+    while (!transfer.done) {
+        auto wake = callback ? std::min(transfer.deadline, transfer.progress.deadline()) : transfer.deadline;
+        auto wait = std::chrono::ceil<std::chrono::milliseconds>(wake - std::chrono::steady_clock::now());
+        if (wait.count() > 0 && poller.wait(events, static_cast<int>(wait.count())) > 0) {
+            transfer.onReadable();
+        } else if (std::chrono::steady_clock::now() >= transfer.deadline) {
+            transfer.onTimeout();
         }
 
-        callback(info);
-        guard.forceCleanup();
+        if (callback && !transfer.done && transfer.progress.due(static_cast<uint64_t>(transfer.info.transferred_bytes))) callback(transfer.info);
+    }
+
+    if (callback) callback(transfer.info);
+    if (transfer.failure) std::rethrow_exception(transfer.failure);
+}
+
+Server::Server (
+    const std::string& root_dir,
+    uint16_t port,
+    TransferCallback callback,
+    std::chrono::milliseconds callback_interval
+) : port_(port), root_dir_(root_dir), callback_(callback), callback_interval_(callback_interval),
+    running_(false), active_transfers_(0) {
+#ifdef _WIN32
+    WSADATA wsaData;
+    if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0)
+        throw TftpError(TftpError::ErrorType::OS, getOsError(), "Failed to initialize Winsock");
+#endif
+
+    size_t workers = Config::getInstance().getServerWorkers();
+    if (workers == 0) workers = std::max(1u, std::thread::hardware_concurrency());
+#ifndef SO_REUSEPORT
+    workers = 1;    // a second socket couldn't bind the port
+#endif
+
+    auto close_all = [this] {
+        for (socket_t& sockfd : sockfds_) clean_sockfd(sockfd);
+    };
+
+    struct sockaddr_in local_addr = {};
+    local_addr.sin_family = AF_INET;
+    local_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    local_addr.sin_port = htons(port);
+
+    // the kernel hashes each client's address to one of the sockets, so its retries land on the same worker
+    for (size_t i = 0; i < workers; i++) {
+        socket_t sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+        if (sockfd == INVALID_SOCKET) {
+            auto errnum = getOsError();
+            close_all();
+            throw TftpError(TftpError::ErrorType::OS, errnum, "Failed to create socket");
+        }
+        sockfds_.push_back(sockfd);
+
+#ifdef SO_REUSEPORT
+        int reuse = 1;
+        if (workers > 1 && setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) < 0) {
+            auto errnum = getOsError();
+            close_all();
+            throw TftpError(TftpError::ErrorType::OS, errnum, "Failed to set SO_REUSEPORT");
+        }
+#endif
+
+        // port 0 picks an ephemeral port for the first socket, the rest join it there
+        socklen_t local_addr_len = sizeof(local_addr);
+        if (bind(sockfd, (struct sockaddr*)&local_addr, sizeof(local_addr)) < 0 ||
+            getsockname(sockfd, (struct sockaddr*)&local_addr, &local_addr_len) < 0) {
+            auto errnum = getOsError();
+            close_all();
+            throw TftpError(TftpError::ErrorType::OS, errnum, "Failed to bind socket");
+        }
+
+        setNonBlocking(sockfd);
+    }
+    port_ = ntohs(local_addr.sin_port);
+
+    // upload writers run on the shared pool - its threads start now, not on the first WRQ
+    ThreadPool::getInstance();
+
+    // a miss is served from disk until the pool has read it - get the known hot ones in before the first request
+    try {
+        preloadCache(root_dir_, Config::getInstance().getCacheManifest());
+    } catch (const TftpError&) {
+        close_all();
+        throw;
+    }
+}
+
+Server::~Server() {
+    for (socket_t& sockfd : sockfds_) clean_sockfd(sockfd);
+}
+
+void Server::run() {
+    running_ = true;
+    if (sockfds_.size() == 1) {
+        serve(sockfds_[0]);
         return;
     }
-    else if (info.type == TransferInfo::Type::Write) {
-        // transfer loop
+
+    // shared-nothing workers - each has its own socket, event loop, transfer table and core
+    std::vector<std::thread> workers;
+    std::vector<std::exception_ptr> failures(sockfds_.size());
+    for (size_t i = 0; i < sockfds_.size(); i++) {
+        workers.emplace_back([this, i, &failures] {
+            pinToCore(i);
+            try {
+                serve(sockfds_[i]);
+            } catch (...) {
+                failures[i] = std::current_exception();
+                running_ = false;
+            }
+        });
+    }
+    for (auto& t : workers) t.join();
+
+    for (auto& failure : failures) {
+        if (failure) std::rethrow_exception(failure);
     }
-    else {
-        throw std::runtime_error("Invalid transfer type");
+}
+
+void Server::serve(socket_t sockfd) {
+    using clock = std::chrono::steady_clock;
+
+    Poller poller;
+    poller.add(sockfd, 0);
+
+    // shared by all uploads, declared first so it outlives them and drains on the way out
+    WriteBehind writer;
+
+    // transfer table - poller token is slot index + 1, 0 is the listening socket
+    std::vector<std::unique_ptr<Transfer>> transfers;
+    std::vector<size_t> free_slots;
+    std::vector<size_t> finished;
+    std::vector<Poller::Event> events(256);
+    RecvBatch requests(32, MaxRequestSize);
+
+    auto release = [&](size_t slot) {
+        Transfer& t = *transfers[slot];
+        if (callback_) callback_(t.info);
+        poller.remove(t.sockfd);
+        transfers[slot].reset();
+        free_slots.push_back(slot);
+        active_transfers_--;
+    };
+
+    // requests from different clients are drained a batch at a time
+    auto accept_requests = [&](clock::time_point& next_sweep) {
+        int received;
+        while ((received = requests.receive(sockfd)) > 0) {
+            for (int i = 0; i < received; i++) {
+                const struct sockaddr_in& client_addr = requests.from(i);
+
+                try {
+                    Request request = parseRequest(requests.data(i), requests.length(i));
+
+                    std::filesystem::path file_path;
+                    if (!resolvePath(root_dir_, request.filename, file_path)) {
+                        sendErrorPacket(sockfd, client_addr, TftpError::ErrorCode::AccessViolation, "Access violation");
+                        continue;
+                    }
+
+                    if (Transfer::joinMulticast(request, client_addr, file_path)) continue;
+
+                    auto transfer = std::make_unique<Transfer>(request, client_addr, root_dir_, file_path, writer, callback_interval_);
+                    transfer->start();
+                    if (transfer->done) continue;
+
+                    size_t slot;
+                    if (free_slots.empty()) {
+                        slot = transfers.size();
+                        transfers.emplace_back();
+                    } else {
+                        slot = free_slots.back();
+                        free_slots.pop_back();
+                    }
+
+                    poller.add(transfer->sockfd, slot + 1);
+                    next_sweep = std::min(next_sweep, transfer->deadline);
+                    transfers[slot] = std::move(transfer);
+                    active_transfers_++;
+
+                    if (callback_) callback_(transfers[slot]->info);
+                } catch (const TftpError&) {
+                    try { sendErrorPacket(sockfd, client_addr, TftpError::ErrorCode::IllegalOperation, "Illegal TFTP operation"); } catch (...) {}
+                } catch (const std::exception&) {
+                    // out of sockets, memory, etc. - the client will retry or give up
+                }
+            }
+        }
+    };
+
+    clock::time_point next_sweep = clock::now();
+
+    while (running_) {
+        // wake up at least every 100ms, so stop() is noticed
+        auto now = clock::now();
+        auto wait = std::chrono::ceil<std::chrono::milliseconds>(std::min(next_sweep, now + std::chrono::milliseconds(100)) - now);
+        size_t n = poller.wait(events, static_cast<int>(std::max<int64_t>(wait.count(), 0)));
+
+        for (size_t i = 0; i < n; i++) {
+            if (events[i].token == 0) {
+                accept_requests(next_sweep);
+                continue;
+            }
+
+            size_t slot = static_cast<size_t>(events[i].token - 1);
+            if (slot >= transfers.size() || !transfers[slot] || transfers[slot]->done) continue;
+
+            Transfer& t = *transfers[slot];
+            t.onReadable();
+            if (t.done) {
+                finished.push_back(slot);
+                continue;
+            }
+
+            next_sweep = std::min(next_sweep, t.deadline);
+            if (callback_ && t.progress.due(static_cast<uint64_t>(t.info.transferred_bytes))) callback_(t.info);
+        }
+
+        for (size_t slot : finished) release(slot);
+        finished.clear();
+
+        // timers - only walk the table once the earliest deadline we know of has passed
+        now = clock::now();
+        if (now < next_sweep) continue;
+
+        next_sweep = now + std::chrono::seconds(1);
+        for (size_t slot = 0; slot < transfers.size(); slot++) {
+            if (!transfers[slot]) continue;
+            Transfer& t = *transfers[slot];
+
+            if (now >= t.deadline) t.onTimeout();
+            if (t.done) {
+                release(slot);
+                continue;
+            }
+
+            if (callback_ && t.progress.due(static_cast<uint64_t>(t.info.transferred_bytes), now)) callback_(t.info);
+
+            next_sweep = std::min(next_sweep, t.deadline);
+            if (callback_) next_sweep = std::min(next_sweep, t.progress.deadline());
+        }
     }
 
-    
+    for (size_t slot = 0; slot < transfers.size(); slot++) {
+        if (!transfers[slot]) continue;
+        try { sendErrorPacket(transfers[slot]->sockfd, transfers[slot]->info.client_addr, TftpError::ErrorCode::None, "Server shutting down"); } catch (...) {}
+        release(slot);
+    }
 }
@@ -0,0 +1,105 @@
+#include "../inc/thread_pool.hpp"
+
+using namespace tftp;
+
+thread_local size_t ThreadPool::self_ = 0;
+
+ThreadPool::ThreadPool(size_t threads) : queued_(0), next_(0) {
+    if (threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+
+    for (size_t i = 0; i < threads; i++) workers_.push_back(std::make_unique<Worker>());
+    for (size_t i = 0; i < threads; i++) std::thread([this, i] { run(i); }).detach();
+}
+
+void ThreadPool::submit(Task task) {
+    if (queued_.load(std::memory_order_relaxed) >= MaxQueued) {
+        task();
+        return;
+    }
+
+    // a worker keeps what it spawns, anyone else spreads tasks around
+    size_t target = self_ != 0 ? self_ - 1 : next_.fetch_add(1, std::memory_order_relaxed) % workers_.size();
+    queued_++;      // counted before it's visible, a thief can't take it below zero
+    {
+        std::lock_guard<std::mutex> lock(workers_[target]->mutex);
+        workers_[target]->tasks.push_back(std::move(task));
+    }
+
+    // taking the lock orders this against a worker that just found nothing and is about to wait
+    { std::lock_guard<std::mutex> lock(idle_mutex_); }
+    idle_cv_.notify_one();
+}
+
+bool ThreadPool::pop(size_t self, Task& task) {
+    {
+        Worker& own = *workers_[self];
+        std::lock_guard<std::mutex> lock(own.mutex);
+        if (!own.tasks.empty()) {
+            task = std::move(own.tasks.back());
+            own.tasks.pop_back();
+            queued_--;
+            return true;
+        }
+    }
+
+    for (size_t i = 1; i < workers_.size(); i++) {
+        Worker& victim = *workers_[(self + i) % workers_.size()];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (!victim.tasks.empty()) {
+            task = std::move(victim.tasks.front());
+            victim.tasks.pop_front();
+            queued_--;
+            return true;
+        }
+    }
+    return false;
+}
+
+void ThreadPool::run(size_t self) {
+    self_ = self + 1;
+
+    Task task;
+    while (true) {
+        if (pop(self, task)) {
+            task();
+            task = nullptr;
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(idle_mutex_);
+        idle_cv_.wait(lock, [this] { return queued_.load() > 0; });
+    }
+}
+
+void SerialTask::schedule() {
+    int state = state_.load();
+    while (true) {
+        if (state == Rescheduled) return;
+        if (state == Scheduled) {
+            if (state_.compare_exchange_weak(state, Rescheduled)) return;
+            continue;
+        }
+        if (state_.compare_exchange_weak(state, Scheduled)) break;
+    }
+    ThreadPool::getInstance().submit([this] { run(); });
+}
+
+void SerialTask::wait() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [this] { return state_.load() == Idle; });
+}
+
+void SerialTask::run() {
+    while (true) {
+        fn_();
+
+        // under the mutex - once Idle is seen, wait() may return and the task be gone
+        std::lock_guard<std::mutex> lock(mutex_);
+        int state = Scheduled;
+        if (state_.compare_exchange_strong(state, Idle)) {
+            cv_.notify_all();
+            return;
+        }
+        state_ = Scheduled;
+    }
+}
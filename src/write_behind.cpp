@@ -0,0 +1,300 @@
+#include "../inc/write_behind.hpp"
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <fcntl.h>
+#endif
+
+#include <unordered_map>
+
+using namespace tftp;
+
+namespace {
+    // ".name.N.part" next to path, created exclusively - same directory, so the rename stays on one file system
+    FILE* openTemporary(const std::filesystem::path& path, std::filesystem::path& temp_path) {
+        static std::atomic<unsigned> counter{0};
+        for (int attempt = 0; attempt < 100; attempt++) {
+            temp_path = path.parent_path() / ("." + path.filename().string() + "." + std::to_string(counter++) + ".part");
+            FILE* fp = std::fopen(temp_path.string().c_str(), "wbx");
+            if (fp != nullptr || errno != EEXIST) return fp;
+        }
+        return nullptr;
+    }
+}
+
+WriteBehind::WriteBehind(std::streamsize max_backlog)
+    : backlog_(0), max_backlog_(max_backlog) {
+#ifdef TFTP_HAVE_IO_URING
+    if (Config::getInstance().getIoUring() && IoUring::supported()) {
+        try {
+            ring_ = std::make_unique<IoUring>(RingEntries);
+            if (ring_->registerFiles(MaxFixedFiles)) {
+                for (unsigned i = MaxFixedFiles; i-- > 0;) free_fixed_.push_back(i);
+            }
+            fixed_buffers_ = ring_->registerBuffers(MaxFixedBuffers);
+        } catch (const TftpError&) {
+            ring_.reset();      // plain writes then
+        }
+    }
+#endif
+    writer_ = std::make_unique<SerialTask>([this] { drain(); });
+}
+
+WriteBehind::~WriteBehind() {
+    writer_->wait();
+}
+
+std::shared_ptr<WriteBehind::File> WriteBehind::open(const std::filesystem::path& path, std::streamsize expected_size) {
+    if (std::filesystem::exists(path) && !std::filesystem::is_regular_file(path)) return nullptr;
+
+    auto file = std::make_shared<File>();
+    file->path_ = path;
+    file->fp_ = openTemporary(path, file->temp_path_);
+    if (file->fp_ == nullptr) return nullptr;
+
+    // our batches are already large, stdio buffering would only add a copy
+    std::setvbuf(file->fp_, nullptr, _IONBF, 0);
+
+#ifdef __linux__
+    // reserve the blocks up front (less fragmentation, early ENOSPC) without changing the file size
+    if (expected_size > 0)
+        fallocate(fileno(file->fp_), FALLOC_FL_KEEP_SIZE, 0, static_cast<off_t>(expected_size));
+#else
+    (void)expected_size;
+#endif
+
+    return file;
+}
+
+bool WriteBehind::write(const std::shared_ptr<File>& file, const uint8_t* data, size_t len) {
+    // an empty backlog always takes the block, a limit below BatchSize would never drain otherwise
+    if (backlog_ > 0 && backlog_ + static_cast<std::streamsize>(len) > max_backlog_) {
+        // part of the backlog may be this file's own batch - hand it over so the writer can work it off
+        if (file->batch_len_ > 0) flush(file);
+        return false;
+    }
+
+    if (file->batch_ && file->batch_len_ + len > BatchSize) flush(file);
+    if (!file->batch_) file->batch_ = BlockPool::getInstance().acquire(BatchSize);
+
+    std::memcpy(file->batch_.get() + file->batch_len_, data, len);
+    file->batch_len_ += len;
+    backlog_ += static_cast<std::streamsize>(len);     // counted from here, not from the hand-over - batches of every upload
+    if (file->batch_len_ == BatchSize) flush(file);
+    return true;
+}
+
+void WriteBehind::close(const std::shared_ptr<File>& file, bool keep) {
+    push(Job { file, std::move(file->batch_), file->batch_len_, true, keep });
+    file->batch_len_ = 0;
+}
+
+void WriteBehind::flush(const std::shared_ptr<File>& file) {
+    push(Job { file, std::move(file->batch_), file->batch_len_, false, true });
+    file->batch_len_ = 0;
+}
+
+void WriteBehind::push(Job&& job) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        jobs_.push_back(std::move(job));
+    }
+    writer_->schedule();
+}
+
+// one writer round after another until nothing's queued - anything pushed later schedules the next
+void WriteBehind::drain() {
+    std::deque<Job> jobs;
+    std::vector<Job> finished;
+
+    while (true) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (jobs_.empty()) return;
+            jobs.swap(jobs_);
+        }
+
+        bool synced = false;
+    #ifdef TFTP_HAVE_IO_URING
+        if (ring_) {
+            writeRing(jobs);
+            synced = true;
+        }
+    #endif
+
+        for (auto& job : jobs) {
+            File& file = *job.file;
+            if (!synced && job.len > 0 && !file.failed()) {
+                if (std::fwrite(job.data.get(), 1, job.len, file.fp_) != job.len)
+                    file.error_ = errno != 0 ? errno : EIO;
+            }
+            backlog_ -= static_cast<std::streamsize>(job.len);
+            job.data.reset();
+
+            if (job.close) finished.push_back(std::move(job));
+        }
+        jobs.clear();
+
+        finish(finished, synced);
+    }
+}
+
+void WriteBehind::finish(std::vector<Job>& finished, bool synced) {
+    // group commit - everything that completed during this round goes to disk together
+    for (auto& job : finished) {
+        File& file = *job.file;
+        if (!synced && job.keep && !file.failed()) {
+        #ifdef _WIN32
+            if (_commit(_fileno(file.fp_)) != 0) file.error_ = errno;
+        #else
+            if (fdatasync(fileno(file.fp_)) != 0) file.error_ = errno;
+        #endif
+        }
+    #ifdef TFTP_HAVE_IO_URING
+        if (file.fixed_ >= 0) {
+            ring_->updateFile(static_cast<unsigned>(file.fixed_), -1);
+            free_fixed_.push_back(static_cast<unsigned>(file.fixed_));
+            file.fixed_ = -1;
+        }
+    #endif
+        if (std::fclose(file.fp_) != 0 && job.keep && !file.failed()) file.error_ = errno != 0 ? errno : EIO;
+        file.fp_ = nullptr;
+
+        std::error_code ec;
+        if (job.keep && !file.failed()) {
+            std::filesystem::rename(file.temp_path_, file.path_, ec);
+            if (ec) file.error_ = ec.value();
+        }
+        if (!job.keep || file.failed()) std::filesystem::remove(file.temp_path_, ec);
+        file.closed_ = true;
+    }
+    finished.clear();
+}
+
+#ifdef TFTP_HAVE_IO_URING
+bool WriteBehind::fixedBuffer(const uint8_t* data, unsigned& index) {
+    if (!fixed_buffers_) return false;
+
+    size_t slab;
+    uint8_t* base;
+    if (!BlockPool::getInstance().findSlab(data, slab, base) || slab >= MaxFixedBuffers) return false;
+
+    // slabs live as long as the process, so once registered they stay valid
+    if (slab >= slabs_.size()) slabs_.resize(slab + 1, 0);
+    if (slabs_[slab] == 0) slabs_[slab] = ring_->updateBuffer(static_cast<unsigned>(slab), base, BlockPool::SlabSize) ? 1 : -1;
+    index = static_cast<unsigned>(slab);
+    return slabs_[slab] == 1;
+}
+
+void WriteBehind::writeRing(std::deque<Job>& jobs) {
+    if (broken_) {
+        for (auto& job : jobs) {
+            int expected = 0;
+            job.file->error_.compare_exchange_strong(expected, EIO);
+        }
+        return;
+    }
+
+    // a file's writes (and its fsync) have to stay in order - consecutive SQEs linked into one chain per file
+    std::vector<std::pair<File*, std::vector<Job*>>> chains;
+    std::unordered_map<File*, size_t> chain_of;
+    for (auto& job : jobs) {
+        auto it = chain_of.emplace(job.file.get(), chains.size()).first;
+        if (it->second == chains.size()) chains.push_back({ job.file.get(), {} });
+        chains[it->second].second.push_back(&job);
+    }
+
+    struct Op {
+        File* file;
+        size_t len;     // 0 - fsync
+    };
+    std::vector<Op> ops;
+    unsigned in_flight = 0;
+
+    auto fail = [](File& file, int error) {
+        int expected = 0;
+        file.error_.compare_exchange_strong(expected, error);
+    };
+
+    auto drain = [&] {
+        while (in_flight > 0) {
+            if (!ring_->submit(in_flight)) {
+                // the ring itself is broken - fail this round and everything after it
+                int error = errno != 0 ? errno : EIO;
+                for (auto& chain : chains) fail(*chain.first, error);
+                broken_ = true;
+                return false;
+            }
+            in_flight -= ring_->reap([&](const struct io_uring_cqe& cqe) {
+                Op& op = ops[cqe.user_data];
+                if (cqe.res == -ECANCELED) fail(*op.file, EIO);     // an earlier link failed
+                else if (cqe.res < 0) fail(*op.file, -cqe.res);
+                else if (static_cast<size_t>(cqe.res) < op.len) fail(*op.file, EIO);   // short write breaks the chain too
+            });
+        }
+        return true;
+    };
+
+    struct io_uring_sqe* last = nullptr;
+    for (auto& chain : chains) {
+        File& file = *chain.first;
+        if (file.failed()) continue;
+
+        int fd = fileno(file.fp_);
+        if (file.fixed_ < 0 && !free_fixed_.empty() && ring_->updateFile(free_fixed_.back(), fd)) {
+            file.fixed_ = static_cast<int>(free_fixed_.back());
+            free_fixed_.pop_back();
+        }
+
+        auto queue = [&](uint8_t opcode, size_t len) -> struct io_uring_sqe* {
+            struct io_uring_sqe* sqe = ring_->getSqe();
+            if (sqe == nullptr) {
+                // queue is full - end the chain here and let it complete before going on, keeps the order
+                if (last != nullptr) last->flags &= ~IOSQE_IO_LINK;
+                if (!drain()) return nullptr;
+                sqe = ring_->getSqe();
+            }
+
+            sqe->opcode = opcode;
+            if (file.fixed_ >= 0) {
+                sqe->fd = file.fixed_;
+                sqe->flags = IOSQE_FIXED_FILE;
+            } else {
+                sqe->fd = fd;
+            }
+            sqe->flags |= IOSQE_IO_LINK;
+            sqe->user_data = ops.size();
+            ops.push_back(Op { &file, len });
+            in_flight++;
+            last = sqe;
+            return sqe;
+        };
+
+        last = nullptr;
+        for (Job* job : chain.second) {
+            if (job->len > 0) {
+                unsigned buf_index;
+                bool fixed = fixedBuffer(job->data.get(), buf_index);
+                struct io_uring_sqe* sqe = queue(fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE, job->len);
+                if (sqe == nullptr) return;
+
+                if (fixed) sqe->buf_index = static_cast<uint16_t>(buf_index);
+                sqe->addr = reinterpret_cast<uint64_t>(job->data.get());
+                sqe->len = static_cast<uint32_t>(job->len);
+                sqe->off = file.offset_;
+                file.offset_ += job->len;
+            }
+
+            if (job->close && job->keep) {
+                struct io_uring_sqe* sqe = queue(IORING_OP_FSYNC, 0);
+                if (sqe == nullptr) return;
+                sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+            }
+        }
+        if (last != nullptr) last->flags &= ~IOSQE_IO_LINK;
+    }
+
+    drain();
+}
+#endif
@@ -0,0 +1,562 @@
+#include "../inc/tftp.hpp"
+#include <functional>
+#include <sstream>
+#include <random>
+
+// Self-contained: runs the event-loop server in-process on an ephemeral port
+// and checks that files survive a round trip through it.
+
+namespace fs = std::filesystem;
+
+std::string makeData(size_t size, unsigned seed) {
+    std::mt19937 rng(seed);
+    std::string data(size, '\0');
+    for (auto& c : data) c = static_cast<char>(rng());
+    return data;
+}
+
+void writeFile(const fs::path& path, const std::string& data) {
+    std::ofstream ofs(path, std::ios::binary);
+    ofs.write(data.data(), data.size());
+}
+
+int main(void) {
+    fs::path root = fs::temp_directory_path() / "tftp_loopback_test";
+    fs::remove_all(root);
+    fs::create_directories(root);
+
+    const size_t blksize = tftp::Config::getInstance().getBlockSize();
+    const std::vector<size_t> sizes = { 0, 1, 511, blksize, blksize * 3, blksize * 3 + 17, (1 << 20) + 123 };
+
+    std::vector<std::string> contents;
+    for (size_t i = 0; i < sizes.size(); i++) {
+        contents.push_back(makeData(sizes[i], static_cast<unsigned>(i)));
+        writeFile(root / ("file" + std::to_string(i)), contents.back());
+    }
+
+    // hot files the server loads into its cache up front - missing ones are skipped
+    std::ofstream(root / "manifest") << "# preloaded\nfile6\n\nfile5\nmissing\n";
+    tftp::Config::getInstance().setCacheManifest((root / "manifest").string());
+
+    int failures = 0;
+    std::mutex output_mutex;
+    uint64_t bytes_read = 0, bytes_written = 0, transfers = 0;     // what the client metrics have to add up to
+
+    auto recvCheck = [&](const std::string& remote, size_t i, const std::string& expected, const std::string& label) {
+        std::ostringstream oss(std::ios::binary);
+        std::string result;
+        try {
+            tftp::Client::recv(remote, "file" + std::to_string(i), oss);
+            result = oss.str() == expected ? "ok" : "content mismatch (" + std::to_string(oss.str().size()) + " bytes)";
+        } catch (const tftp::TftpError& e) {
+            std::ostringstream err;
+            err << e;
+            result = err.str();
+        }
+
+        std::lock_guard<std::mutex> lock(output_mutex);
+        std::cout << "recv file" << i << " (" << expected.size() << " bytes, " << label << "): " << result << std::endl;
+        if (result != "ok") failures++;
+        else {
+            bytes_read += expected.size();
+            transfers++;
+        }
+    };
+
+    auto missingCheck = [&](const std::string& remote, const std::string& filename, const std::string& label) {
+        std::string result;
+        try {
+            std::ostringstream oss;
+            tftp::Client::recv(remote, filename, oss);
+            result = "no error";
+        } catch (const tftp::TftpError& e) {
+            result = e.getCode() == static_cast<int>(tftp::TftpError::ErrorCode::FileNotFound) ? "ok" : "wrong error";
+        }
+        std::cout << "recv " << filename << " (" << label << "): " << result << std::endl;
+        if (result != "ok") failures++;
+    };
+
+    // Config is plain data - it's only changed while no server is running, so every mode gets its own
+    auto serve = [](const fs::path& root, const std::function<void(const std::string&)>& body) {
+        tftp::Server server(root.string(), 0);
+        std::thread server_thread([&server] { server.run(); });
+        std::cout << "Server started, listening on port " << server.getPort() << std::endl;
+        body("127.0.0.1:" + std::to_string(server.getPort()));
+        server.stop();
+        server_thread.join();
+    };
+
+    // whole round twice - epoll and plain writes, then io_uring where the kernel has it
+    for (bool io_uring : { false, true }) {
+        tftp::Config::getInstance().setIoUring(io_uring);
+        std::cout << (io_uring ? "io_uring" : "default") << " backend" << std::endl;
+        // second round looks files up through the open file cache, the first goes to the file system every time
+        tftp::Config::getInstance().setOpenFileCacheSize(io_uring ? 64 : 0);
+
+        // every file at once - the server has to serve them concurrently, from a mapping, through reads and from its cache
+        for (std::string mode : { "mapped", "read", "cached" }) {
+            tftp::Config::getInstance().setMappedReads(mode == "mapped");
+            tftp::Config::getInstance().setCacheSize(mode == "cached" ? 64 << 20 : 0);
+
+            serve(root, [&](const std::string& remote) {
+                std::vector<std::thread> clients;
+                for (size_t i = 0; i < sizes.size(); i++) {
+                    clients.emplace_back([&, i] { recvCheck(remote, i, contents[i], mode); });
+                }
+                for (auto& t : clients) t.join();
+
+                if (mode == "read") {
+                    // gone and back - neither the file nor its absence may be remembered past the change
+                    fs::rename(root / "file3", root / "file3.away");
+                    missingCheck(remote, "file3", "moved away");
+                    fs::rename(root / "file3.away", root / "file3");
+                    recvCheck(remote, 3, contents[3], "moved back");
+                }
+                if (mode != "cached") return;
+
+                // first requests were served from disk while the cache loaded them - now they come out of it
+                std::this_thread::sleep_for(std::chrono::milliseconds(50));
+                for (size_t i = 0; i < sizes.size(); i++) recvCheck(remote, i, contents[i], "cached, warm");
+
+                // a cached file that changed on disk has to be reloaded, not served stale
+                std::string changed = makeData(sizes[4] + 100, 100);
+                writeFile(root / "file4", changed);
+                recvCheck(remote, 4, changed, "cached, changed");
+                writeFile(root / "file4", contents[4]);
+                recvCheck(remote, 4, contents[4], "cached, restored");
+            });
+        }
+        tftp::Config::getInstance().setCacheSize(0);
+
+        // RFC 2090 over loopback - clients of the same file share a session, the late ones fill in what they missed
+        tftp::Config::getInstance().setMulticastAddress("239.255.0.69");
+        tftp::Config::getInstance().setMulticastInterface("127.0.0.1");
+        tftp::Config::getInstance().setRequestMulticast(true);
+        serve(root, [&](const std::string& remote) {
+            std::vector<std::thread> clients;
+            for (size_t i : { 6, 6, 6, 6, 3, 3, 0 }) {
+                clients.emplace_back([&, i] { recvCheck(remote, i, contents[i], "multicast"); });
+            }
+            for (auto& t : clients) t.join();
+        });
+        tftp::Config::getInstance().setRequestMulticast(false);
+        tftp::Config::getInstance().setMulticastAddress("");
+
+        // and the same files back up, again all at once - Client::send refuses empty streams, so skip file0
+        std::vector<std::string> upload_results(sizes.size());
+        serve(root, [&](const std::string& remote) {
+            std::vector<std::thread> clients;
+            for (size_t i = 1; i < sizes.size(); i++) {
+                clients.emplace_back([&, i] {
+                    std::istringstream iss(contents[i], std::ios::binary);
+                    try {
+                        tftp::Client::send(remote, "upload" + std::to_string(i), iss);
+                        upload_results[i] = "ok";
+                    } catch (const tftp::TftpError& e) {
+                        std::ostringstream err;
+                        err << e;
+                        upload_results[i] = err.str();
+                    }
+                });
+            }
+            for (auto& t : clients) t.join();
+
+            // the final ACK waits for the writer - an upload is in place, whole, as soon as send() returns
+            for (size_t i = 1; i < sizes.size(); i++) {
+                std::string& result = upload_results[i];
+                if (result != "ok") continue;
+                std::ifstream ifs(root / ("upload" + std::to_string(i)), std::ios::binary);
+                std::string stored((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+                if (stored != contents[i]) result = "content mismatch (" + std::to_string(stored.size()) + " bytes)";
+            }
+
+            // missing file must be reported as a TFTP error, not hang
+            try {
+                std::ostringstream oss;
+                tftp::Client::recv(remote, "does_not_exist", oss);
+                std::cout << "recv missing file: no error" << std::endl;
+                failures++;
+            } catch (const tftp::TftpError& e) {
+                bool ok = e.getType() == tftp::TftpError::ErrorType::Tftp && e.getCode() == static_cast<int>(tftp::TftpError::ErrorCode::FileNotFound);
+                std::cout << "recv missing file: " << (ok ? "ok" : "wrong error") << std::endl;
+                if (!ok) failures++;
+            }
+        });
+
+        for (size_t i = 1; i < sizes.size(); i++) {
+            std::string& result = upload_results[i];
+            fs::remove(root / ("upload" + std::to_string(i)));     // next round must write it again
+
+            std::cout << "send upload" << i << " (" << sizes[i] << " bytes): " << result << std::endl;
+            if (result != "ok") failures++;
+            else {
+                bytes_written += sizes[i];
+                transfers++;
+            }
+        }
+
+        // uploads are written to temporary files first - none of them may be left behind
+        for (const auto& entry : fs::directory_iterator(root)) {
+            if (entry.path().extension() != ".part") continue;
+            std::cout << "leftover " << entry.path().filename().string() << std::endl;
+            failures++;
+        }
+    }
+
+    // progress comes from the transfer loops themselves - on the calling thread, every 64 KiB
+    {
+        tftp::Config::getInstance().setProgressBytes(64 << 10);
+        std::atomic<size_t> server_reports(0);
+        tftp::Server server(root.string(), 0, [&](tftp::Server::TransferInfo&) { server_reports++; }, std::chrono::seconds(10));
+        std::thread server_thread([&server] { server.run(); });
+
+        size_t client_reports = 0;
+        const auto caller = std::this_thread::get_id();
+        bool same_thread = true;
+        size_t last_reported = 0;
+        std::ostringstream oss(std::ios::binary);
+        try {
+            tftp::Client::recv("127.0.0.1:" + std::to_string(server.getPort()), "file6", oss, [&](tftp::Client::Progress& progress) {
+                client_reports++;
+                same_thread = same_thread && std::this_thread::get_id() == caller;
+                last_reported = progress.transferred_bytes;
+            }, std::chrono::seconds(10));
+        } catch (const tftp::TftpError& e) {
+            std::cout << "recv with progress: " << e << std::endl;
+            failures++;
+        }
+        server.stop();
+        server_thread.join();
+        tftp::Config::getInstance().setProgressBytes(0);
+
+        // 1 MiB in 64 KiB steps - at most one report per wakeup, and nothing would fire on time with a 10s interval.
+        // The server always reports a transfer's start and end, anything past that came from the byte threshold.
+        bool ok = oss.str() == contents[6] && same_thread && client_reports >= 4 && last_reported == contents[6].size() && server_reports >= 4;
+        if (oss.str() == contents[6]) {
+            bytes_read += contents[6].size();
+            transfers++;
+        }
+        std::cout << "progress reports: client " << client_reports << ", server " << server_reports << (ok ? " ok" : " too few") << std::endl;
+        if (!ok) failures++;
+    }
+
+    // a hundred-odd transfers in flight on two threads through futures, then uploads on a loop this thread drives
+    {
+        std::vector<std::string> async_uploads(sizes.size());
+        serve(root, [&](const std::string& remote) {
+            tftp::AsyncClient async(2);
+            std::vector<std::unique_ptr<std::ostringstream>> outputs;
+            std::vector<std::pair<size_t, std::future<std::streamsize>>> pending;
+            for (int round = 0; round < 20; round++) {
+                for (size_t i = 0; i < sizes.size(); i++) {
+                    outputs.push_back(std::make_unique<std::ostringstream>(std::ios::binary));
+                    pending.emplace_back(i, async.recv(remote, "file" + std::to_string(i), *outputs.back()));
+                }
+            }
+
+            size_t ok = 0;
+            for (size_t n = 0; n < pending.size(); n++) {
+                size_t i = pending[n].first;
+                try {
+                    std::streamsize got = pending[n].second.get();
+                    if (got == static_cast<std::streamsize>(sizes[i]) && outputs[n]->str() == contents[i]) {
+                        ok++;
+                        bytes_read += sizes[i];
+                        transfers++;
+                    }
+                } catch (const tftp::TftpError& e) {
+                    std::cout << "async recv file" << i << ": " << e << std::endl;
+                }
+            }
+            std::cout << "async recv: " << ok << "/" << pending.size() << " ok" << std::endl;
+            if (ok != pending.size()) failures++;
+
+            tftp::AsyncClient driven(0);
+            const auto caller = std::this_thread::get_id();
+            std::vector<std::unique_ptr<std::istringstream>> inputs;
+            for (size_t i = 1; i < sizes.size(); i++) {
+                inputs.push_back(std::make_unique<std::istringstream>(contents[i], std::ios::binary));
+                driven.send(remote, "async_upload" + std::to_string(i), *inputs.back(), [&, i](std::streamsize bytes, std::exception_ptr error) {
+                    std::string& result = async_uploads[i];
+                    if (std::this_thread::get_id() != caller) result = "callback on another thread";
+                    else if (error) {
+                        try { std::rethrow_exception(error); } catch (const tftp::TftpError& e) {
+                            std::ostringstream err;
+                            err << e;
+                            result = err.str();
+                        }
+                    } else result = bytes == static_cast<std::streamsize>(sizes[i]) ? "ok" : "short (" + std::to_string(bytes) + " bytes)";
+                });
+            }
+            while (driven.poll(std::chrono::milliseconds(100)) > 0) {}
+
+            // every file a few times over plus one that isn't there, never more than 4 at once
+            std::vector<std::unique_ptr<std::ostringstream>> sinks;
+            std::vector<tftp::Client::Fetch> batch;
+            for (int round = 0; round < 3; round++) {
+                for (size_t i = 0; i < sizes.size(); i++) {
+                    sinks.push_back(std::make_unique<std::ostringstream>(std::ios::binary));
+                    batch.emplace_back("file" + std::to_string(i), *sinks.back());
+                }
+            }
+            sinks.push_back(std::make_unique<std::ostringstream>(std::ios::binary));
+            batch.emplace_back("does_not_exist", *sinks.back());
+
+            size_t fetched = tftp::Client::recvMany(remote, batch, 4);
+            size_t batch_ok = 0;
+            for (size_t n = 0; n + 1 < batch.size(); n++) {
+                size_t i = n % sizes.size();
+                if (!batch[n].error && batch[n].bytes == static_cast<std::streamsize>(sizes[i]) && sinks[n]->str() == contents[i]) {
+                    batch_ok++;
+                    bytes_read += sizes[i];
+                    transfers++;
+                }
+            }
+            bool missing_reported = false;
+            try {
+                if (batch.back().error) std::rethrow_exception(batch.back().error);
+            } catch (const tftp::TftpError& e) {
+                missing_reported = e.getCode() == static_cast<int>(tftp::TftpError::ErrorCode::FileNotFound);
+            }
+            bool batch_passed = fetched == batch.size() - 1 && batch_ok == fetched && missing_reported;
+            std::cout << "recvMany: " << batch_ok << "/" << batch.size() - 1 << (missing_reported ? ", missing file reported" : ", missing file not reported") << std::endl;
+            if (!batch_passed) failures++;
+        });
+
+        for (size_t i = 1; i < sizes.size(); i++) {
+            std::string& result = async_uploads[i];
+            if (result == "ok") {
+                std::ifstream ifs(root / ("async_upload" + std::to_string(i)), std::ios::binary);
+                std::string stored((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+                if (stored != contents[i]) result = "content mismatch (" + std::to_string(stored.size()) + " bytes)";
+            }
+            fs::remove(root / ("async_upload" + std::to_string(i)));
+
+            std::cout << "async send upload" << i << " (" << sizes[i] << " bytes): " << result << std::endl;
+            if (result != "ok") failures++;
+            else {
+                bytes_written += sizes[i];
+                transfers++;
+            }
+        }
+    }
+
+    // resumed reads - data only gets the rest of the file, progress counts from the start of it
+    serve(root, [&](const std::string& remote) {
+        for (size_t offset : { static_cast<size_t>(300001), sizes[6] }) {
+            std::ostringstream oss(std::ios::binary);
+            size_t last_reported = 0;
+            std::string result;
+            try {
+                std::streamsize got = tftp::Client::recv(remote, "file6", oss, [&](tftp::Client::Progress& progress) {
+                    last_reported = progress.transferred_bytes;
+                }, std::chrono::milliseconds(1000), static_cast<std::streamsize>(offset));
+                result = oss.str() == contents[6].substr(offset) && got == static_cast<std::streamsize>(sizes[6] - offset) && last_reported == sizes[6] ? "ok" : "wrong data or progress";
+            } catch (const tftp::TftpError& e) {
+                std::ostringstream err;
+                err << e;
+                result = err.str();
+            }
+            std::cout << "resume file6 at " << offset << ": " << result << std::endl;
+            if (result != "ok") failures++;
+            else {
+                bytes_read += sizes[6] - offset;
+                transfers++;
+            }
+        }
+
+        // past the end is refused, not answered with an empty file
+        try {
+            std::ostringstream oss;
+            tftp::Client::recv(remote, "file6", oss, nullptr, std::chrono::milliseconds(1000), static_cast<std::streamsize>(sizes[6] + 1));
+            std::cout << "resume past end: no error" << std::endl;
+            failures++;
+        } catch (const tftp::TftpError& e) {
+            bool ok = e.getCode() == static_cast<int>(tftp::TftpError::ErrorCode::OptionNegotiation);
+            std::cout << "resume past end: " << (ok ? "ok" : "wrong error") << std::endl;
+            if (!ok) failures++;
+        }
+    });
+
+    // malformed requests are answered with an error, not taken apart half way
+    uint64_t raw_read_requests = 0;     // valid ones sent by hand, the client's metrics don't know them
+    serve(root, [&](const std::string& remote) {
+        struct sockaddr_in server_addr = {};
+        server_addr.sin_family = AF_INET;
+        server_addr.sin_port = htons(static_cast<uint16_t>(std::stoi(remote.substr(remote.find(':') + 1))));
+        inet_pton(AF_INET, "127.0.0.1", &server_addr.sin_addr);
+        tftp::socket_t sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+
+        const std::vector<std::pair<std::string, std::string>> requests = {
+            { "opcode", std::string("\0\x09" "file6\0octet\0", 14) },
+            { "no filename end", std::string("\0\x01" "file6", 7) },
+            { "no mode end", std::string("\0\x01" "file6\0octet", 13) },
+            { "option without value", std::string("\0\x01" "file6\0octet\0blksize\0", 22) },
+        };
+        for (const auto& request : requests) {
+            sendto(sockfd, request.second.data(), static_cast<int>(request.second.size()), 0, (struct sockaddr*)&server_addr, sizeof(server_addr));
+
+            uint8_t answer[64] = {};
+            bool answered = tftp::waitReadable(sockfd, std::chrono::steady_clock::now() + std::chrono::seconds(1)) && recv(sockfd, reinterpret_cast<char*>(answer), sizeof(answer), 0) >= 4;
+            bool ok = answered && answer[1] == static_cast<uint8_t>(tftp::TftpOpcode::Error) && answer[3] == static_cast<uint8_t>(tftp::TftpError::ErrorCode::IllegalOperation);
+            std::cout << "malformed request (" << request.first << "): " << (ok ? "ok" : "not rejected") << std::endl;
+            if (!ok) failures++;
+        }
+
+        // blksize below the RFC 2348 minimum isn't acknowledged - never answered with a bigger one than asked for
+        const std::string tiny("\0\x01" "file6\0octet\0blksize\0" "4\0", 24);
+        sendto(sockfd, tiny.data(), static_cast<int>(tiny.size()), 0, (struct sockaddr*)&server_addr, sizeof(server_addr));
+        raw_read_requests++;
+        uint8_t answer[600] = {};
+        struct sockaddr_in transfer_addr = {};
+        socklen_t transfer_addr_len = sizeof(transfer_addr);
+        int answer_len = tftp::waitReadable(sockfd, std::chrono::steady_clock::now() + std::chrono::seconds(1))
+            ? static_cast<int>(recvfrom(sockfd, reinterpret_cast<char*>(answer), sizeof(answer), 0, (struct sockaddr*)&transfer_addr, &transfer_addr_len)) : -1;
+        bool ok = answer_len == 516 && answer[1] == static_cast<uint8_t>(tftp::TftpOpcode::Data) && answer[3] == 1;
+        std::cout << "blksize 4 ignored: " << (ok ? "ok" : "not ignored") << std::endl;
+        if (!ok) failures++;
+        if (answer_len > 0) {
+            const std::string gone("\0\x05\0\0" "done\0", 9);
+            sendto(sockfd, gone.data(), static_cast<int>(gone.size()), 0, (struct sockaddr*)&transfer_addr, sizeof(transfer_addr));
+        }
+        clean_sockfd(sockfd);
+    });
+
+    // SO_REUSEPORT shards - clients are spread over four workers on the same port, each file asked for twice
+    tftp::Config::getInstance().setServerWorkers(4);
+    serve(root, [&](const std::string& remote) {
+        std::vector<std::thread> clients;
+        for (size_t i = 0; i < 2 * sizes.size(); i++) {
+            clients.emplace_back([&, i] { recvCheck(remote, i % sizes.size(), contents[i % sizes.size()], "sharded"); });
+        }
+        for (auto& t : clients) t.join();
+    });
+    tftp::Config::getInstance().setServerWorkers(1);
+
+    // rate limited - the big file takes as long as the limit says, small ones fetched meanwhile don't queue behind it
+    tftp::Config::getInstance().setRateLimit(8 << 20);
+    tftp::Config::getInstance().setClientRateLimit(16 << 20);
+    serve(root, [&](const std::string& remote) {
+        using clock = std::chrono::steady_clock;
+        auto started = clock::now();
+        clock::duration big_took, small_took;
+        std::thread big([&] {
+            recvCheck(remote, 6, contents[6], "rate limited");
+            big_took = clock::now() - started;
+        });
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));     // streaming by now
+        for (size_t i = 1; i < 6; i++) recvCheck(remote, i, contents[i], "next to a rate limited one");
+        small_took = clock::now() - started;
+        big.join();
+
+        // 1 MiB at 8 MiB/s is 125 ms, less what the bucket holds up front
+        bool paced = big_took >= std::chrono::milliseconds(100) && small_took < big_took;
+        std::cout << "rate limit: " << std::chrono::duration_cast<std::chrono::milliseconds>(big_took).count() << " ms, small files "
+                  << std::chrono::duration_cast<std::chrono::milliseconds>(small_took).count() << " ms: " << (paced ? "ok" : "not paced") << std::endl;
+        if (!paced) failures++;
+    });
+    tftp::Config::getInstance().setRateLimit(0);
+    tftp::Config::getInstance().setClientRateLimit(0);
+
+    // RFC 2348 maximum - anything bigger is clamped, and loopback's MTU carries it unfragmented
+    tftp::Config::getInstance().setBlockSize(65535);
+    if (tftp::Config::getInstance().getBlockSize() != tftp::Config::MaxBlockSize) {
+        std::cout << "blksize 65535 not clamped" << std::endl;
+        failures++;
+    }
+    std::string jumbo_result;
+    serve(root, [&](const std::string& remote) {
+        recvCheck(remote, 6, contents[6], "jumbo");
+        recvCheck(remote, 5, contents[5], "jumbo");
+
+        std::istringstream iss(contents[6], std::ios::binary);
+        try {
+            tftp::Client::send(remote, "upload_jumbo", iss);
+            jumbo_result = "ok";
+        } catch (const tftp::TftpError& e) {
+            std::ostringstream err;
+            err << e;
+            jumbo_result = err.str();
+        }
+    });
+    if (jumbo_result == "ok") {
+        std::ifstream ifs(root / "upload_jumbo", std::ios::binary);
+        std::string stored((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+        if (stored != contents[6]) jumbo_result = "content mismatch (" + std::to_string(stored.size()) + " bytes)";
+    }
+    std::cout << "send upload_jumbo (" << sizes[6] << " bytes): " << jumbo_result << std::endl;
+    if (jumbo_result != "ok") failures++;
+    else {
+        bytes_written += sizes[6];
+        transfers++;
+    }
+
+    // writer backlog smaller than one batch - concurrent uploads still drain, each hands its batch over when refused
+    const std::streamsize max_queue_size = tftp::Config::getInstance().getMaxQueueSize();
+    tftp::Config::getInstance().setMaxQueueSize(64 << 10);
+    serve(root, [&](const std::string& remote) {
+        std::vector<std::thread> uploads;
+        for (size_t i = 0; i < 3; i++) {
+            uploads.emplace_back([&, i] {
+                std::string name = "upload_small_queue" + std::to_string(i);
+                std::istringstream iss(contents[6], std::ios::binary);
+                std::string result;
+                try {
+                    tftp::Client::send(remote, name, iss);
+                    std::ifstream ifs(root / name, std::ios::binary);
+                    std::string stored((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+                    result = stored == contents[6] ? "ok" : "content mismatch (" + std::to_string(stored.size()) + " bytes)";
+                } catch (const tftp::TftpError& e) {
+                    std::ostringstream err;
+                    err << e;
+                    result = err.str();
+                }
+
+                std::lock_guard<std::mutex> lock(output_mutex);
+                std::cout << "send " << name << " (" << sizes[6] << " bytes, 64 KiB backlog): " << result << std::endl;
+                if (result != "ok") failures++;
+                else {
+                    bytes_written += sizes[6];
+                    transfers++;
+                }
+            });
+        }
+        for (auto& t : uploads) t.join();
+    });
+    tftp::Config::getInstance().setMaxQueueSize(max_queue_size);
+
+    // a tiny blksize is about DATA - requests asking for it are still read whole
+    tftp::Config::getInstance().setBlockSize(16);
+    serve(root, [&](const std::string& remote) { recvCheck(remote, 5, contents[5], "blksize 16"); });
+    tftp::Config::getInstance().setBlockSize(static_cast<uint16_t>(blksize));
+
+    // both sides counted the same transfers - everything ran in this process
+    using tftp::Metrics;
+    Metrics::Snapshot metrics = Metrics::getInstance().snapshot();
+    auto metricsCheck = [&](const std::string& what, uint64_t value, uint64_t expected) {
+        std::cout << "metrics " << what << ": " << value << (value == expected ? "" : " (expected " + std::to_string(expected) + ")") << std::endl;
+        if (value != expected) failures++;
+    };
+    metricsCheck("client bytes received", metrics.get(Metrics::Side::Client, Metrics::Counter::BytesReceived), bytes_read);
+    metricsCheck("client bytes sent", metrics.get(Metrics::Side::Client, Metrics::Counter::BytesSent), bytes_written);
+    metricsCheck("server bytes received", metrics.get(Metrics::Side::Server, Metrics::Counter::BytesReceived), bytes_written);
+    metricsCheck("server read requests", metrics.get(Metrics::Side::Server, Metrics::Counter::ReadRequests), metrics.get(Metrics::Side::Client, Metrics::Counter::ReadRequests) + raw_read_requests);
+    metricsCheck("server write requests", metrics.get(Metrics::Side::Server, Metrics::Counter::WriteRequests), metrics.get(Metrics::Side::Client, Metrics::Counter::WriteRequests));
+    metricsCheck("client transfer times", metrics.get(Metrics::Side::Client, Metrics::Histogram::TransferTime).count, transfers);
+    const size_t client = static_cast<size_t>(Metrics::Side::Client), server = static_cast<size_t>(Metrics::Side::Server);
+    const size_t not_found = static_cast<size_t>(tftp::TftpError::ErrorCode::FileNotFound);
+    metricsCheck("file not found errors", metrics.errors_received[client][not_found], metrics.errors_sent[server][not_found]);
+
+    std::string exported = metrics.toPrometheus();
+    std::string line = "tftp_read_requests_total{side=\"server\"} " + std::to_string(metrics.get(Metrics::Side::Server, Metrics::Counter::ReadRequests)) + "\n";
+    metricsCheck("exported read requests", exported.find(line) != std::string::npos, 1);
+
+    fs::remove_all(root);
+
+    if (failures != 0) {
+        std::cerr << failures << " check(s) failed" << std::endl;
+        return 1;
+    }
+    std::cout << "Success!" << std::endl;
+    return 0;
+}
@@ -43,12 +43,14 @@ int main(void) {
 		goto cleanup;
 	}
 
+	{
 #ifdef _WIN32
 	const DWORD timeout = TIMEOUT_SECS * 1000;
 #else
 	const struct timeval timeout = { TIMEOUT_SECS, 0 };
 #endif
 	setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout));
+	}
 
 	std::cout << "Server started, listening on port 6969" << std::endl;
 	